@@ -0,0 +1,501 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* boxscale.c - shrink images by averaging areas */
+
+/* Each destination pixel is the average of the source area it covers, with
+ * partly-covered source pixels weighted by how much is covered (in 1/256ths).
+ * This is what GDK_INTERP_BILINEAR does when shrinking, but doing only that
+ * lets us be quicker about it.
+ *
+ * For each destination row, the covered source rows are added up (weighted)
+ * into one row of 32-bit sums. This is most of the work, and is the same for
+ * every byte whatever the pixel format, so it has SSE2 and AVX2 versions
+ * (chosen when first needed, according to the CPU). Then each destination
+ * pixel is made from the sums for the columns it covers.
+ *
+ * With an alpha channel, the colours are premultiplied first, so that
+ * transparent pixels don't darken their neighbours.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+
+#include "boxscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define USE_X86_KERNELS
+# include <immintrin.h>
+#endif
+
+/* So that a column of sums can't overflow 32 bits */
+#define MAX_SCALE 32768
+
+typedef void (*AccumulateFn)(guint32 *acc, const guchar *row, int n,
+			     guint weight);
+
+static AccumulateFn accumulate_row = NULL;
+
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* acc[i] += row[i] * weight, for i < n. weight is at most 256. */
+static void accumulate_scalar(guint32 *acc, const guchar *row, int n,
+			      guint weight)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] += row[i] * weight;
+}
+
+#ifdef USE_X86_KERNELS
+/* 255 * 256 fits in an unsigned 16 bits, so the low half of a 16-bit
+ * multiply is the whole product.
+ */
+__attribute__((target("sse2")))
+static void accumulate_sse2(guint32 *acc, const guchar *row, int n,
+			    guint weight)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i w = _mm_set1_epi16(weight);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		__m128i b = _mm_loadu_si128((const __m128i *) (row + i));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w);
+		__m128i *a = (__m128i *) (acc + i);
+
+		_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+					_mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+					_mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2),
+					_mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3),
+					_mm_unpackhi_epi16(hi, zero)));
+	}
+
+	accumulate_scalar(acc + i, row + i, n - i, weight);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(guint32 *acc, const guchar *row, int n,
+			    guint weight)
+{
+	__m256i w = _mm256_set1_epi16(weight);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		__m256i v = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *) (row + i))), w);
+		__m256i *a = (__m256i *) (acc + i);
+
+		_mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a),
+			_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v))));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi32(
+			_mm256_loadu_si256(a + 1),
+			_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1))));
+	}
+
+	accumulate_scalar(acc + i, row + i, n - i, weight);
+}
+#endif
+
+static AccumulateFn best_kernel(void)
+{
+#ifdef USE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return accumulate_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return accumulate_sse2;
+#endif
+	return accumulate_scalar;
+}
+
+static void pick_kernel(void)
+{
+	static gsize done = 0;
+
+	if (g_once_init_enter(&done))
+	{
+		accumulate_row = best_kernel();
+		g_once_init_leave(&done, 1);
+	}
+}
+
+/* Where each of the 'dest' rows or columns starts, in 1/256ths of a source
+ * pixel. Dest pixel i covers [edge[i], edge[i + 1]).
+ */
+static int *make_edges(int src, int dest)
+{
+	int *edge = g_new(int, dest + 1);
+	int i;
+
+	for (i = 0; i <= dest; i++)
+		edge[i] = ((gint64) i * src * 256 + dest / 2) / dest;
+
+	return edge;
+}
+
+/* How much of source pixel 's' is in [start, end) */
+static guint coverage(int s, int start, int end)
+{
+	int lo = MAX(s * 256, start);
+	int hi = MIN(s * 256 + 256, end);
+
+	return hi > lo ? hi - lo : 0;
+}
+
+/* Premultiply one row of RGBA pixels into 'out' */
+static void premultiply(guchar *out, const guchar *in, int width)
+{
+	int x;
+
+	for (x = 0; x < width; x++, in += 4, out += 4)
+	{
+		guint a = in[3];
+
+		out[0] = (in[0] * a + 127) / 255;
+		out[1] = (in[1] * a + 127) / 255;
+		out[2] = (in[2] * a + 127) / 255;
+		out[3] = a;
+	}
+}
+
+/* Make one destination row from the column sums in 'acc', which add up
+ * 'area_y' (in 1/256ths) of source rows.
+ */
+static void reduce_row(guchar *out, const guint32 *acc, int dest_w,
+		       const int *xedge, int n_channels, gboolean alpha,
+		       guint area_y)
+{
+	guint64 sum[4];
+	int x, c, s;
+
+	for (x = 0; x < dest_w; x++, out += n_channels)
+	{
+		int start = xedge[x], end = xedge[x + 1];
+		guint64 area = (guint64) (end - start) * area_y;
+
+		memset(sum, 0, sizeof(sum));
+		for (s = start / 256; s * 256 < end; s++)
+		{
+			guint w = coverage(s, start, end);
+			const guint32 *p = acc + s * n_channels;
+
+			for (c = 0; c < n_channels; c++)
+				sum[c] += (guint64) p[c] * w;
+		}
+
+		if (!alpha)
+		{
+			for (c = 0; c < n_channels; c++)
+				out[c] = (sum[c] + area / 2) / area;
+			continue;
+		}
+
+		out[3] = (sum[3] + area / 2) / area;
+		for (c = 0; c < 3; c++)
+			out[c] = sum[3] ? MIN(255, (sum[c] * 255 + sum[3] / 2)
+						/ sum[3]) : 0;
+	}
+}
+
+static GdkPixbuf *box_scale(GdkPixbuf *src, int dest_w, int dest_h,
+			    AccumulateFn accumulate)
+{
+	int src_w = gdk_pixbuf_get_width(src);
+	int src_h = gdk_pixbuf_get_height(src);
+	int n_channels = gdk_pixbuf_get_n_channels(src);
+	gboolean alpha = gdk_pixbuf_get_has_alpha(src);
+	int src_stride = gdk_pixbuf_get_rowstride(src);
+	const guchar *src_pixels = gdk_pixbuf_get_pixels(src);
+	int row_bytes = src_w * n_channels;
+	GdkPixbuf *dest;
+	guchar *dest_pixels, *premul = NULL;
+	guint32 *acc;
+	int *xedge, *yedge;
+	int dest_stride, y, s;
+
+	dest = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, 8, dest_w, dest_h);
+	if (!dest)
+		return NULL;
+	dest_pixels = gdk_pixbuf_get_pixels(dest);
+	dest_stride = gdk_pixbuf_get_rowstride(dest);
+
+	xedge = make_edges(src_w, dest_w);
+	yedge = make_edges(src_h, dest_h);
+	acc = g_new(guint32, row_bytes);
+	if (alpha)
+		premul = g_new(guchar, row_bytes);
+
+	for (y = 0; y < dest_h; y++)
+	{
+		int start = yedge[y], end = yedge[y + 1];
+
+		memset(acc, 0, row_bytes * sizeof(guint32));
+		for (s = start / 256; s * 256 < end; s++)
+		{
+			const guchar *row = src_pixels + s * src_stride;
+
+			if (alpha)
+			{
+				premultiply(premul, row, src_w);
+				row = premul;
+			}
+			accumulate(acc, row, row_bytes,
+					coverage(s, start, end));
+		}
+
+		reduce_row(dest_pixels + y * dest_stride, acc, dest_w,
+				xedge, n_channels, alpha, end - start);
+	}
+
+	g_free(premul);
+	g_free(acc);
+	g_free(yedge);
+	g_free(xedge);
+
+	return dest;
+}
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* Shrink 'src' to dest_w x dest_h by averaging. NULL if it's a kind of
+ * pixbuf we don't handle (not 8-bit RGB or RGBA), or it would grow.
+ */
+GdkPixbuf *boxscale_pixbuf(GdkPixbuf *src, int dest_w, int dest_h)
+{
+	int src_w = gdk_pixbuf_get_width(src);
+	int src_h = gdk_pixbuf_get_height(src);
+	int n_channels = gdk_pixbuf_get_n_channels(src);
+
+	if (gdk_pixbuf_get_colorspace(src) != GDK_COLORSPACE_RGB ||
+			gdk_pixbuf_get_bits_per_sample(src) != 8 ||
+			n_channels != (gdk_pixbuf_get_has_alpha(src) ? 4 : 3) ||
+			dest_w < 1 || dest_h < 1 ||
+			dest_w > src_w || dest_h > src_h ||
+			src_h / dest_h >= MAX_SCALE ||
+			src_w >= G_MAXINT / 256)
+		return NULL;
+
+	pick_kernel();
+
+	return box_scale(src, dest_w, dest_h, accumulate_row);
+}
+
+#ifdef UNIT_TESTS
+/* A test picture: gradients, a sharp-edged grid and (if 'alpha') a
+ * transparent region with a colour that should not leak out of it.
+ */
+static GdkPixbuf *test_image(int w, int h, gboolean alpha)
+{
+	GdkPixbuf *image = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, 8, w, h);
+	int n = gdk_pixbuf_get_n_channels(image);
+	int x, y;
+
+	for (y = 0; y < h; y++)
+	{
+		guchar *p = gdk_pixbuf_get_pixels(image) +
+			y * gdk_pixbuf_get_rowstride(image);
+
+		for (x = 0; x < w; x++, p += n)
+		{
+			p[0] = x * 255 / w;
+			p[1] = y * 255 / h;
+			p[2] = ((x / 37 + y / 53) & 1) ? 220 : 30;
+			if (alpha)
+				p[3] = x < w / 3 ? 0 : 255;
+			if (alpha && x < w / 3)
+				p[0] = p[1] = p[2] = 255;
+		}
+	}
+
+	return image;
+}
+
+/* Largest and mean difference between two pixbufs of the same size.
+ * Colours of fully transparent pixels don't count.
+ */
+static void pixel_diff(GdkPixbuf *a, GdkPixbuf *b, int *max, double *mean)
+{
+	int w = gdk_pixbuf_get_width(a), h = gdk_pixbuf_get_height(a);
+	int n = gdk_pixbuf_get_n_channels(a);
+	gboolean alpha = gdk_pixbuf_get_has_alpha(a);
+	gint64 total = 0, count = 0;
+	int x, y, c;
+
+	*max = 0;
+	for (y = 0; y < h; y++)
+	{
+		const guchar *pa = gdk_pixbuf_get_pixels(a) +
+			y * gdk_pixbuf_get_rowstride(a);
+		const guchar *pb = gdk_pixbuf_get_pixels(b) +
+			y * gdk_pixbuf_get_rowstride(b);
+
+		for (x = 0; x < w; x++, pa += n, pb += n)
+		{
+			for (c = 0; c < n; c++)
+			{
+				int d = ABS(pa[c] - pb[c]);
+
+				if (alpha && c < 3 && pa[3] == 0 && pb[3] == 0)
+					continue;
+				*max = MAX(*max, d);
+				total += d;
+				count++;
+			}
+		}
+	}
+	*mean = count ? (double) total / count : 0;
+}
+
+static const struct {
+	const char	*name;
+	AccumulateFn	fn;
+} kernels[] = {
+	{"scalar", accumulate_scalar},
+#ifdef USE_X86_KERNELS
+	{"sse2", accumulate_sse2},
+	{"avx2", accumulate_avx2},
+#endif
+};
+
+static gboolean kernel_usable(int k)
+{
+#ifdef USE_X86_KERNELS
+	__builtin_cpu_init();
+	if (kernels[k].fn == accumulate_sse2)
+		return __builtin_cpu_supports("sse2");
+	if (kernels[k].fn == accumulate_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return TRUE;
+}
+
+/* Every kernel must give exactly the same pixels, and they must be close to
+ * what gdk_pixbuf_scale_simple() gives.
+ */
+static void boxscale_diff_tests(void)
+{
+	static const int sizes[][4] = {
+		{640, 480, 128, 96}, {1001, 333, 97, 32}, {300, 3000, 12, 128},
+		{256, 192, 128, 96}, {301, 203, 150, 101},	/* About 2x */
+	};
+	int i, k, alpha;
+
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+	for (alpha = 0; alpha < 2; alpha++)
+	{
+		GdkPixbuf *src = test_image(sizes[i][0], sizes[i][1], alpha);
+		int dw = sizes[i][2], dh = sizes[i][3];
+		GdkPixbuf *want = gdk_pixbuf_scale_simple(src, dw, dh,
+				GDK_INTERP_BILINEAR);
+		GdkPixbuf *ref = box_scale(src, dw, dh, accumulate_scalar);
+		int max;
+		double mean;
+
+		for (k = 1; k < G_N_ELEMENTS(kernels); k++)
+		{
+			GdkPixbuf *got;
+
+			if (!kernel_usable(k))
+				continue;
+			got = box_scale(src, dw, dh, kernels[k].fn);
+			pixel_diff(ref, got, &max, &mean);
+			if (max != 0)
+				g_error("boxscale: %s kernel differs from "
+					"scalar by up to %d", kernels[k].name,
+					max);
+			g_object_unref(got);
+		}
+
+		pixel_diff(want, ref, &max, &mean);
+		if (mean > 1.0 || max > 16)
+			g_error("boxscale: %dx%d%s -> %dx%d differs from "
+				"gdk-pixbuf by %.2f (max %d)",
+				sizes[i][0], sizes[i][1], alpha ? " RGBA" : "",
+				dw, dh, mean, max);
+
+		g_object_unref(ref);
+		g_object_unref(want);
+		g_object_unref(src);
+	}
+}
+
+/* Shrink a 4000x3000 picture to 128x96 $ROX_BOXSCALE_BENCH times with each
+ * kernel, and with gdk_pixbuf_scale_simple(), and print the times.
+ */
+static void boxscale_bench(void)
+{
+	const char *count = g_getenv("ROX_BOXSCALE_BENCH");
+	int n = count ? atoi(count) : 0;
+	GdkPixbuf *src;
+	GTimer *timer;
+	int i, k;
+
+	if (n <= 0)
+		return;
+
+	src = test_image(4000, 3000, FALSE);
+	timer = g_timer_new();
+
+	for (k = 0; k <= G_N_ELEMENTS(kernels); k++)
+	{
+		if (k < G_N_ELEMENTS(kernels) && !kernel_usable(k))
+			continue;
+
+		g_timer_start(timer);
+		for (i = 0; i < n; i++)
+			g_object_unref(k < G_N_ELEMENTS(kernels)
+				? box_scale(src, 128, 96, kernels[k].fn)
+				: gdk_pixbuf_scale_simple(src, 128, 96,
+					GDK_INTERP_BILINEAR));
+		g_timer_stop(timer);
+
+		g_print("boxscale: %s: %.2fms per 4000x3000 -> 128x96\n",
+			k < G_N_ELEMENTS(kernels) ? kernels[k].name
+				: "gdk-pixbuf",
+			g_timer_elapsed(timer, NULL) * 1000 / n);
+	}
+
+	g_timer_destroy(timer);
+	g_object_unref(src);
+}
+
+void boxscale_tests(void)
+{
+	boxscale_diff_tests();
+	boxscale_bench();
+}
+#endif
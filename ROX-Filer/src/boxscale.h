@@ -0,0 +1,16 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Thomas Leonard, <tal197@users.sourceforge.net>
+ */
+
+
+#ifndef _BOXSCALE_H
+#define _BOXSCALE_H
+
+GdkPixbuf *boxscale_pixbuf(GdkPixbuf *src, int dest_w, int dest_h);
+
+#ifdef UNIT_TESTS
+void boxscale_tests(void);
+#endif
+
+#endif /* _BOXSCALE_H */
@@ -208,6 +208,9 @@ static DisplayStyle get_style(GtkCellRenderer *cell)
 						make_path(filer_window->real_path, item->leafname));
 				view_item->thumb = pixmap_load_thumb(path);
 				g_free(path);
+				if (view_item->thumb)
+					view_details_thumb_loaded(
+						icon->view_details);
 			}
 		}
 		else
@@ -337,6 +340,9 @@ static void cell_icon_render(GtkCellRenderer    *cell,
 	if (!image && !sendi)
 		return;
 
+	if (sendi)
+		view_item->thumb_used = g_get_monotonic_time();
+
 	color = &widget->style->base[fw->selection_state];
 
 	/* Draw the icon */
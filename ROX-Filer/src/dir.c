@@ -31,16 +31,23 @@
  * When a whole directory is to be rescanned:
  *
  * - A list of all filenames in the directory is fetched, without any
- *   of the extra details.
- * - This list is compared to the current DirItems, removing any that are now
- *   missing.
- * - Each window onto the directory is asked which items it will actually
- *   display, and the union of these sets is the new recheck list.
+ *   of the extra details. This is done in a background thread, which hands
+ *   the names to the main loop in batches (small at first, so that the
+ *   first screenful appears quickly, then larger).
+ * - Each batch is added to the Directory straight away, and each window onto
+ *   the directory is asked which items it will actually display. The union
+ *   of these sets is added to the recheck list.
+ * - When the list is complete, it is compared to the current DirItems,
+ *   removing any that are now missing.
  *
  * This system is designed to get the number of items and their names quickly,
  * so that the auto-sizer can make a good guess. It also prevents checking
  * hidden files if they're not going to be displayed.
  *
+ * While someone is attached, a GFileMonitor watches the directory. Changes
+ * to individual entries just recheck those entries; only events on the
+ * directory itself (or a flood of changes) cause a whole rescan.
+ *
  * To get the Directory object, use dir_cache, which will automatically
  * trigger a rescan if needed.
  *
@@ -69,6 +76,7 @@
 #include "type.h"
 #include "main.h"
 #include "options.h"
+#include "dirsnap.h"
 
 /* For debugging. Can't detach when this is non-zero. */
 static int in_callback = 0;
@@ -76,26 +84,68 @@ static int in_callback = 0;
 GFSCache *dir_cache = NULL;
 
 static Option o_purge_dir_cache;
+static Option o_dir_cache_budget;
 static Option o_close_dir_when_missing;
+static Option o_restat_workers;
+static Option o_dir_snapshots;
+
+/* Only directories with at least this many items get snapshots */
+#define SNAPSHOT_MIN_ITEMS 500
+
+/* scan_thread() starts another worker for each RESTAT_BACKLOG items waiting
+ * to be restatted, up to the 'restat_workers' option (0 for one per CPU).
+ */
+#define MAX_RESTAT_WORKERS 32
+#define RESTAT_BACKLOG 256
 
 /* Static prototypes */
 static void fsupdate(Directory *dir, gchar *pathname, gpointer data);
 static void call_scan_t(Directory *dir);
+static DirItem *item_restatted(Directory *dir, DirItem *item,
+		DirItem *old, gboolean do_compare, gboolean examine_now);
 static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafname, gboolean examine_now);
 static DirItem *insert_item(Directory *dir, const guchar *leafname, gboolean examine_now);
 static GPtrArray *hash_to_array(GHashTable *hash);
 static void dir_force_update_item(Directory *dir,
 		const gchar *leaf, gboolean thumb);
 static void dir_scan(Directory *dir);
+static gboolean stop_read_t(Directory *dir);
+static void load_snapshot(Directory *dir);
+static void save_snapshot(Directory *dir);
+static gsize dir_cost(gpointer object, gpointer data);
+static void dir_options_changed(void);
 
 
 void dir_init(void)
 {
 	option_add_int(&o_purge_dir_cache, "purge_dir_cache", FALSE);
 	option_add_int(&o_close_dir_when_missing, "close_dir_when_missing", FALSE);
+	option_add_int(&o_restat_workers, "restat_workers", 0);
+	option_add_int(&o_dir_snapshots, "dir_snapshots", TRUE);
+	option_add_int(&o_dir_cache_budget, "dir_cache_budget", 64);
+	option_add_notify(dir_options_changed);
 
 	dir_cache = g_fscache_new((GFSLoadFunc) dir_new,
 				(GFSUpdateFunc) fsupdate, NULL);
+	g_fscache_set_budget(dir_cache, dir_cost,
+			(gsize) o_dir_cache_budget.int_value << 20);
+}
+
+/* Roughly how much memory a Directory in dir_cache is using */
+static gsize dir_cost(gpointer object, gpointer data)
+{
+	Directory *dir = (Directory *) object;
+
+	/* The DirItems, their names and collate keys, and the hash entry */
+	return sizeof(Directory) +
+		g_hash_table_size(dir->known_items) * (sizeof(DirItem) + 64);
+}
+
+static void dir_options_changed(void)
+{
+	if (o_dir_cache_budget.has_changed)
+		g_fscache_set_budget(dir_cache, dir_cost,
+			(gsize) o_dir_cache_budget.int_value << 20);
 }
 
 
@@ -115,15 +165,117 @@ static gint rescan_timeout_cb(gpointer data)
 static void rescan_soon(Directory *dir)
 {
 	dir->needs_update = TRUE;
+	g_hash_table_remove_all(dir->changed_leaves);	/* Rescan covers them */
 	if (dir->rescan_timeout != -1) return;
 	dir->rescan_timeout = g_timeout_add(300, rescan_timeout_cb, dir);
 }
+
+/* If more than this many files change before we get to them, we give up
+ * and rescan the whole directory instead. GFileMonitor doesn't tell us
+ * when the kernel's event queue overflows, so this serves the same purpose.
+ */
+#define MAX_CHANGED_LEAVES 1000
+
+static gint changed_leaves_cb(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+	GHashTableIter iter;
+	gpointer leaf;
+
+	dir->changed_timeout = -1;
+
+	if (!dir->users)
+	{
+		/* Nobody saw the changes; catch up on the next attach */
+		g_hash_table_remove_all(dir->changed_leaves);
+		dir->needs_update = TRUE;
+		return FALSE;
+	}
+
+	time(&diritem_recent_time);
+
+	g_hash_table_iter_init(&iter, dir->changed_leaves);
+	while (g_hash_table_iter_next(&iter, &leaf, NULL))
+		insert_item(dir, leaf, TRUE);
+	g_hash_table_remove_all(dir->changed_leaves);
+
+	dir_merge_new(dir);
+
+	return FALSE;
+}
+
+/* Queue the leaf of 'file' to be restatted soon.
+ * Returns FALSE if 'file' isn't an entry in this directory (e.g. it's the
+ * directory itself), or if too many changes are queued already.
+ */
+static gboolean changed_leaf_soon(Directory *dir, GFile *file)
+{
+	gchar *path = g_file_get_path(file);
+	if (!path)
+		return FALSE;
+
+	gchar *dirname = g_path_get_dirname(path);
+	gboolean child = strcmp(dirname, dir->pathname) == 0;
+	g_free(dirname);
+
+	if (!child ||
+		g_hash_table_size(dir->changed_leaves) >= MAX_CHANGED_LEAVES)
+	{
+		g_free(path);
+		return FALSE;
+	}
+
+	g_hash_table_add(dir->changed_leaves, g_path_get_basename(path));
+	g_free(path);
+
+	if (dir->changed_timeout == -1)
+		dir->changed_timeout = g_timeout_add(300, changed_leaves_cb, dir);
+
+	return TRUE;
+}
+
+/* Stop the fscache reusing an earlier stat() of 'file' */
+static void forget_stat(GFile *file)
+{
+	gchar *path = g_file_get_path(file);
+
+	if (path)
+		g_fscache_forget_stat(path);
+	g_free(path);
+}
+
 static void monitorcb(GFileMonitor *m, GFile *f,
 		GFile *o, GFileMonitorEvent e, Directory *dir)
 {
-	//don't rescan untile G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
-	if (e != G_FILE_MONITOR_EVENT_CHANGED)
-		rescan_soon(dir);
+	forget_stat(f);
+	if (o)
+		forget_stat(o);
+
+	switch (e)
+	{
+		case G_FILE_MONITOR_EVENT_CHANGED:
+			//don't recheck until G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
+			return;
+		case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+		case G_FILE_MONITOR_EVENT_DELETED:
+		case G_FILE_MONITOR_EVENT_CREATED:
+		case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+		case G_FILE_MONITOR_EVENT_MOVED:
+			/* Just recheck the items concerned, unless a rescan
+			 * is coming anyway.
+			 */
+			if (dir->needs_update && dir->rescan_timeout != -1)
+				return;
+			if (changed_leaf_soon(dir, f) &&
+					(!o || changed_leaf_soon(dir, o)))
+				return;
+			break;
+		default:
+			/* (Un)mounts, etc */
+			break;
+	}
+
+	rescan_soon(dir);
 }
 
 /* Periodically calls callback to notify about changes to the contents
@@ -226,6 +378,8 @@ void dir_detach(Directory *dir, DirCallback callback, gpointer data)
 			g_object_unref(dir);
 
 			/* May stop scanning if noone's watching */
+			if (!dir->users && stop_read_t(dir))
+				dir->needs_update = TRUE; /* Listing is incomplete */
 			call_scan_t(dir);
 
 			if (!dir->users)
@@ -235,6 +389,9 @@ void dir_detach(Directory *dir, DirCallback callback, gpointer data)
 				if (o_purge_dir_cache.int_value)
 					//don't remove when detach and attach are called in a func
 					g_idle_add((GSourceFunc)delayed_remove, g_strdup(dir->pathname));
+				else
+					/* It may be droppable now */
+					g_fscache_trim_soon(dir_cache);
 			}
 			return;
 		}
@@ -338,6 +495,71 @@ void dir_queue_recheck(Directory *dir, DirItem *item)
 	}
 }
 
+/* Move the entries in list[start..] that appear in 'rank' to the front of
+ * that part, in rank order. Other entries keep their relative order.
+ */
+static void list_prioritise(GPtrArray *list, int start,
+			    GHashTable *rank, int n)
+{
+	gpointer *front;
+	int i, j = list->len;
+
+	if (start >= list->len)
+		return;
+
+	front = g_new0(gpointer, n);
+
+	/* Pack the unranked entries at the end, working backwards */
+	for (i = list->len - 1; i >= start; i--)
+	{
+		gpointer item = list->pdata[i];
+		int r = GPOINTER_TO_INT(g_hash_table_lookup(rank, item));
+
+		if (r && !front[r - 1])
+			front[r - 1] = item;
+		else
+			list->pdata[--j] = item;
+	}
+
+	for (i = 0; i < n; i++)
+		if (front[i])
+			list->pdata[start++] = front[i];
+
+	g_free(front);
+}
+
+/* 'items' are the DirItems a view is showing (or about to), most urgent
+ * first (see view_visible_items()). Make sure any of them still waiting
+ * to be restatted or examined get done before the rest.
+ * The items are only compared as pointers, so stale ones are harmless.
+ */
+void dir_recheck_first(Directory *dir, GPtrArray *items)
+{
+	GHashTable *rank;
+	int i;
+
+	if (!items->len)
+		return;
+
+	g_mutex_lock(&dir->mutex);
+	if (dir->recheck_list->len <= dir->rechecki &&
+			dir->examine_list->len <= dir->examinei)
+	{
+		g_mutex_unlock(&dir->mutex);
+		return;		/* Nothing waiting */
+	}
+
+	rank = g_hash_table_new(NULL, NULL);
+	for (i = items->len - 1; i >= 0; i--)
+		g_hash_table_insert(rank, items->pdata[i], GINT_TO_POINTER(i + 1));
+
+	list_prioritise(dir->recheck_list, dir->rechecki, rank, items->len);
+	list_prioritise(dir->examine_list, dir->examinei, rank, items->len);
+	g_mutex_unlock(&dir->mutex);
+
+	g_hash_table_destroy(rank);
+}
+
 static void tousers(Directory *dir, DirAction action, GPtrArray *items)
 {
 	in_callback++;
@@ -355,9 +577,16 @@ static void dir_set_scanning(Directory *dir, gboolean scanning)
 	if (scanning == dir->scanning)
 		return;
 
+	/* Still reading the directory; read_done() will clear it */
+	if (!scanning && dir->readjob)
+		return;
+
 	dir->scanning = scanning;
 	tousers(dir, scanning ? DIR_START_SCAN : DIR_END_SCAN, NULL);
 
+	if (!scanning)
+		save_snapshot(dir);
+
 #if 0
 	/* Useful for profiling */
 	if (!scanning)
@@ -386,16 +615,17 @@ static void stop_scan_t(Directory *dir)
 
 static void stop_scan(gpointer key, gpointer data, gpointer user_data)
 {
-	GFSCacheData *fsdata = (GFSCacheData *) data;
-	Directory *dir = (Directory *) fsdata->data;
+	Directory *dir = (Directory *) data;
 
+	if (stop_read_t(dir))
+		dir->needs_update = TRUE;
 	stop_scan_t(dir);
 	dir_set_scanning(dir, FALSE);
 }
 
 void dir_stop(void)
 {
-	g_hash_table_foreach(dir_cache->inode_to_stats, stop_scan, NULL);
+	g_fscache_foreach(dir_cache, stop_scan, NULL);
 }
 
 static const guchar *make_path_to_buf(GString *buffer, const char *dir, const char *leaf)
@@ -442,42 +672,95 @@ static void delayed_notify(Directory *dir, gboolean mainthread)
 	dir->notify_active = g_timeout_add(dir->notify_time, notify_timeout, dir);
 }
 
-/* This is called in the background when there are items on the
- * dir->recheck_list to process.
+/* With dir->mutex held. Once the recheck_list has been emptied and no
+ * worker still has an item out, the scan can be reported as finished.
  */
-static gboolean do_recheck(gpointer data)
+static void scan_off_if_done(Directory *dir)
 {
-	Directory *dir = (Directory *) data;
+	if (dir->scan_off_due && !dir->in_flight &&
+			dir->recheck_list->len <= dir->rechecki)
+	{
+		dir->scan_off_due = FALSE;
+		dir->req_scan_off = TRUE;
+	}
+}
 
+/* This is called in the background when there are items on the
+ * dir->recheck_list to process. There may be several restat workers
+ * calling it at once (see scan_thread()), so the restat and examine
+ * themselves are done without holding dir->mutex. If the main thread
+ * restats the item meanwhile (see insert_item()), the result is thrown
+ * away. 'buf' is the caller's own path buffer.
+ */
+static gboolean do_recheck(Directory *dir, GString *buf)
+{
 	g_return_val_if_fail(dir != NULL, FALSE);
 
+	g_mutex_lock(&dir->mutex);
+
 	if (dir->recheck_list->len > dir->rechecki)
 	{
-		g_mutex_lock(&dir->mutex);
 		DirItem *item = dir->recheck_list->pdata[dir->rechecki];
 		                dir->recheck_list->pdata[dir->rechecki++] = NULL;
 
+		if (dir->recheck_list->len == dir->rechecki)
+		{
+			dir->rechecki = 0;
+			g_ptr_array_free(dir->recheck_list, TRUE);
+			dir->recheck_list = g_ptr_array_new();
+			dir->scan_off_due = TRUE;
+		}
+
 		if (item->flags & ITEM_FLAG_GONE)
 			diritem_free(item);
 		else
 		{
+			/* ITEM_FLAG_IN_RESCAN_QUEUE stays set until we're done,
+			 * so the item isn't freed under us (see gone_free()).
+			 */
+			const guchar *path = make_path_to_buf(buf,
+					dir->pathname, item->leafname);
+			gboolean do_compare = item->base_type != TYPE_UNKNOWN;
+			gboolean fresh;
+			DirItem old = *item, new;
+
+			dir->in_flight++;
+			g_mutex_unlock(&dir->mutex);
+			diritem_restat_get(dir->scan_fd, path, item, &new,
+					&dir->stat_info);
+			g_mutex_lock(&dir->mutex);
+			dir->in_flight--;
+
 			item->flags &= ~ITEM_FLAG_IN_RESCAN_QUEUE;
-			item = _insert_item(dir, item, item->leafname, FALSE);
-			if (item && item->flags & ITEM_FLAG_NEED_EXAMINE
-					&& !(item->flags & ITEM_FLAG_IN_EXAMINE))
+			old.flags &= ~ITEM_FLAG_IN_RESCAN_QUEUE;
+
+			/* If insert_item() restatted it meanwhile, ours may
+			 * be the older result.
+			 */
+			fresh = item->restats == old.restats;
+			if (fresh)
+				diritem_restat_set(item, &new);
+			else
+				diritem_restat_discard(&new);
+
+			if (item->flags & ITEM_FLAG_GONE)
+				diritem_free(item);
+			else if (fresh && g_hash_table_lookup(dir->known_items,
+						item->leafname) == item)
 			{
-				g_ptr_array_add(dir->examine_list, item);
-				item->flags |= ITEM_FLAG_IN_EXAMINE;
+				item = item_restatted(dir, item, &old, do_compare,
+						FALSE);
+				if (item && item->flags & ITEM_FLAG_NEED_EXAMINE
+						&& !(item->flags & ITEM_FLAG_IN_EXAMINE))
+				{
+					g_ptr_array_add(dir->examine_list, item);
+					item->flags |= ITEM_FLAG_IN_EXAMINE;
+				}
 			}
-		}
-		if (dir->recheck_list->len == dir->rechecki)
-		{
-			dir->rechecki = 0;
-			g_ptr_array_free(dir->recheck_list, TRUE);
-			dir->recheck_list = g_ptr_array_new();
-			dir->req_scan_off = TRUE;
+			/* (else it was removed meanwhile; gone_free() frees it) */
 		}
 
+		scan_off_if_done(dir);
 		g_mutex_unlock(&dir->mutex);
 		g_thread_yield();
 
@@ -486,17 +769,51 @@ static gboolean do_recheck(gpointer data)
 
 	if (dir->examine_list->len > dir->examinei)
 	{
-		g_mutex_lock(&dir->mutex);
 		DirItem *item = dir->examine_list->pdata[dir->examinei];
 		                dir->examine_list->pdata[dir->examinei++] = NULL;
 		item->flags &= ~ITEM_FLAG_IN_EXAMINE;
 
+		if (dir->examine_list->len == dir->examinei)
+		{
+			dir->examinei = 0;
+			g_ptr_array_free(dir->examine_list, TRUE);
+			dir->examine_list = g_ptr_array_new();
+		}
+
 		if (item->flags & ITEM_FLAG_GONE)
 			diritem_free(item);
 		else if (item->flags & ITEM_FLAG_NEED_EXAMINE)
 		{
-			if (diritem_examine_dir(
-						make_path_to_buf(dir->strbuf, dir->pathname, item->leafname), item))
+			const guchar *path = make_path_to_buf(buf,
+					dir->pathname, item->leafname);
+			guint restats = item->restats;
+			DirItem new;
+
+			/* Kept set meanwhile, as for restatting above */
+			item->flags |= ITEM_FLAG_IN_EXAMINE;
+			dir->in_flight++;
+			g_mutex_unlock(&dir->mutex);
+			diritem_examine_get(path, item, &new);
+			g_mutex_lock(&dir->mutex);
+			dir->in_flight--;
+			item->flags &= ~ITEM_FLAG_IN_EXAMINE;
+
+			if (item->flags & ITEM_FLAG_GONE)
+			{
+				diritem_restat_discard(&new);
+				diritem_free(item);
+			}
+			else if (item->restats != restats)
+			{
+				/* Restatted meanwhile, so look again */
+				diritem_restat_discard(&new);
+				if (item->flags & ITEM_FLAG_NEED_EXAMINE)
+				{
+					g_ptr_array_add(dir->examine_list, item);
+					item->flags |= ITEM_FLAG_IN_EXAMINE;
+				}
+			}
+			else if (diritem_examine_set(item, &new))
 			{
 				g_mutex_lock(&dir->mergem);
 				g_ptr_array_add(dir->exa_items, item);
@@ -505,17 +822,12 @@ static gboolean do_recheck(gpointer data)
 			}
 		}
 
+		scan_off_if_done(dir);
 		g_mutex_unlock(&dir->mutex);
-		if (dir->examine_list->len == dir->examinei)
-		{
-			dir->examinei = 0;
-			g_ptr_array_free(dir->examine_list, TRUE);
-			dir->examine_list = g_ptr_array_new();
-		}
-		else
-			return TRUE;
+		return TRUE;
 	}
 
+	g_mutex_unlock(&dir->mutex);
 	return FALSE;
 }
 
@@ -560,11 +872,11 @@ static gboolean recheck_callback(gpointer data)
 		g_thread_join(dir->t_scan);
 		dir->t_scan = NULL;
 
-		//added by this thread
+		//added after the thread finished (e.g. by a readdir batch)
 		if (dir->recheck_list->len || dir->examine_list->len)
-			while (do_recheck(dir));
-
-		dir_set_scanning(dir, FALSE);
+			call_scan_t(dir);
+		else
+			dir_set_scanning(dir, FALSE);
 	}
 
 	if (dir->req_notify)
@@ -594,6 +906,36 @@ static void attach_callback(Directory *dir)
 	g_thread_yield();
 }
 
+/* The number of threads restatting a directory's items at once */
+static int restat_workers(void)
+{
+	int n = o_restat_workers.int_value;
+
+	if (n <= 0)
+		n = g_get_num_processors();
+
+	return CLAMP(n, 1, MAX_RESTAT_WORKERS);
+}
+
+/* A helper for scan_thread(), when there's a lot to restat */
+static gpointer restat_worker(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+	GString *buf = g_string_new(NULL);
+	gboolean ret = TRUE;
+
+	while (ret && dir->in_scan_thread)
+	{
+		ret = do_recheck(dir, buf);
+
+		if (dir->req_notify || dir->req_scan_off)
+			attach_callback(dir);
+	}
+
+	g_string_free(buf, TRUE);
+	return NULL;
+}
+
 static gpointer scan_thread(gpointer data)
 {
 	Directory *dir = (Directory *) data;
@@ -603,16 +945,56 @@ static gpointer scan_thread(gpointer data)
 	if (!dir->recheck_list->len)
 		dir->req_scan_off = TRUE;
 
-	while (ret)
+#ifdef mc_fstatat
+	/* Only held while we work, so it doesn't keep the mount busy */
+	int fd = open(dir->pathname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	g_mutex_lock(&dir->mutex);
+	dir->scan_fd = fd;
+	g_mutex_unlock(&dir->mutex);
+#endif
+
+	GString *buf = g_string_new(NULL);
+	GThread *workers[MAX_RESTAT_WORKERS];
+	int max_workers = restat_workers() - 1;
+	int n_workers = 0;
+
+	for (int i = 0; ret; i++)
 	{
 		if (!dir->in_scan_thread) break;
 
-		ret = do_recheck(data);
+		/* Start more workers while the backlog is big enough */
+		if (n_workers < max_workers && i % RESTAT_BACKLOG == 0)
+		{
+			g_mutex_lock(&dir->mutex);
+			int backlog = dir->recheck_list->len - dir->rechecki;
+			g_mutex_unlock(&dir->mutex);
+
+			if (backlog > (n_workers + 1) * RESTAT_BACKLOG)
+				workers[n_workers++] = g_thread_new("restat_t",
+						restat_worker, dir);
+		}
+
+		ret = do_recheck(dir, buf);
 
 		if (dir->req_notify || dir->req_scan_off)
 			attach_callback(dir);
 	}
 
+	/* Anything they queue after we finished is picked up by
+	 * recheck_callback().
+	 */
+	for (int i = 0; i < n_workers; i++)
+		g_thread_join(workers[i]);
+	g_string_free(buf, TRUE);
+
+#ifdef mc_fstatat
+	g_mutex_lock(&dir->mutex);
+	dir->scan_fd = -1;
+	g_mutex_unlock(&dir->mutex);
+	if (fd != -1)
+		close(fd);
+#endif
+
 	dir->notify_time = 0;
 	dir->in_scan_thread = FALSE;
 	attach_callback(dir);
@@ -697,7 +1079,8 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 {
 	if (item->lstat_errno == old->lstat_errno
 	 && item->base_type == old->base_type
-	 && item->flags == old->flags
+	 && (item->flags & ~ITEM_FLAG_SNAPSHOT) ==
+			(old->flags & ~ITEM_FLAG_SNAPSHOT)
 	 && item->size == old->size
 	 && item->mode == old->mode
 	 && item->atime == old->atime
@@ -707,7 +1090,7 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 	 && item->gid == old->gid
 	 && item->mime_type == old->mime_type
 	 && (old->_image == NULL || _diritem_get_image(item, FALSE) == old->_image)
-	 && (item->label == NULL || (
+	 && (item->label == NULL || (old->label &&
 			   item->label->red   == old->label->red
 			&& item->label->green == old->label->green
 			&& item->label->blue  == old->label->blue)))
@@ -715,6 +1098,43 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 	return FALSE;
 }
 
+/* 'item' (which is in known_items) has just been restatted. 'old' is a copy
+ * of it from before, if 'do_compare'. Remove it if it has been deleted, or
+ * queue an update if it has changed. dir->mutex must be held.
+ * Returns the item, or NULL if it was removed.
+ */
+static DirItem *item_restatted(Directory *dir, DirItem *item,
+		DirItem *old, gboolean do_compare, gboolean examine_now)
+{
+	if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
+	{
+		/* Item has been deleted */
+		if (g_hash_table_remove(dir->known_items, item->leafname))
+		{
+			g_mutex_lock(&dir->mergem);
+			g_hash_table_insert(dir->gone_items, item->leafname, item);
+			g_mutex_unlock(&dir->mergem);
+		}
+
+		item = NULL;
+	}
+	else
+	{
+		if (item->flags & ITEM_FLAG_NEED_EXAMINE)
+			old->flags |= ITEM_FLAG_NEED_EXAMINE;
+
+		if (do_compare && compare_items(item, old))
+			return item;
+
+		g_mutex_lock(&dir->mergem);
+		g_ptr_array_add(dir->up_items, item);
+		g_mutex_unlock(&dir->mergem);
+	}
+
+	delayed_notify(dir, examine_now);
+	return item;
+}
+
 /* Stat this item and add, update or remove it.
  * Returns the new/updated item, if any.
  * (leafname may be from the current DirItem item)
@@ -735,37 +1155,16 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 			old = *item;
 			do_compare = TRUE;
 		}
-		diritem_restat(full_path, item, &dir->stat_info, examine_now);
-
-		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
-		{
-			/* Item has been deleted */
-			if (g_hash_table_remove(dir->known_items, item->leafname))
-			{
-				g_mutex_lock(&dir->mergem);
-				g_hash_table_insert(dir->gone_items, item->leafname, item);
-				g_mutex_unlock(&dir->mergem);
-			}
+		diritem_restat_at(dir->scan_fd, full_path, item,
+				&dir->stat_info, examine_now);
 
-			item = NULL;
-		}
-		else
-		{
-			if (item->flags & ITEM_FLAG_NEED_EXAMINE)
-				old.flags |= ITEM_FLAG_NEED_EXAMINE;
-
-			if (do_compare && compare_items(item, &old))
-				return item;
-
-			g_mutex_lock(&dir->mergem);
-			g_ptr_array_add(dir->up_items, item);
-			g_mutex_unlock(&dir->mergem);
-		}
+		return item_restatted(dir, item, &old, do_compare, examine_now);
 	}
 	else
 	{
-		item = diritem_new(leafname);
-		diritem_restat(full_path, item, &dir->stat_info, examine_now);
+		item = diritem_new_in(dir->arena, leafname);
+		diritem_restat_at(dir->scan_fd, full_path, item,
+				&dir->stat_info, examine_now);
 
 		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
 		{
@@ -773,6 +1172,10 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 			return NULL;
 		}
 
+		/* The listing in progress may already have passed it */
+		if (dir->readjob && dir->have_scanned)
+			item->flags |= ITEM_FLAG_NOT_DELETE;
+
 		if (g_hash_table_insert(dir->known_items, item->leafname, item))
 		{
 			g_mutex_lock(&dir->mergem);
@@ -839,6 +1242,7 @@ static void call_scan_t(Directory *dir)
 		dir_set_scanning(dir, TRUE);
 
 		dir->req_scan_off = FALSE;
+		dir->scan_off_due = FALSE;
 		dir->in_scan_thread = TRUE;
 		dir->req_notify = FALSE;
 		dir->t_scan = g_thread_new("rescan_t", scan_thread, dir);
@@ -904,7 +1308,7 @@ static void inlist_clear(GPtrArray *pta)
 
 static gpointer parent_class;
 
-/* Note: dir_cache is never purged, so this shouldn't get called */
+/* Called when dir_cache drops an unused Directory; see dir_cost() */
 static void dir_finialize(GObject *object)
 {
 	Directory *dir = (Directory *) object;
@@ -913,9 +1317,13 @@ static void dir_finialize(GObject *object)
 
 	//g_print("[ dir finalize ]\n");
 
+	stop_read_t(dir);
 	call_scan_t(dir);
 	if (dir->rescan_timeout != -1)
 		g_source_remove(dir->rescan_timeout);
+	if (dir->changed_timeout != -1)
+		g_source_remove(dir->changed_timeout);
+	g_hash_table_destroy(dir->changed_leaves);
 
 	dir_merge_new(dir);	/* Ensures new, up and gone are empty */
 
@@ -930,6 +1338,7 @@ static void dir_finialize(GObject *object)
 
 	g_hash_table_foreach_remove(dir->known_items, free_items, NULL);
 	g_hash_table_destroy(dir->known_items);
+	dirarena_free(dir->arena);
 
 	g_string_free(dir->strbuf, TRUE);
 	g_mutex_clear(&dir->mutex);
@@ -959,17 +1368,24 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->strbuf = g_string_new(NULL);
 
 	dir->known_items = g_hash_table_new(g_str_hash, g_str_equal);
+	dir->arena = dirarena_new();
 	dir->recheck_list = g_ptr_array_new();
 	dir->rechecki = 0;
 	dir->examine_list = g_ptr_array_new();
 	dir->examinei = 0;
 	dir->idle_callback = 0;
 	dir->t_scan = NULL;
+	dir->scan_fd = -1;
+	dir->readjob = NULL;
 	dir->req_scan_off = FALSE;
+	dir->in_flight = 0;
+	dir->scan_off_due = FALSE;
 	dir->in_scan_thread = FALSE;
 	dir->req_notify = FALSE;
 	dir->scanning = FALSE;
 	dir->have_scanned = FALSE;
+	dir->scan_time = 0;
+	dir->snap_mtime = dir->snap_ctime = 0;
 
 	dir->users = NULL;
 	dir->needs_update = TRUE;
@@ -978,6 +1394,9 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->pathname = NULL;
 	dir->error = NULL;
 	dir->rescan_timeout = -1;
+	dir->changed_leaves = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free, NULL);
+	dir->changed_timeout = -1;
 	dir->monitor = NULL;
 
 	dir->new_items = g_ptr_array_new();
@@ -1046,7 +1465,358 @@ static gboolean checkthiscb(char *path)
 	return FALSE;
 }
 
-/* Get the names of all files in the directory.
+/* The first batch of names is sent to the main loop as soon as it is read,
+ * so that something appears quickly. Later batches get bigger, because every
+ * batch makes each window look through all its items for DIR_QUEUE_INTERESTING.
+ */
+#define READ_FIRST_BATCH 256
+#define READ_MAX_BATCH (32 * 1024)
+
+/* There is one of these for each background readdir. The thread only uses
+ * the fields above 'dir'; the rest belong to the main thread.
+ * The job is shared by the thread, the Directory and any pending merge
+ * callback, each holding a reference.
+ */
+typedef struct _ReadJob ReadJob;
+struct _ReadJob
+{
+	gint		refs;
+	gint		cancel;		/* Set (atomically) to stop reading */
+	gchar		*pathname;
+
+	GMutex		m;		/* Lock for names, done and error */
+	GPtrArray	*names;		/* Read, but not yet merged */
+	gboolean	done;
+	int		error;		/* errno from opendir, or 0 */
+	gboolean	idle;		/* read_merge_cb() is pending */
+
+	Directory	*dir;		/* NULL once cancelled */
+};
+
+/* One entry in a batch */
+typedef struct _ReadName ReadName;
+struct _ReadName
+{
+	int		hint_type;	/* From d_type; see dirent_base_type() */
+	char		leafname[1];
+};
+
+static void readjob_unref(ReadJob *job)
+{
+	if (!g_atomic_int_dec_and_test(&job->refs))
+		return;
+
+	if (job->names)
+		g_ptr_array_free(job->names, TRUE);
+	g_mutex_clear(&job->m);
+	g_free(job->pathname);
+	g_free(job);
+}
+
+/* Cancel the background readdir, if any. The thread itself may carry on
+ * until its current readdir() returns, but nothing more is merged.
+ * Returns TRUE if a read was in progress.
+ */
+static gboolean stop_read_t(Directory *dir)
+{
+	ReadJob *job = dir->readjob;
+
+	if (!job)
+		return FALSE;
+
+	dir->readjob = NULL;
+	job->dir = NULL;
+	g_atomic_int_set(&job->cancel, TRUE);
+	readjob_unref(job);
+
+	return TRUE;
+}
+
+/* Add these leafnames to the directory and tell our users */
+static void merge_names(Directory *dir, GPtrArray *names)
+{
+	g_mutex_lock(&dir->mutex);
+	for (int i = 0; i < names->len; i++)
+	{
+		ReadName *rn = names->pdata[i];
+		const gchar *leaf = rn->leafname;
+		DirItem *old = g_hash_table_lookup(dir->known_items, leaf);
+
+		if (old)
+		{
+			/* ITEM_FLAG_NEED_RESCAN_QUEUE is cleared when the item is added
+			 * to the rescan list.
+			 */
+			old->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
+			if (dir->have_scanned)
+				old->flags |= ITEM_FLAG_NOT_DELETE;
+		}
+		else
+		{
+			DirItem *new = diritem_new_in(dir->arena, leaf);
+			new->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
+			new->hint_type = rn->hint_type;
+
+			if (dir->have_scanned)
+				new->flags |= ITEM_FLAG_NOT_DELETE;
+
+			g_mutex_lock(&dir->mergem);
+			g_ptr_array_add(dir->new_items, new);
+			g_mutex_unlock(&dir->mergem);
+			g_hash_table_insert(dir->known_items, new->leafname, new);
+		}
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	dir_merge_new(dir);
+
+	/* Ask everyone which items they need to display, and add them to
+	 * the recheck list. Typically, this means we don't waste time
+	 * scanning hidden items.
+	 */
+	g_mutex_lock(&dir->mutex);
+	tousers(dir, DIR_QUEUE_INTERESTING, NULL);
+	g_mutex_unlock(&dir->mutex);
+
+	call_scan_t(dir);
+}
+
+/* The whole directory has been listed (or couldn't be opened) */
+static void read_done(Directory *dir, int error)
+{
+	if (error)
+	{
+		dir->error = g_strdup_printf(_("Can't open directory: %s"),
+				g_strerror(error));
+		dir_error_changed(dir);
+		dir_set_scanning(dir, FALSE);
+		return;
+	}
+
+	if (dir->have_scanned)
+	{
+		/* Remove all items and add to gone list */
+		g_mutex_lock(&dir->mutex);
+		g_mutex_lock(&dir->mergem);
+		g_hash_table_foreach_remove(dir->known_items, check_delete, dir);
+		g_mutex_unlock(&dir->mergem);
+		g_mutex_unlock(&dir->mutex);
+
+		dir_merge_new(dir);
+
+		//this means files are changed by rox
+		//by other prog, still needs the scan btn because it is very heavy.
+		//and this func is called in the lock of fscache. so have to be idle
+		g_idle_add((GSourceFunc)checkthiscb, g_strdup(dir->pathname));
+	}
+	dir->have_scanned = TRUE;
+
+	/* Stops scanning if there is nothing left to restat */
+	call_scan_t(dir);
+
+	if (dir->needs_update)
+		rescan_soon(dir);
+}
+
+/* Called in the main thread to merge whatever the reader has found so far */
+static gboolean read_merge_cb(gpointer data)
+{
+	ReadJob *job = (ReadJob *) data;
+
+	g_mutex_lock(&job->m);
+	GPtrArray *names = job->names;
+	gboolean done = job->done;
+	job->names = NULL;
+	job->idle = FALSE;
+	g_mutex_unlock(&job->m);
+
+	Directory *dir = job->dir;
+	if (dir)
+	{
+		if (names)
+			merge_names(dir, names);
+
+		if (done && dir->readjob == job)
+		{
+			dir->readjob = NULL;
+			job->dir = NULL;
+			readjob_unref(job);	/* The Directory's reference */
+
+			read_done(dir, job->error);
+		}
+	}
+
+	if (names)
+		g_ptr_array_free(names, TRUE);
+	readjob_unref(job);	/* The callback's reference */
+
+	return FALSE;
+}
+
+/* Called in the reading thread. Hands the batch to the main thread. */
+static void read_push(ReadJob *job, GPtrArray *batch, gboolean done)
+{
+	g_mutex_lock(&job->m);
+
+	if (!job->names)
+		job->names = batch;
+	else
+	{
+		for (int i = 0; i < batch->len; i++)
+			g_ptr_array_add(job->names, batch->pdata[i]);
+		g_ptr_array_set_free_func(batch, NULL);
+		g_ptr_array_free(batch, TRUE);
+	}
+
+	job->done = done;
+
+	if (!job->idle)
+	{
+		job->idle = TRUE;
+		g_atomic_int_inc(&job->refs);
+		g_idle_add(read_merge_cb, job);
+	}
+
+	g_mutex_unlock(&job->m);
+}
+
+/* Guess the base type from readdir() without stat()ing anything, so that
+ * new items can be sorted and filtered correctly before they're restatted.
+ * Symlinks (and filesystems without d_type) give TYPE_UNKNOWN.
+ */
+static int dirent_base_type(struct dirent *ent)
+{
+#if defined(_DIRENT_HAVE_D_TYPE) && defined(DTTOIF)
+	if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK)
+		return mode_to_base_type(DTTOIF(ent->d_type));
+#endif
+	return TYPE_UNKNOWN;
+}
+
+static gpointer read_thread(gpointer data)
+{
+	ReadJob *job = (ReadJob *) data;
+	guint limit = READ_FIRST_BATCH;
+	GPtrArray *batch = g_ptr_array_new_with_free_func(g_free);
+
+	DIR *d = mc_opendir(job->pathname);
+	if (!d)
+		job->error = errno;	/* Read by the main thread after 'done' */
+	else
+	{
+		struct dirent *ent;
+
+		while (!g_atomic_int_get(&job->cancel) && (ent = mc_readdir(d)))
+		{
+			if (ent->d_name[0] == '.')
+			{
+				if (ent->d_name[1] == '\0')
+					continue;		/* Ignore '.' */
+				if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
+					continue;		/* Ignore '..' */
+			}
+
+			size_t len = strlen(ent->d_name);
+			ReadName *rn = g_malloc(sizeof(ReadName) + len);
+			rn->hint_type = dirent_base_type(ent);
+			memcpy(rn->leafname, ent->d_name, len + 1);
+			g_ptr_array_add(batch, rn);
+
+			if (batch->len >= limit)
+			{
+				read_push(job, batch, FALSE);
+				batch = g_ptr_array_new_with_free_func(g_free);
+				limit = MIN(limit * 2, READ_MAX_BATCH);
+			}
+		}
+		mc_closedir(d);
+	}
+
+	read_push(job, batch, TRUE);
+	readjob_unref(job);	/* The thread's reference */
+
+	return NULL;
+}
+
+/* Fill an empty Directory from its snapshot (see dirsnap.c), so that our
+ * users get fully detailed items straight away. The listing that follows
+ * then works like a rescan, removing any items that have gone.
+ */
+static void load_snapshot(Directory *dir)
+{
+	GPtrArray *items;
+
+	if (!o_dir_snapshots.int_value || g_hash_table_size(dir->known_items))
+		return;
+
+	items = dirsnap_load(&dir->stat_info, dir->arena);
+	if (!items)
+		return;
+
+	g_mutex_lock(&dir->mutex);
+	g_mutex_lock(&dir->mergem);
+	for (int i = 0; i < items->len; i++)
+	{
+		DirItem *item = items->pdata[i];
+
+		item->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
+		g_ptr_array_add(dir->new_items, item);
+		g_hash_table_insert(dir->known_items, item->leafname, item);
+	}
+	g_mutex_unlock(&dir->mergem);
+	g_mutex_unlock(&dir->mutex);
+
+	g_ptr_array_free(items, TRUE);
+
+	dir->have_scanned = TRUE;
+	dir->snap_mtime = dir->stat_info.st_mtime;
+	dir->snap_ctime = dir->stat_info.st_ctime;
+
+	dir_merge_new(dir);
+}
+
+/* Called when scanning stops. If this is a big directory and all the items
+ * we were asked about have been restatted, save a snapshot for next time.
+ */
+static void save_snapshot(Directory *dir)
+{
+	GPtrArray *items;
+
+	if (!o_dir_snapshots.int_value || !dir->have_scanned || dir->error ||
+			dir->readjob)
+		return;
+
+	/* Already saved (or loaded) for this version of the directory */
+	if (dir->snap_mtime == dir->stat_info.st_mtime &&
+			dir->snap_ctime == dir->stat_info.st_ctime)
+		return;
+
+	/* Changed in the same second as we looked at it, so we can't tell
+	 * whether we saw the change.
+	 */
+	if (dir->stat_info.st_mtime >= dir->scan_time ||
+			dir->stat_info.st_ctime >= dir->scan_time)
+		return;
+
+	g_mutex_lock(&dir->mutex);
+	if (g_hash_table_size(dir->known_items) >= SNAPSHOT_MIN_ITEMS &&
+			!dir->recheck_list->len && !dir->examine_list->len &&
+			!dir->in_flight)
+	{
+		/* Only copies the details; the snapshot is made and
+		 * written in the background.
+		 */
+		items = hash_to_array(dir->known_items);
+		dirsnap_save(&dir->stat_info, items);
+		g_ptr_array_free(items, TRUE);
+
+		dir->snap_mtime = dir->stat_info.st_mtime;
+		dir->snap_ctime = dir->stat_info.st_ctime;
+	}
+	g_mutex_unlock(&dir->mutex);
+}
+
+/* Get the names of all files in the directory (in the background).
  * Remove any DirItems that are no longer listed.
  * Replace the recheck_list with the items found.
  */
@@ -1055,6 +1825,7 @@ static void dir_scan(Directory *dir)
 	g_return_if_fail(dir != NULL);
 
 	stop_scan_t(dir);
+	stop_read_t(dir);
 
 	const char *pathname = dir->pathname;
 	gboolean isupdate = dir->needs_update && !dir->error;
@@ -1081,81 +1852,27 @@ static void dir_scan(Directory *dir)
 		return;		/* Report on attach */
 	}
 
-	DIR *d = mc_opendir(pathname);
-	if (!d)
-	{
-		dir->error = g_strdup_printf(_("Can't open directory: %s"),
-				g_strerror(errno));
-		dir_error_changed(dir);
-		return;		/* Report on attach */
-	}
+	time(&dir->scan_time);
 
 	dir_set_scanning(dir, TRUE);
 	gdk_flush();
 
-	struct dirent *ent;
-	while ((ent = mc_readdir(d)))
-	{
-		if (ent->d_name[0] == '.')
-		{
-			if (ent->d_name[1] == '\0')
-				continue;		/* Ignore '.' */
-			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
-				continue;		/* Ignore '..' */
-		}
-
-		DirItem *old;
-		if (dir->have_scanned &&
-				(old = g_hash_table_lookup(dir->known_items, ent->d_name)))
-		{
-			/* ITEM_FLAG_NEED_RESCAN_QUEUE is cleared when the item is added
-			 * to the rescan list.
-			 */
-			old->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE | ITEM_FLAG_NOT_DELETE;
-
-		}
-		else
-		{
-			DirItem *new;
+	if (!dir->have_scanned)
+		load_snapshot(dir);
 
-			new = diritem_new(ent->d_name);
-			new->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
-
-			if (dir->have_scanned)
-				new->flags |= ITEM_FLAG_NOT_DELETE;
-
-			g_ptr_array_add(dir->new_items, new);
-			g_hash_table_insert(dir->known_items, new->leafname, new);
-		}
-	}
-	mc_closedir(d);
-
-	if (dir->have_scanned)
-	{
-		/* Remove all items and add to gone list */
-		g_hash_table_foreach_remove(dir->known_items, check_delete, dir);
-	}
 	inlist_clear(dir->recheck_list);
 	inlist_clear(dir->examine_list);
-	dir->recheck_list = g_ptr_array_sized_new(dir->new_items->len);
+	dir->recheck_list = g_ptr_array_new();
 	dir->rechecki = 0;
 	dir->examine_list = g_ptr_array_new();
 	dir->examinei = 0;
 
-	dir_merge_new(dir);
+	ReadJob *job = g_new0(ReadJob, 1);
+	job->refs = 2;	/* The Directory and the thread */
+	job->pathname = g_strdup(pathname);
+	g_mutex_init(&job->m);
+	job->dir = dir;
+	dir->readjob = job;
 
-	/* Ask everyone which items they need to display, and add them to
-	 * the recheck list. Typically, this means we don't waste time
-	 * scanning hidden items.
-	 */
-	tousers(dir, DIR_QUEUE_INTERESTING, NULL);
-
-	call_scan_t(dir);
-
-	if (dir->have_scanned)
-		//this means files are changed by rox
-		//by other prog, still needs the scan btn because it is very heavy.
-		//and this func is called in the lock of fscache. so have to be idle
-		g_idle_add((GSourceFunc)checkthiscb, g_strdup(dir->pathname));
-	dir->have_scanned = TRUE;
+	g_thread_unref(g_thread_new("readdir_t", read_thread, job));
 }
@@ -63,12 +63,15 @@ struct _Directory
 	gint		idle_callback;	/* Idle callback ID */
 	gboolean	in_scan_thread, req_scan_off, req_notify;
 	GThread		*t_scan;
+	int		scan_fd;	/* Open on pathname while t_scan runs */
+	struct _ReadJob	*readjob;	/* Background readdir; see dir_scan() */
 
 	GMutex		mutex;
 	GMutex		mergem;
 	GString		*strbuf;
 
 	GHashTable 	*known_items;	/* What our users know about */
+	DirArena	*arena;		/* Holds the DirItems and their names */
 	GPtrArray	*new_items;	/* New items to add in */
 	GPtrArray	*up_items;	/* Items to redraw */
 	GPtrArray	*exa_items;	/* Items to redraw */
@@ -78,8 +81,12 @@ struct _Directory
 	int rechecki;
 	GPtrArray	*examine_list;	/* Items to examine on callback */
 	int examinei;
+	int		in_flight;	/* Items do_recheck() is working on */
+	gboolean	scan_off_due;	/* recheck_list emptied; see do_recheck() */
 
 	gboolean	have_scanned;	/* TRUE after first complete scan */
+	time_t		scan_time;	/* When stat_info was read */
+	time_t		snap_mtime, snap_ctime;	/* Of the saved snapshot */
 	gboolean	scanning;	/* TRUE if we sent DIR_START_SCAN */
 
 	/* Indicates that the directory needs to be rescanned.
@@ -94,6 +101,9 @@ struct _Directory
 
 	gint		rescan_timeout;	/* See dir_rescan_soon() */
 
+	GHashTable	*changed_leaves;	/* Leafnames from the monitor */
+	gint		changed_timeout;	/* See changed_leaf_soon() */
+
 	GFileMonitor *monitor;
 };
 
@@ -109,6 +119,7 @@ void dir_merge_new(Directory *dir);
 void dir_force_update_path(const gchar *path, gboolean icon);
 void dir_drop_all_notifies(void);
 void dir_queue_recheck(Directory *dir, DirItem *item);
+void dir_recheck_first(Directory *dir, GPtrArray *items);
 void dir_stop(void); /* stop all scan thread */
 
 #endif /* _DIR_H */
@@ -31,6 +31,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "global.h"
 
@@ -45,6 +48,14 @@
 #include "pixmaps.h"
 #include "xtypes.h"
 
+#if defined(HAVE_SYS_VFS_H) && defined(__linux__)
+# include <sys/vfs.h>
+# define TMPFS_MAGIC 0x01021994
+# define TMPFS_DIRENT_SIZE 20	/* tmpfs adds this to a dir's size per entry */
+#endif
+
+#define COUNT_CACHE_MAX 4096	/* Forget all the counts after this many */
+
 #define RECENT_DELAY (5 * 60)	/* Time in seconds to consider a file recent */
 #define ABOUT_NOW(time) (diritem_recent_time - time < RECENT_DELAY)
 /* If you want to make use of the RECENT flag, make sure this is set to
@@ -52,10 +63,122 @@
  */
 time_t diritem_recent_time;
 static GMutex m_diritems;
+
+static Option o_dir_count_limit;
+
+/* The number of items in each directory we've counted, by (dev, inode) */
+typedef struct _ChildCount ChildCount;
+struct _ChildCount
+{
+	dev_t		dev;
+	ino_t		ino;
+	time_t		mtime, ctime;	/* Of the directory, when counted */
+	off_t		count;
+	gboolean	exact;		/* FALSE => there are more */
+};
+static GHashTable *child_counts = NULL;	/* ChildCount -> itself */
+static GMutex m_counts;
+
+#ifdef TMPFS_MAGIC
+/* Whether each filesystem we've counted in is a tmpfs, by st_dev. Only ever
+ * appended to (under m_counts), so it can be read without the lock.
+ */
+#define MAX_FS_DEVS 32
+typedef struct _FsDev FsDev;
+struct _FsDev
+{
+	dev_t		dev;
+	gboolean	tmpfs;
+};
+static FsDev fs_devs[MAX_FS_DEVS];
+static gint n_fs_devs = 0;
+#endif
 static GSList *mfree = NULL; //free on main loop
 static GSList *munref = NULL; //unref on main loop
 static guint onmainidle = 0;
 
+/* The DirItems of a Directory are allocated from its DirArena, each in one
+ * record with its leafname, along with their collate keys. The arena gets
+ * memory in large blocks, and keeps freed records on lists by size for
+ * reuse. The blocks are mapped directly rather than malloc()ed, so that
+ * freeing them with the Directory really gives the memory back; malloc's
+ * own threshold for that moves up once a block has been freed.
+ */
+#define ARENA_BLOCK (256 * 1024)
+#define ARENA_GRAIN 16
+#define ARENA_CLASSES 48	/* Larger records are just malloc()ed */
+
+struct _DirArena
+{
+	GMutex		m;
+	GSList		*blocks;
+	char		*next, *end;	/* Unused part of the newest block */
+	gpointer	free[ARENA_CLASSES];	/* Linked through first word */
+};
+
+/* Number of blocks (malloc()ed or mapped) held by DirItems; see
+ * diritem_tests()
+ */
+static gint n_mallocs = 0;
+
+static gpointer arena_alloc(DirArena *arena, gsize size)
+{
+	gsize sizeclass = (size + ARENA_GRAIN - 1) / ARENA_GRAIN;
+	gpointer p;
+
+	if (!arena || sizeclass > ARENA_CLASSES)
+	{
+		g_atomic_int_inc(&n_mallocs);
+		return g_malloc(size);
+	}
+
+	size = sizeclass * ARENA_GRAIN;
+
+	g_mutex_lock(&arena->m);
+	p = arena->free[sizeclass - 1];
+	if (p)
+		arena->free[sizeclass - 1] = *(gpointer *) p;
+	else
+	{
+		if (arena->end - arena->next < size)
+		{
+			g_atomic_int_inc(&n_mallocs);
+			arena->next = mmap(NULL, ARENA_BLOCK,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (arena->next == MAP_FAILED)
+				g_error("Can't map %d bytes: %s", ARENA_BLOCK,
+					g_strerror(errno));
+			arena->end = arena->next + ARENA_BLOCK;
+			arena->blocks = g_slist_prepend(arena->blocks,
+							arena->next);
+		}
+		p = arena->next;
+		arena->next += size;
+	}
+	g_mutex_unlock(&arena->m);
+
+	return p;
+}
+
+/* 'size' must be the same as when 'p' was allocated */
+static void arena_release(DirArena *arena, gpointer p, gsize size)
+{
+	gsize sizeclass = (size + ARENA_GRAIN - 1) / ARENA_GRAIN;
+
+	if (!arena || sizeclass > ARENA_CLASSES)
+	{
+		g_atomic_int_add(&n_mallocs, -1);
+		g_free(p);
+		return;
+	}
+
+	g_mutex_lock(&arena->m);
+	*(gpointer *) p = arena->free[sizeclass - 1];
+	arena->free[sizeclass - 1] = p;
+	g_mutex_unlock(&arena->m);
+}
+
 static gboolean onmaincb(void *notused)
 {
 	g_mutex_lock(&m_diritems);
@@ -73,12 +196,161 @@ static gboolean onmaincb(void *notused)
 	return FALSE;
 }
 
+/* lstat() 'path' (or stat() it, if 'follow' is set). If 'dirfd' is an open
+ * directory containing the item, look up 'leaf' relative to that instead,
+ * which saves the kernel walking the whole path again.
+ */
+static int restat_stat(int dirfd, const guchar *path, const char *leaf,
+			struct stat *info, gboolean follow)
+{
+#ifdef mc_fstatat
+	if (dirfd != -1)
+		return mc_fstatat(dirfd, leaf, info,
+				follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
+	return follow ? mc_stat(path, info) : mc_lstat(path, info);
+}
+
+static guint count_hash(gconstpointer key)
+{
+	const ChildCount *c = (ChildCount *) key;
+
+	return (guint) c->ino ^ (guint) c->dev;
+}
+
+static gboolean count_equal(gconstpointer a, gconstpointer b)
+{
+	const ChildCount *ca = (ChildCount *) a, *cb = (ChildCount *) b;
+
+	return ca->ino == cb->ino && ca->dev == cb->dev;
+}
+
+#ifdef TMPFS_MAGIC
+/* TRUE if 'path', on device 'dev', is in a tmpfs. Only calls statfs() the
+ * first time for each device.
+ */
+static gboolean dev_is_tmpfs(const char *path, dev_t dev)
+{
+	int i, n = g_atomic_int_get(&n_fs_devs);
+	struct statfs fs;
+	gboolean tmpfs;
+
+	for (i = 0; i < n; i++)
+		if (fs_devs[i].dev == dev)
+			return fs_devs[i].tmpfs;
+
+	if (statfs(path, &fs) != 0)
+		return FALSE;
+	tmpfs = fs.f_type == TMPFS_MAGIC;
+
+	g_mutex_lock(&m_counts);
+	n = n_fs_devs;
+	for (i = 0; i < n; i++)
+		if (fs_devs[i].dev == dev)
+			break;
+	if (i == n && n < MAX_FS_DEVS)
+	{
+		fs_devs[n].dev = dev;
+		fs_devs[n].tmpfs = tmpfs;
+		g_atomic_int_inc(&n_fs_devs);
+	}
+	g_mutex_unlock(&m_counts);
+
+	return tmpfs;
+}
+#endif
+
+/* The number of entries in the directory 'path' (not counting . and ..),
+ * whose details are in 'info'. Stops at 'limit' if it's > 0, setting
+ * *exact to FALSE if there are more. Returns -1 if it can't be read.
+ * Counts are reused until the directory's mtime or ctime changes.
+ */
+static off_t count_children(const char *path, const struct stat *info,
+			    int limit, gboolean *exact)
+{
+	ChildCount key, *c;
+	off_t count = 0;
+
+	key.dev = info->st_dev;
+	key.ino = info->st_ino;
+
+	g_mutex_lock(&m_counts);
+	if (!child_counts)
+		child_counts = g_hash_table_new_full(count_hash, count_equal,
+						     g_free, NULL);
+	c = g_hash_table_lookup(child_counts, &key);
+	if (c && c->mtime == info->st_mtime && c->ctime == info->st_ctime &&
+			(c->exact || (limit > 0 && c->count >= limit)))
+	{
+		*exact = c->exact && (limit <= 0 || c->count <= limit);
+		count = *exact ? c->count : limit;
+		g_mutex_unlock(&m_counts);
+		return count;
+	}
+	g_mutex_unlock(&m_counts);
+
+	*exact = TRUE;
+
+#ifdef TMPFS_MAGIC
+	/* tmpfs keeps count for us */
+	if (info->st_size >= 2 * TMPFS_DIRENT_SIZE &&
+			dev_is_tmpfs(path, info->st_dev))
+		count = info->st_size / TMPFS_DIRENT_SIZE - 2;
+	else
+#endif
+	{
+		DIR *d = mc_opendir(path);
+		struct dirent *ent;
+
+		if (!d)
+			return -1;
+
+		while ((ent = mc_readdir(d)))
+		{
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' ||
+				(ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+				continue;
+			if (limit > 0 && count == limit)
+			{
+				*exact = FALSE;
+				break;
+			}
+			count++;
+		}
+		mc_closedir(d);
+	}
+
+	/* If it changed within the last second, we can't tell whether
+	 * we'd see a later change; so don't remember it.
+	 */
+	time_t now = time(NULL);
+	if (info->st_mtime >= now - 1 || info->st_ctime >= now - 1)
+		return count;
+
+	c = g_new(ChildCount, 1);
+	*c = key;
+	c->mtime = info->st_mtime;
+	c->ctime = info->st_ctime;
+	c->count = count;
+	c->exact = *exact;
+
+	g_mutex_lock(&m_counts);
+	if (g_hash_table_size(child_counts) >= COUNT_CACHE_MAX)
+		g_hash_table_remove_all(child_counts);
+	g_hash_table_replace(child_counts, c, c);
+	g_mutex_unlock(&m_counts);
+
+	return count;
+}
+
 /****************************************************************
  *			EXTERNAL INTERFACE			*
  ****************************************************************/
 
 void diritem_init(void)
 {
+	option_add_int(&o_dir_count_limit, "dir_count_limit", 1000);
+
 	read_globicons();
 }
 
@@ -90,21 +362,57 @@ void diritem_restat(
 		DirItem *retitem,
 		struct stat *parent,
 		gboolean examine_now)
+{
+	diritem_restat_at(-1, path, retitem, parent, examine_now);
+}
+
+/* As diritem_restat(), but 'dirfd' may be an open fd on the directory
+ * containing the item (or -1). The item is then stat()ed by leafname.
+ */
+void diritem_restat_at(
+		int dirfd,
+		const guchar *path,
+		DirItem *retitem,
+		struct stat *parent,
+		gboolean examine_now)
+{
+	DirItem newitem;
+
+	diritem_restat_get(dirfd, path, retitem, &newitem, parent);
+	diritem_restat_set(retitem, &newitem);
+
+	if (examine_now && retitem->flags & ITEM_FLAG_NEED_EXAMINE)
+		diritem_examine_dir(path, retitem);
+}
+
+/* The slow half of diritem_restat_at(). Fills in 'newitem' with the current
+ * details of 'retitem', but doesn't change 'retitem' itself, so the caller
+ * needn't hold its lock meanwhile. Pass the result to diritem_restat_set().
+ */
+void diritem_restat_get(
+		int dirfd,
+		const guchar *path,
+		DirItem *retitem,
+		DirItem *newitem,
+		struct stat *parent)
 {
 	struct stat	info;
+	gboolean	unchanged = FALSE;
+	XAttrProbe	xattrs = {FALSE, NULL, NULL};
 
 	g_mutex_lock(&m_diritems);
-	DirItem newitem = *retitem;
+	*newitem = *retitem;
 	g_mutex_unlock(&m_diritems);
 
-	DirItem *item = &newitem;
+	DirItem *item = newitem;
+	DirItem snap = *item;	/* Only used if ITEM_FLAG_SNAPSHOT is set */
 
 	item->_image = NULL;
-	item->flags &=
-		(ITEM_FLAG_CAPS | ITEM_FLAG_IN_RESCAN_QUEUE | ITEM_FLAG_IN_EXAMINE);
+	item->label = NULL;
+	item->flags &= ITEM_FLAG_CAPS;	/* See diritem_restat_set() */
 	item->mime_type = NULL;
 
-	if (mc_lstat(path, &info) == -1)
+	if (restat_stat(dirfd, path, item->leafname, &info, FALSE) == -1)
 	{
 		item->lstat_errno = errno;
 		item->base_type = TYPE_ERROR;
@@ -129,22 +437,29 @@ void diritem_restat(
 		if (ABOUT_NOW(item->mtime) || ABOUT_NOW(item->ctime))
 			item->flags |= ITEM_FLAG_RECENT;
 
-		if (xattr_have(path))
-			item->flags |= ITEM_FLAG_HAS_XATTR;
-
-		if (item->label)
+		/* Any change to the contents or xattrs updates the ctime, so
+		 * a snapshotted file's type is still good if that hasn't moved.
+		 */
+		unchanged = snap.flags & ITEM_FLAG_SNAPSHOT &&
+			!S_ISLNK(info.st_mode) &&
+			snap.ctime == item->ctime && snap.mtime == item->mtime &&
+			snap.size == item->size && snap.mode == item->mode;
+
+		if (!unchanged)
+			xattr_probe(path, &info, &xattrs);
+		else if (snap.flags & ITEM_FLAG_HAS_XATTR)
 		{
-			g_mutex_lock(&m_diritems);
-			if (retitem->label)
-				mfree = g_slist_prepend(mfree, item->label);
-			retitem->label = NULL;
-			g_mutex_unlock(&m_diritems);
+			xattrs.have = TRUE;
+			xattrs.label = xlabel_get(path);
 		}
-		item->label = xlabel_get(path);
+
+		if (xattrs.have)
+			item->flags |= ITEM_FLAG_HAS_XATTR;
+		item->label = xattrs.label;
 
 		if (S_ISLNK(info.st_mode))
 		{
-			if (mc_stat(path, &info))
+			if (restat_stat(dirfd, path, item->leafname, &info, TRUE))
 				item->base_type = TYPE_ERROR;
 			else
 				item->base_type =
@@ -211,8 +526,12 @@ void diritem_restat(
 					: path);
 			g_free(link_path);
 		}
+		else if (unchanged)
+			item->mime_type = snap.mime_type;
+		else if (xattrs.type)
+			item->mime_type = xattrs.type;
 		else
-			item->mime_type = type_from_path(path);
+			item->mime_type = type_guess_from_path(path);
 
 		/* Note: for symlinks we need the mode of the target */
 		if (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
@@ -256,41 +575,228 @@ void diritem_restat(
 
 	if (!item->mime_type)
 		item->mime_type = mime_type_from_base_type(item->base_type);
+}
 
+/* Replace the details of 'retitem' with those from diritem_restat_get().
+ * The flags used by the Directory to keep track of the item are left as
+ * they are now. (NOT_DELETE belongs to a directory listing that may still
+ * be in progress; see check_delete())
+ */
+void diritem_restat_set(DirItem *retitem, DirItem *newitem)
+{
 	g_mutex_lock(&m_diritems);
 	if (retitem->_image)
 		munref = g_slist_prepend(munref, retitem->_image);
-	*retitem = newitem;
+	if (retitem->label)
+		mfree = g_slist_prepend(mfree, retitem->label);
+	newitem->flags |= retitem->flags & (ITEM_FLAG_IN_RESCAN_QUEUE |
+			ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_NOT_DELETE | ITEM_FLAG_GONE);
+	newitem->collatekey = retitem->collatekey;	/* May have been made */
+	newitem->restats = retitem->restats + 1;
+	*retitem = *newitem;
 	g_mutex_unlock(&m_diritems);
+}
 
-	if (examine_now && item->flags & ITEM_FLAG_NEED_EXAMINE)
-		diritem_examine_dir(path, retitem);
+/* Throw away the results of diritem_restat_get() or diritem_examine_get()
+ * (eg, because the item has been restatted again since).
+ */
+void diritem_restat_discard(DirItem *newitem)
+{
+	g_mutex_lock(&m_diritems);
+	if (newitem->_image)
+		munref = g_slist_prepend(munref, newitem->_image);
+	if (newitem->label)
+		mfree = g_slist_prepend(mfree, newitem->label);
+	g_mutex_unlock(&m_diritems);
 }
 
 DirItem *diritem_new(const guchar *leafname)
 {
-	DirItem		*item;
+	return diritem_new_in(NULL, leafname);
+}
 
-	item = g_new0(DirItem, 1);
-	item->leafname = g_strdup(leafname);
+/* As diritem_new(), but allocated from 'arena' (if not NULL). The item must
+ * be freed (with diritem_free()) before the arena is.
+ */
+DirItem *diritem_new_in(DirArena *arena, const guchar *leafname)
+{
+	DirItem		*item;
+	gsize		len = strlen(leafname) + 1;
+	gunichar	first;
+
+	item = arena_alloc(arena, sizeof(DirItem) + len);
+	memset(item, 0, sizeof(DirItem));
+	item->arena = arena;
+	item->leafname = (char *) (item + 1);
+	memcpy(item->leafname, leafname, len);
 	item->base_type = TYPE_UNKNOWN;
+	item->hint_type = TYPE_UNKNOWN;
 
-	//collate key
-	gchar *to_free = NULL;
-	if (!g_utf8_validate(leafname, -1, NULL))
-		leafname = to_free = to_utf8(leafname);
+	/* The collate key is only made when sorting by name needs it */
+	if (leafname[0] < 0x80)
+		first = leafname[0];
+	else
+	{
+		first = g_utf8_get_char_validated(leafname, -1);
+		if (first == (gunichar) -1 || first == (gunichar) -2)
+		{
+			gchar *utf8 = to_utf8(leafname);
+			first = g_utf8_get_char(utf8);
+			g_free(utf8);
+		}
+	}
 
-	if (g_unichar_isupper(g_utf8_get_char(leafname)))
+	if (g_unichar_isupper(first))
 		item->flags |= ITEM_FLAG_CAPS;
 
-	gchar *tmp = g_utf8_strdown(leafname, -1);
-	item->collatekey = g_utf8_collate_key_for_filename(tmp, -1);
-	g_free(tmp);
+	return item;
+}
 
-	if (to_free)
-		g_free(to_free);	/* Only taken for invalid UTF-8 */
+/* Write a key for 'name' to 'key' (which must have room for 3 bytes per
+ * character, plus one), such that strcmp() on the keys sorts
+ * case-insensitively, puts dots before anything else and then numbers, in
+ * numerical order ("file9" before "file10"), as
+ * g_utf8_collate_key_for_filename() does.
+ * Returns FALSE if 'name' isn't all ASCII.
+ */
+static gboolean ascii_collate_key(const guchar *name, char *key)
+{
+	const guchar *p = name;
 
-	return item;
+	while (*p)
+	{
+		if (*p >= 0x80)
+			return FALSE;
+
+		if (g_ascii_isdigit(*p))
+		{
+			const guchar *start;
+
+			while (*p == '0' && g_ascii_isdigit(p[1]))
+				p++;	/* Leading zeros are ignored */
+			for (start = p; g_ascii_isdigit(*p); p++)
+				;
+			*key++ = '\2';
+			*key++ = 0x20 + MIN(p - start, 0xdf);
+			memcpy(key, start, p - start);
+			key += p - start;
+		}
+		else if (*p == '.')
+		{
+			*key++ = '\1';
+			p++;
+		}
+		else
+			*key++ = g_ascii_tolower(*p++);
+	}
+	*key = '\0';
+
+	return TRUE;
+}
+
+/* Transliterate as much of the UTF-8 string 'name' to ASCII as we can,
+ * stopping at the first character g_str_to_ascii() can't do. Sets *all to
+ * whether that was the whole name. g_free() the result.
+ */
+static gchar *ascii_prefix(const gchar *name, gboolean *all)
+{
+	GString *str = g_string_new(NULL);
+	const gchar *p;
+
+	*all = TRUE;
+	for (p = name; *p; p = g_utf8_next_char(p))
+	{
+		gchar buf[7], *ascii;
+		int len;
+
+		if ((guchar) *p < 0x80 && *p != '?')
+		{
+			g_string_append_c(str, *p);
+			continue;
+		}
+
+		len = g_unichar_to_utf8(g_utf8_get_char(p), buf);
+		buf[len] = '\0';
+		ascii = g_str_to_ascii(buf, NULL);
+		if (*p != '?' && strchr(ascii, '?'))
+		{
+			/* Can't be transliterated */
+			g_free(ascii);
+			*all = FALSE;
+			break;
+		}
+		g_string_append(str, ascii);
+		g_free(ascii);
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+/* For use by di_collatekey() only. Sets item->collatekey.
+ * ASCII names get a key from ascii_collate_key(). Others get one for as
+ * much of the name as can be transliterated to ASCII (so that "émile"
+ * sorts with "emile"), then a separator, then the locale's collate key to
+ * order them among themselves. The separator is "\1\1" if all of the name
+ * was transliterated, or "\377" if not (eg, CJK), so that "Photos X" (where
+ * X can't be transliterated) goes after every "Photos ..." name that can,
+ * and a name starting with such a character after all of those that don't.
+ */
+const char *_diritem_make_collatekey(DirItem *item)
+{
+	const guchar *leafname = item->leafname;
+	gsize len = strlen(leafname);
+	char stack[768], *key = len < sizeof(stack) / 3 ? stack
+		: g_malloc(len * 3 + 1);
+	char *ret;
+
+	if (!ascii_collate_key(leafname, key))
+	{
+		gchar *to_free = NULL, *ascii, *tmp, *glibkey;
+		gboolean all;
+		GString *str;
+
+		if (!g_utf8_validate(leafname, -1, NULL))
+			leafname = to_free = to_utf8(leafname);
+
+		ascii = ascii_prefix(leafname, &all);
+		if (key != stack)
+			g_free(key);
+
+		tmp = g_utf8_strdown(leafname, -1);
+		glibkey = g_utf8_collate_key_for_filename(tmp, -1);
+
+		key = g_malloc(strlen(ascii) * 3 + 1);
+		ascii_collate_key(ascii, key);
+		str = g_string_new(key);
+		g_free(key);
+		g_string_append(str, all ? "\1\1" : "\377");
+		g_string_append(str, glibkey);
+
+		key = g_string_free(str, FALSE);
+		g_free(glibkey);
+		g_free(tmp);
+		g_free(ascii);
+		g_free(to_free);
+	}
+
+	len = strlen(key) + 1;
+	ret = arena_alloc(item->arena, len);
+	memcpy(ret, key, len);
+	if (key != stack)
+		g_free(key);
+
+	g_mutex_lock(&m_diritems);
+	if (item->collatekey)
+	{
+		/* Another thread beat us to it */
+		arena_release(item->arena, ret, len);
+		ret = item->collatekey;
+	}
+	else
+		item->collatekey = ret;
+	g_mutex_unlock(&m_diritems);
+
+	return ret;
 }
 
 void diritem_free(DirItem *item)
@@ -302,9 +808,33 @@ void diritem_free(DirItem *item)
 	if (item->label)
 		g_free(item->label);
 
-	g_free(item->collatekey);
-	g_free(item->leafname);
-	g_free(item);
+	if (item->collatekey)
+		arena_release(item->arena, item->collatekey,
+				strlen(item->collatekey) + 1);
+	arena_release(item->arena, item,
+			sizeof(DirItem) + strlen(item->leafname) + 1);
+}
+
+DirArena *dirarena_new(void)
+{
+	DirArena *arena = g_new0(DirArena, 1);
+
+	g_mutex_init(&arena->m);
+
+	return arena;
+}
+
+/* Give all the arena's memory back. Its items must already be freed. */
+void dirarena_free(DirArena *arena)
+{
+	for (GSList *next = arena->blocks; next; next = next->next)
+	{
+		g_atomic_int_add(&n_mallocs, -1);
+		munmap(next->data, ARENA_BLOCK);
+	}
+	g_slist_free(arena->blocks);
+	g_mutex_clear(&arena->m);
+	g_free(arena);
 }
 
 /* For use by di_image() only. Sets item->_image. */
@@ -320,6 +850,12 @@ MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread)
 		else
 			item->_image = type_to_icon(item->mime_type);
 	}
+	else if (!item->_image && item->hint_type != TYPE_UNKNOWN)
+	{
+		/* Replaced when the item is restatted */
+		item->_image = type_to_icon(
+				mime_type_from_base_type(item->hint_type));
+	}
 
 	ret = item->_image;
 
@@ -333,19 +869,47 @@ MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread)
 /* Fill in more details of the DirItem for a directory item.
  * - Looks for an image (but maybe still NULL on error)
  * - Updates ITEM_FLAG_APPDIR
+ * Returns TRUE if anything shown for it changed.
  */
 gboolean diritem_examine_dir(const guchar *path, DirItem *item)
+{
+	DirItem newitem;
+
+	diritem_examine_get(path, item, &newitem);
+	return diritem_examine_set(item, &newitem);
+}
+
+/* The slow half of diritem_examine_dir(). As for diritem_restat_get(), the
+ * results go in 'newitem' and 'item' isn't changed, so the caller needn't
+ * hold its lock meanwhile. Pass the result to diritem_examine_set(), or to
+ * diritem_restat_discard() if it's no longer wanted.
+ */
+void diritem_examine_get(const guchar *path, DirItem *item, DirItem *newitem)
 {
 	guchar *rpath = pathdup(path); //realpath
 
-	int oldsize = item->size;
-	DIR *d = mc_opendir(rpath);
-	if (d)
+	g_mutex_lock(&m_diritems);
+	*newitem = *item;
+	g_mutex_unlock(&m_diritems);
+
+	item = newitem;
+	item->_image = NULL;	/* The new one, if any; we have a ref */
+	item->label = NULL;
+
+	struct stat dirinfo;
+	if (mc_stat(rpath, &dirinfo) == 0)
 	{
-		int cnt = 0;
-		while ((mc_readdir(d))) cnt++;
-		item->size = cnt - 2; //. and ..
-		mc_closedir(d);
+		gboolean exact;
+		off_t cnt = count_children(rpath, &dirinfo,
+				o_dir_count_limit.int_value, &exact);
+		if (cnt >= 0)
+		{
+			item->size = cnt;
+			if (exact)
+				item->flags &= ~ITEM_FLAG_MORE_ITEMS;
+			else
+				item->flags |= ITEM_FLAG_MORE_ITEMS;
+		}
 	}
 
 	gchar *pathbuf = NULL;
@@ -409,9 +973,7 @@ no_diricon:
 	if (!(info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
 		goto out;	/* Not executable */
 
-	g_mutex_lock(&m_diritems);
 	item->flags |= ITEM_FLAG_APPDIR;
-	g_mutex_unlock(&m_diritems);
 
 	/* Try to load AppIcon.xpm... */
 
@@ -436,9 +998,7 @@ no_diricon:
 out:
 	g_free(pathbuf);
 
-	g_mutex_lock(&m_diritems);
 	item->flags &= ~ITEM_FLAG_NEED_EXAMINE;
-	g_mutex_unlock(&m_diritems);
 
 	if ((item->flags & ITEM_FLAG_APPDIR) && !newimage)
 	{
@@ -447,17 +1007,238 @@ out:
 		g_object_ref(newimage);
 	}
 
-	if (newimage)
-	{
-		g_mutex_lock(&m_diritems);
+	item->_image = newimage;
+}
+
+/* Copy the results of diritem_examine_get() to 'item'. Returns TRUE if
+ * anything shown for it changed.
+ */
+gboolean diritem_examine_set(DirItem *item, DirItem *newitem)
+{
+	const int mask = ITEM_FLAG_APPDIR | ITEM_FLAG_MORE_ITEMS |
+			 ITEM_FLAG_NEED_EXAMINE;
+	gboolean changed;
 
+	g_mutex_lock(&m_diritems);
+
+	changed = newitem->_image != NULL || item->size != newitem->size ||
+		(item->flags & ITEM_FLAG_MORE_ITEMS) !=
+		(newitem->flags & ITEM_FLAG_MORE_ITEMS);
+
+	item->size = newitem->size;
+	item->flags = (item->flags & ~mask) | (newitem->flags & mask);
+	if (newitem->_image)
+	{
 		if (item->_image)
 			munref = g_slist_prepend(munref, item->_image);
+		item->_image = newitem->_image;
+	}
+
+	g_mutex_unlock(&m_diritems);
+
+	return changed;
+}
+
+#ifdef UNIT_TESTS
+/* Resident set size, in KB */
+static long rss_kb(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f)
+	{
+		if (fscanf(f, "%*ld %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Create and free $ROX_ARENA_BENCH synthetic items (eg 1000000), first with
+ * malloc() and then from a DirArena. Prints the time taken, the number of
+ * malloc()ed blocks held and the RSS at each stage.
+ */
+static void arena_bench(void)
+{
+	const char *count = g_getenv("ROX_ARENA_BENCH");
+	int n = count ? atoi(count) : 0;
+
+	if (n <= 0)
+		return;
+
+	GPtrArray *items = g_ptr_array_sized_new(n);
+	GTimer *timer = g_timer_new();
+	char leaf[32];
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		DirArena *arena = pass ? dirarena_new() : NULL;
+		long rss0 = rss_kb();
+		int mallocs0 = g_atomic_int_get(&n_mallocs);
+
+		g_timer_start(timer);
+		for (int i = 0; i < n; i++)
+		{
+			sprintf(leaf, "File %07d.txt", i);
+			g_ptr_array_add(items, diritem_new_in(arena, leaf));
+		}
+		double t_new = g_timer_elapsed(timer, NULL);
+		long rss1 = rss_kb();
+		int mallocs = g_atomic_int_get(&n_mallocs) - mallocs0;
+
+		g_timer_start(timer);
+		for (int i = 0; i < n; i++)
+			diritem_free(items->pdata[i]);
+		if (arena)
+			dirarena_free(arena);
+		double t_free = g_timer_elapsed(timer, NULL);
+		g_ptr_array_set_size(items, 0);
+
+		g_print("%s: %d items: new %.3fs, free %.3fs, "
+			"%d blocks held, RSS +%ldK, +%ldK after free\n",
+			pass ? "arena" : "malloc", n, t_new, t_free,
+			mallocs, rss1 - rss0, rss_kb() - rss0);
+	}
+
+	g_timer_destroy(timer);
+	g_ptr_array_free(items, TRUE);
+}
+
+/* Names in the order sort_by_name() should put them */
+static void collatekey_tests(void)
+{
+	static const char *names[] = {
+		"a.txt", "a1", "a02", "a2b", "a10", "A11", "a_b", "ab",
+		"b", "file9", "file10", "x0", "x1",
+	};
+	DirItem *prev = NULL;
+
+	for (int i = 0; i < G_N_ELEMENTS(names); i++)
+	{
+		DirItem *item = diritem_new(names[i]);
+
+		if (prev && strcmp(di_collatekey(prev), di_collatekey(item)) >= 0)
+			g_error("Collate key for '%s' not before '%s'",
+					prev->leafname, item->leafname);
+		if (prev)
+			diritem_free(prev);
+		prev = item;
+	}
+	diritem_free(prev);
+
+	/* Transliterated names sort with the ASCII ones */
+	static const char *accented[] = {"emile", "\xc3\xa9mile", "emilf"};
+	prev = NULL;
+	for (int i = 0; i < G_N_ELEMENTS(accented); i++)
+	{
+		DirItem *item = diritem_new(accented[i]);
+
+		if (prev && strcmp(di_collatekey(prev), di_collatekey(item)) >= 0)
+			g_error("Collate key for '%s' not before '%s'",
+					prev->leafname, item->leafname);
+		if (prev)
+			diritem_free(prev);
+		prev = item;
+	}
+	diritem_free(prev);
+
+	/* What can't be transliterated goes after what can */
+	static const char *mixed[] = {
+		"Photos 2020", "Photos zz",
+		"Photos \xe6\x97\xa5\xe6\x9c\xac", "Photosa", "zzz",
+		"\xe4\xb8\xad\xe6\x96\x87.txt",
+	};
+	prev = NULL;
+	for (int i = 0; i < G_N_ELEMENTS(mixed); i++)
+	{
+		DirItem *item = diritem_new(mixed[i]);
+
+		if (prev && strcmp(di_collatekey(prev), di_collatekey(item)) >= 0)
+			g_error("Collate key for '%s' not before '%s'",
+					prev->leafname, item->leafname);
+		if (prev)
+			diritem_free(prev);
+		prev = item;
+	}
+	diritem_free(prev);
+}
+
+/* Restat every item in $ROX_RESTAT_BENCH twice: by full path, and relative
+ * to an open fd on the directory. Checks that both give the same results
+ * and prints the time taken. Run under "strace -c -f" to compare syscalls.
+ * A deep path on a network filesystem shows the difference best.
+ */
+void diritem_tests(void)
+{
+	const char *dirpath = g_getenv("ROX_RESTAT_BENCH");
+	struct stat parent;
+	GPtrArray *items[2];
+	struct dirent *ent;
+	DIR *d;
+
+	collatekey_tests();
+	arena_bench();
+
+	if (!dirpath || mc_stat(dirpath, &parent) || !(d = mc_opendir(dirpath)))
+		return;
+
+	items[0] = g_ptr_array_new();
+	items[1] = g_ptr_array_new();
+	while ((ent = mc_readdir(d)))
+	{
+		if (strcmp(ent->d_name, ".") == 0 ||
+				strcmp(ent->d_name, "..") == 0)
+			continue;
+		g_ptr_array_add(items[0], diritem_new(ent->d_name));
+		g_ptr_array_add(items[1], diritem_new(ent->d_name));
+	}
+	mc_closedir(d);
+
+	int fd = -1;
+#ifdef mc_fstatat
+	fd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+
+	GTimer *timer = g_timer_new();
+	time(&diritem_recent_time);
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		g_timer_start(timer);
+		for (int i = 0; i < items[pass]->len; i++)
+		{
+			DirItem *item = items[pass]->pdata[i];
+			gchar *path = g_build_filename(dirpath, item->leafname, NULL);
+
+			diritem_restat_at(pass ? fd : -1, path, item, &parent, FALSE);
+			g_free(path);
+		}
+		g_timer_stop(timer);
+
+		g_print("restat %s: %d items in %.3fs\n",
+				pass ? "by fd" : "by path", items[pass]->len,
+				g_timer_elapsed(timer, NULL));
+	}
+
+	for (int i = 0; i < items[0]->len; i++)
+	{
+		DirItem *a = items[0]->pdata[i];
+		DirItem *b = items[1]->pdata[i];
+
+		if (a->base_type != b->base_type || a->mode != b->mode ||
+				a->size != b->size || a->mtime != b->mtime ||
+				a->mime_type != b->mime_type)
+			g_error("restat by fd differs for '%s'", a->leafname);
 
-		item->_image = newimage;
-		g_mutex_unlock(&m_diritems);
-		return TRUE;
+		diritem_free(a);
+		diritem_free(b);
 	}
 
-	return item->size != oldsize;
+	if (fd != -1)
+		close(fd);
+	g_timer_destroy(timer);
+	g_ptr_array_free(items[0], TRUE);
+	g_ptr_array_free(items[1], TRUE);
 }
+#endif
@@ -17,6 +17,7 @@ typedef enum
 	ITEM_FLAG_APPDIR  	= 0x02,	/* Contains an AppRun */
 	ITEM_FLAG_MOUNT_POINT  	= 0x04,	/* Is mounted or in fstab */
 	ITEM_FLAG_MOUNTED  	= 0x08,	/* Is mounted */
+	ITEM_FLAG_SNAPSHOT  	= 0x10,	/* Details are from a dirsnap; not restatted yet */
 	ITEM_FLAG_EXEC_FILE  	= 0x20,	/* File, and has an X bit set (or is a .desktop)*/
 	ITEM_FLAG_NOT_DELETE	= 0x40, /* Not Delete */
 	ITEM_FLAG_RECENT	= 0x80, /* [MC]-time is around now */
@@ -30,6 +31,7 @@ typedef enum
 	ITEM_FLAG_NEED_EXAMINE = 0x200,
 	ITEM_FLAG_IN_EXAMINE   = 0x2000,
 	ITEM_FLAG_GONE = 0x4000,
+	ITEM_FLAG_MORE_ITEMS = 0x8000,	/* Dir has more than 'size' items */
 
 	ITEM_FLAG_CAPS      = 0x400,
 	ITEM_FLAG_HAS_XATTR = 0x800, /* Has extended attributes set */
@@ -38,11 +40,13 @@ typedef enum
 struct _DirItem
 {
 	char		*leafname;
-	char		*collatekey; /* Preprocessed for sorting */
+	char		*collatekey; /* Preprocessed for sorting; di_collatekey() */
 	int		base_type;
+	int		hint_type;	/* Guess from readdir(), until restatted */
 	int		flags;
 	int		lstat_errno;	/* 0 if details are valid */
 	mode_t		mode;
+	guint		restats;	/* Changes when restatted */
 	off_t		size;
 	time_t		atime, ctime, mtime;
 	MaskedPixmap	*_image;	/* NULL => leafname only so far */
@@ -50,14 +54,41 @@ struct _DirItem
 	GdkColor	*label;
 	uid_t		uid;
 	gid_t		gid;
+	DirArena	*arena;		/* NULL => malloc()ed */
 };
 
 void diritem_init(void);
 DirItem *diritem_new(const guchar *leafname);
+DirItem *diritem_new_in(DirArena *arena, const guchar *leafname);
+DirArena *dirarena_new(void);
+void dirarena_free(DirArena *arena);
 void diritem_restat(const guchar *path, DirItem *item, struct stat *parent, gboolean examine_now);
+void diritem_restat_at(int dirfd, const guchar *path, DirItem *item, struct stat *parent, gboolean examine_now);
+void diritem_restat_get(int dirfd, const guchar *path, DirItem *item, DirItem *newitem, struct stat *parent);
+void diritem_restat_set(DirItem *item, DirItem *newitem);
+void diritem_restat_discard(DirItem *newitem);
 MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread);
+const char *_diritem_make_collatekey(DirItem *item);
 void diritem_free(DirItem *item);
 gboolean diritem_examine_dir(const guchar *path, DirItem *item);
+void diritem_examine_get(const guchar *path, DirItem *item, DirItem *newitem);
+gboolean diritem_examine_set(DirItem *item, DirItem *newitem);
+
+#ifdef UNIT_TESTS
+void diritem_tests(void);
+#endif
+
+/* The base type, or readdir()'s guess at it if we haven't restatted yet */
+static inline int di_base_type(const DirItem *item)
+{
+	return item->base_type == TYPE_UNKNOWN ? item->hint_type : item->base_type;
+}
+
+static inline const char *di_collatekey(DirItem *item)
+{
+	return item->collatekey ? item->collatekey
+		: _diritem_make_collatekey(item);
+}
 
 static inline MaskedPixmap *di_image(DirItem *item)
 {
@@ -0,0 +1,446 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* dirsnap.c - remember the contents of big directories between runs */
+
+/* When a large directory has been scanned, the details of its items (type,
+ * size, times, MIME type, etc) are written to
+ * ~/.cache/rox.sourceforge.net/ROX-Filer/dirs/<dev>-<inode>.
+ * Next time it is opened, the items are created from this snapshot straight
+ * away, instead of waiting for them all to be restatted and their types
+ * guessed. The directory is still read and its items restatted in the
+ * background as usual; but an item whose ctime, mtime, size and mode haven't
+ * changed keeps its snapshotted MIME type (see diritem_restat_get()).
+ *
+ * A snapshot is only used if the directory's own mtime and ctime match.
+ *
+ * The file is a header, an array of SnapItems, an array of offsets to MIME
+ * type names, and then the strings. It is in the machine's own byte order
+ * and is used directly from a read-only mapping.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+
+#include "dirsnap.h"
+#include "diritem.h"
+#include "type.h"
+
+#define SNAP_MAGIC "ROXsnap1"
+
+/* Bounds on the size of a snapshot, and on how many are kept */
+#define SNAP_MAX_ITEMS (256 * 1024)
+#define SNAP_MAX_BYTES (32 * 1024 * 1024)
+#define SNAP_MAX_FILES 256
+
+/* These are worth remembering; the rest are recalculated on restat */
+#define SNAP_FLAGS (ITEM_FLAG_SYMLINK | ITEM_FLAG_APPDIR | \
+		    ITEM_FLAG_MOUNT_POINT | ITEM_FLAG_MOUNTED | \
+		    ITEM_FLAG_EXEC_FILE | ITEM_FLAG_HAS_XATTR)
+
+typedef struct _SnapHeader SnapHeader;
+struct _SnapHeader
+{
+	char	magic[8];
+	guint32	n_items;
+	guint32	n_types;
+	guint64	dev, ino;	/* Of the directory... */
+	gint64	mtime, ctime;	/* ...and when it was read */
+	guint32	strings_size;
+	guint32	unused;
+};
+
+typedef struct _SnapItem SnapItem;
+struct _SnapItem
+{
+	guint32	leafname;	/* Offset into the strings */
+	guint16	type;		/* Index into the type table, plus 1 */
+	guint16	base_type;
+	guint32	flags;
+	guint32	mode;
+	guint32	uid, gid;
+	gint64	size;
+	gint64	atime, ctime, mtime;
+};
+
+/* What dirsnap_save() copies from the DirItems for write_thread() */
+typedef struct _SnapCopy SnapCopy;
+struct _SnapCopy
+{
+	SnapItem	s;		/* Except for the type */
+	MIME_type	*type;
+};
+
+typedef struct _SnapWrite SnapWrite;
+struct _SnapWrite
+{
+	gchar		*path;
+	struct stat	dir_info;
+	GArray		*items;		/* SnapCopy */
+	GString		*strings;	/* The leafnames, so far */
+};
+
+static gint n_saves = 0;
+
+static gchar *snap_dir(void)
+{
+	return g_build_filename(g_get_user_cache_dir(),
+			SITE, PROJECT, "dirs", NULL);
+}
+
+static gchar *snap_path(const struct stat *dir_info)
+{
+	gchar *dir = snap_dir();
+	gchar *leaf = g_strdup_printf("%" G_GINT64_MODIFIER "x-%"
+			G_GINT64_MODIFIER "x",
+			(guint64) dir_info->st_dev, (guint64) dir_info->st_ino);
+	gchar *path = g_build_filename(dir, leaf, NULL);
+
+	g_free(leaf);
+	g_free(dir);
+	return path;
+}
+
+/* Returns the string at 'offset', or NULL if it's out of range */
+static const char *snap_string(const char *strings, guint32 size,
+			       guint32 offset)
+{
+	return offset < size ? strings + offset : NULL;
+}
+
+static gint cmp_time(gconstpointer a, gconstpointer b)
+{
+	time_t ta = *(const time_t *) a, tb = *(const time_t *) b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* Remove the oldest snapshots, so that there are at most SNAP_MAX_FILES */
+static void snap_prune(void)
+{
+	gchar *dir = snap_dir();
+	GDir *d = g_dir_open(dir, 0, NULL);
+	GArray *times;
+	GPtrArray *paths;
+	const char *leaf;
+	time_t cutoff;
+	int i;
+
+	if (!d)
+	{
+		g_free(dir);
+		return;
+	}
+
+	times = g_array_new(FALSE, FALSE, sizeof(time_t));
+	paths = g_ptr_array_new_with_free_func(g_free);
+	while ((leaf = g_dir_read_name(d)))
+	{
+		struct stat info;
+		gchar *path = g_build_filename(dir, leaf, NULL);
+
+		if (stat(path, &info) == 0)
+		{
+			g_array_append_val(times, info.st_mtime);
+			g_ptr_array_add(paths, path);
+		}
+		else
+			g_free(path);
+	}
+	g_dir_close(d);
+
+	if (paths->len > SNAP_MAX_FILES)
+	{
+		GArray *sorted = g_array_sized_new(FALSE, FALSE,
+				sizeof(time_t), times->len);
+
+		g_array_append_vals(sorted, times->data, times->len);
+		g_array_sort(sorted, cmp_time);
+		cutoff = g_array_index(sorted, time_t,
+				paths->len - SNAP_MAX_FILES);
+		g_array_free(sorted, TRUE);
+
+		for (i = 0; i < paths->len; i++)
+			if (g_array_index(times, time_t, i) < cutoff)
+				unlink(paths->pdata[i]);
+	}
+
+	g_array_free(times, TRUE);
+	g_ptr_array_free(paths, TRUE);
+	g_free(dir);
+}
+
+/* Make the snapshot from the copied details, or NULL if it would be too
+ * big. Frees w->strings.
+ */
+static GByteArray *snap_build(SnapWrite *w)
+{
+	GByteArray *data;
+	GString *strings = w->strings;
+	GHashTable *type_index;
+	GPtrArray *type_list;
+	SnapHeader header;
+	guint32 offset;
+	int i;
+
+	data = g_byte_array_sized_new(sizeof(header) +
+			w->items->len * sizeof(SnapItem));
+	type_index = g_hash_table_new(NULL, NULL);
+	type_list = g_ptr_array_new();
+
+	memset(&header, 0, sizeof(header));
+	g_byte_array_append(data, (guint8 *) &header, sizeof(header));
+
+	for (i = 0; i < w->items->len; i++)
+	{
+		SnapCopy *c = &g_array_index(w->items, SnapCopy, i);
+
+		if (c->type)
+		{
+			c->s.type = GPOINTER_TO_UINT(g_hash_table_lookup(
+						type_index, c->type));
+			if (!c->s.type)
+			{
+				if (type_list->len >= G_MAXUINT16)
+					continue;
+				g_ptr_array_add(type_list, c->type);
+				c->s.type = type_list->len;
+				g_hash_table_insert(type_index, c->type,
+						GUINT_TO_POINTER(c->s.type));
+			}
+		}
+
+		g_byte_array_append(data, (guint8 *) &c->s, sizeof(c->s));
+		header.n_items++;
+	}
+
+	for (i = 0; i < type_list->len; i++)
+	{
+		MIME_type *type = (MIME_type *) type_list->pdata[i];
+
+		offset = strings->len;
+		g_byte_array_append(data, (guint8 *) &offset, sizeof(offset));
+		g_string_append_printf(strings, "%s/%s",
+				type->media_type, type->subtype);
+		g_string_append_c(strings, '\0');
+	}
+
+	memcpy(header.magic, SNAP_MAGIC, 8);
+	header.n_types = type_list->len;
+	header.dev = w->dir_info.st_dev;
+	header.ino = w->dir_info.st_ino;
+	header.mtime = w->dir_info.st_mtime;
+	header.ctime = w->dir_info.st_ctime;
+	header.strings_size = strings->len;
+	memcpy(data->data, &header, sizeof(header));
+	g_byte_array_append(data, (guint8 *) strings->str, strings->len);
+
+	g_string_free(strings, TRUE);
+	g_hash_table_destroy(type_index);
+	g_ptr_array_free(type_list, TRUE);
+
+	if (!header.n_items || data->len > SNAP_MAX_BYTES)
+	{
+		g_byte_array_free(data, TRUE);
+		return NULL;
+	}
+
+	return data;
+}
+
+static gpointer write_thread(gpointer data)
+{
+	SnapWrite *w = (SnapWrite *) data;
+	gchar *dir = g_path_get_dirname(w->path);
+	GByteArray *snap;
+
+	snap = snap_build(w);
+	if (snap)
+	{
+		g_mkdir_with_parents(dir, 0700);
+		g_file_set_contents(w->path, (gchar *) snap->data,
+				snap->len, NULL);
+		g_byte_array_free(snap, TRUE);
+
+		if (g_atomic_int_add(&n_saves, 1) % 32 == 0)
+			snap_prune();
+	}
+
+	g_free(dir);
+	g_free(w->path);
+	g_array_free(w->items, TRUE);
+	g_free(w);
+
+	return NULL;
+}
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* If there is a snapshot for the directory with these details, return a
+ * new DirItem (from 'arena') for each item in it, with ITEM_FLAG_SNAPSHOT set.
+ * Returns NULL if there is no usable snapshot.
+ */
+GPtrArray *dirsnap_load(const struct stat *dir_info, DirArena *arena)
+{
+	gchar *path = snap_path(dir_info);
+	GMappedFile *map = g_mapped_file_new(path, FALSE, NULL);
+	const SnapHeader *header;
+	const SnapItem *items;
+	const guint32 *types;
+	const char *strings;
+	MIME_type **mime_types = NULL;
+	GPtrArray *ret = NULL;
+	gsize len;
+	int i;
+
+	g_free(path);
+	if (!map)
+		return NULL;
+
+	len = g_mapped_file_get_length(map);
+	header = (SnapHeader *) g_mapped_file_get_contents(map);
+
+	if (len < sizeof(SnapHeader) ||
+			memcmp(header->magic, SNAP_MAGIC, 8) != 0 ||
+			header->dev != (guint64) dir_info->st_dev ||
+			header->ino != (guint64) dir_info->st_ino ||
+			header->mtime != dir_info->st_mtime ||
+			header->ctime != dir_info->st_ctime ||
+			header->n_items > SNAP_MAX_ITEMS ||
+			header->n_types > G_MAXUINT16 ||
+			len != sizeof(SnapHeader) +
+				header->n_items * sizeof(SnapItem) +
+				header->n_types * sizeof(guint32) +
+				header->strings_size ||
+			header->strings_size == 0)
+		goto out;
+
+	items = (SnapItem *) (header + 1);
+	types = (guint32 *) (items + header->n_items);
+	strings = (char *) (types + header->n_types);
+
+	/* So that every string is terminated */
+	if (strings[header->strings_size - 1] != '\0')
+		goto out;
+
+	mime_types = g_new(MIME_type *, header->n_types);
+	for (i = 0; i < header->n_types; i++)
+	{
+		const char *name = snap_string(strings, header->strings_size,
+						types[i]);
+		if (!name || !strchr(name, '/'))
+			goto out;
+		mime_types[i] = mime_type_lookup(name);
+	}
+
+	ret = g_ptr_array_sized_new(header->n_items);
+	for (i = 0; i < header->n_items; i++)
+	{
+		const SnapItem *s = &items[i];
+		const char *leaf = snap_string(strings, header->strings_size,
+						s->leafname);
+		DirItem *item;
+
+		if (!leaf || !*leaf || s->type > header->n_types ||
+				s->base_type == TYPE_UNKNOWN ||
+				s->base_type == TYPE_ERROR)
+			continue;
+
+		item = diritem_new_in(arena, leaf);
+		item->base_type = s->base_type;
+		item->flags |= (s->flags & SNAP_FLAGS) | ITEM_FLAG_SNAPSHOT;
+		item->mode = s->mode;
+		item->uid = s->uid;
+		item->gid = s->gid;
+		item->size = s->size;
+		item->atime = s->atime;
+		item->ctime = s->ctime;
+		item->mtime = s->mtime;
+		item->mime_type = s->type ? mime_types[s->type - 1]
+			: mime_type_from_base_type(item->base_type);
+
+		g_ptr_array_add(ret, item);
+	}
+
+out:
+	g_free(mime_types);
+	g_mapped_file_unref(map);
+	return ret;
+}
+
+/* Save the details of these DirItems (in the background). Items which
+ * haven't been restatted are left out. The caller must prevent the items
+ * from changing until this returns, but only their details are copied
+ * here; the snapshot is made and written by another thread.
+ */
+void dirsnap_save(const struct stat *dir_info, GPtrArray *items)
+{
+	SnapWrite *w;
+	int i;
+
+	if (items->len > SNAP_MAX_ITEMS)
+		return;
+
+	w = g_new(SnapWrite, 1);
+	w->path = snap_path(dir_info);
+	w->dir_info = *dir_info;
+	w->items = g_array_sized_new(FALSE, FALSE, sizeof(SnapCopy),
+				     items->len);
+	w->strings = g_string_sized_new(items->len * 16);
+
+	for (i = 0; i < items->len; i++)
+	{
+		DirItem *item = (DirItem *) items->pdata[i];
+		SnapCopy c;
+
+		if (item->base_type == TYPE_UNKNOWN ||
+				item->base_type == TYPE_ERROR ||
+				item->lstat_errno)
+			continue;
+
+		memset(&c, 0, sizeof(c));
+		c.s.leafname = w->strings->len;
+		g_string_append_len(w->strings, item->leafname,
+				strlen(item->leafname) + 1);
+		c.type = item->mime_type;
+		c.s.base_type = item->base_type;
+		c.s.flags = item->flags & SNAP_FLAGS;
+		c.s.mode = item->mode;
+		c.s.uid = item->uid;
+		c.s.gid = item->gid;
+		c.s.size = item->size;
+		c.s.atime = item->atime;
+		c.s.ctime = item->ctime;
+		c.s.mtime = item->mtime;
+
+		g_array_append_val(w->items, c);
+	}
+
+	g_thread_unref(g_thread_new("dirsnap_t", write_thread, w));
+}
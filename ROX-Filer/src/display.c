@@ -465,7 +465,7 @@ void draw_huge_icon(
  * passed as arguments to display_set_sort_fn().
  */
 
-#define IS_A_DIR(item) (item->base_type == TYPE_DIRECTORY && \
+#define IS_A_DIR(item) (di_base_type(item) == TYPE_DIRECTORY && \
 			!(item->flags & ITEM_FLAG_APPDIR))
 
 #define SORT_DIRS	\
@@ -493,7 +493,8 @@ int sort_by_name(const void *item1, const void *item2)
 			return 1;
 	}
 
-	retval = strcmp(i1->collatekey, i2->collatekey);
+	retval = strcmp(di_collatekey((DirItem *) i1),
+			di_collatekey((DirItem *) i2));
 
 	return retval ? retval : strcmp(i1->leafname, i2->leafname);
 }
@@ -655,6 +656,7 @@ void display_set_sort_type(FilerWindow *filer_window, SortType sort_type,
 	filer_window->sort_order = order;
 
 	view_sort(filer_window->view);
+	filer_recheck_visible(filer_window);
 }
 
 /* Change the icon size and style.
@@ -735,6 +737,7 @@ void display_update_hidden(FilerWindow *filer_window)
 	filer_detach_rescan(filer_window);	/* (updates titlebar) */
 
 	display_set_actual_size(filer_window, FALSE);
+	filer_recheck_visible(filer_window);
 }
 
 /* Set the 'Show Hidden' flag for this window */
@@ -920,7 +923,10 @@ static void options_changed(void)
 		if (o_display_dirs_first.has_changed ||
 		    o_display_caps_first.has_changed ||
 		    o_display_newly_first.has_changed)
+		{
 			view_sort(VIEW(filer_window->view));
+			filer_recheck_visible(filer_window);
+		}
 
 		if (flags || changed)
 		{
@@ -1042,6 +1048,15 @@ static char *getdetails(FilerWindow *filer_window,
 				buf = g_strdup("1234b");
 			else
 				buf = g_strdup("1234 b");
+		} else if (item->flags & ITEM_FLAG_MORE_ITEMS)
+		{
+			/* Counting stopped; see diritem_examine_dir() */
+			if (filer_window->display_style == SMALL_ICONS)
+				buf = g_strdup_printf("%4" SIZE_FMT "+",
+						      item->size);
+			else
+				buf = g_strdup_printf("%" SIZE_FMT " +",
+						      item->size);
 		} else
 //		if (item->base_type != TYPE_DIRECTORY)
 		{
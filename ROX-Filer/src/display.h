@@ -24,6 +24,7 @@ struct _ViewData
 
 	MaskedPixmap *image;		/* Image; not thumbnail */
 	GdkPixbuf *thumb;
+	gint64 thumb_used;		/* When thumb was last drawn */
 	int iconstatus; //0:unknown, 1:init, 2:done, 3:may thumb, 4:delay, -1:re
 	gboolean recent;
 };
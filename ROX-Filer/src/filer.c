@@ -67,6 +67,7 @@
 #include "bookmarks.h"
 #include "xtypes.h"
 #include "usericons.h"
+#include "thumbpack.h"
 
 static XMLwrapper *groups = NULL;
 
@@ -160,6 +161,7 @@ static void filer_add_signals(FilerWindow *filer_window);
 static void set_selection_state(FilerWindow *filer_window, gboolean normal);
 static void filer_next_thumb(GObject *window, const gchar *path);
 static void start_thumb_scanning(FilerWindow *filer_window);
+static void sort_thumb_queue(FilerWindow *fw, GPtrArray *visible);
 static void filer_options_changed(void);
 static void drag_end(GtkWidget *widget, GdkDragContext *context,
 		     FilerWindow *filer_window);
@@ -480,6 +482,20 @@ static void queue_interesting(FilerWindow *filer_window)
 {
 	DirItem	*item;
 	ViewIter iter;
+	GPtrArray *visible;
+	int i;
+
+	/* What's on screen (and the next page) goes first */
+	visible = g_ptr_array_new();
+	view_visible_items(filer_window->view, visible,
+			   filer_window->scroll_dir);
+	for (i = 0; i < visible->len; i++)
+	{
+		item = visible->pdata[i];
+		if (item->flags & ITEM_FLAG_NEED_RESCAN_QUEUE)
+			dir_queue_recheck(filer_window->directory, item);
+	}
+	g_ptr_array_free(visible, TRUE);
 
 	view_get_iter(filer_window->view, &iter, 0);
 	while ((item = iter.next(&iter)))
@@ -487,6 +503,56 @@ static void queue_interesting(FilerWindow *filer_window)
 		if (item->flags & ITEM_FLAG_NEED_RESCAN_QUEUE)
 			dir_queue_recheck(filer_window->directory, item);
 	}
+
+	/* Items queued earlier may still be ahead of them */
+	filer_recheck_visible(filer_window);
+}
+
+static gboolean recheck_visible_cb(gpointer data)
+{
+	FilerWindow *fw = (FilerWindow *) data;
+	GPtrArray *visible;
+
+	fw->recheck_timeout = 0;
+	if (!g_list_find(all_filer_windows, fw)) return FALSE;//destroyed
+
+	visible = g_ptr_array_new();
+	view_visible_items(fw->view, visible, fw->scroll_dir);
+	dir_recheck_first(fw->directory, visible);
+	sort_thumb_queue(fw, visible);
+	g_ptr_array_free(visible, TRUE);
+
+	return FALSE;
+}
+
+/* The view has scrolled (or been refilled, resized or re-sorted). Soon,
+ * move whatever is now on screen to the front of the directory's restat and
+ * examine queues, and of the thumbnail queue (bringing back any thumbnails
+ * parked there).
+ */
+void filer_recheck_visible(FilerWindow *fw)
+{
+	if (!fw->recheck_timeout)
+		fw->recheck_timeout = g_timeout_add(100, recheck_visible_cb, fw);
+}
+
+static void scrolled(GtkRange *range, FilerWindow *filer_window)
+{
+	gdouble value = gtk_range_get_value(range);
+
+	if (value != filer_window->scroll_value)
+		filer_window->scroll_dir =
+			value > filer_window->scroll_value ? 1 : -1;
+	filer_window->scroll_value = value;
+
+	filer_recheck_visible(filer_window);
+}
+
+/* The window was resized (eg, maximised), so more may be on screen */
+static void scrollbar_resized(GtkWidget *widget, GtkAllocation *allocation,
+			      FilerWindow *filer_window)
+{
+	filer_recheck_visible(filer_window);
 }
 
 static gboolean _set_pointer(void *vp)
@@ -592,6 +658,7 @@ static void update_display(Directory *dir,
 				filer_window->req_sort = FALSE;
 				view_sort(view);
 				gtk_widget_queue_draw(GTK_WIDGET(view));
+				filer_recheck_visible(filer_window);
 			}
 
 			GdkColor *tmpc = xlabel_get(fw->sym_path);
@@ -645,7 +712,10 @@ static void update_display(Directory *dir,
 					filer_window->view_type == VIEW_TYPE_COLLECTION)
 			{
 				if (!filer_window->first_scan)
+				{
 					view_sort(view);
+					filer_recheck_visible(filer_window);
+				}
 				else
 					filer_window->req_sort = TRUE;
 			}
@@ -998,7 +1068,9 @@ static void filer_window_destroyed(GtkWidget *widget, FilerWindow *filer_window)
 	if (sdinfo.fw == filer_window)
 		free_subdir_info();
 
+	pixmap_cancel_thumbs(filer_window->window);
 	g_queue_free_full(filer_window->thumb_queue, g_free);
+	g_queue_free_full(filer_window->thumb_parked, g_free);
 
 	tooltip_show(NULL);
 
@@ -1743,6 +1815,7 @@ void filer_change_to(FilerWindow *fw,
 	gboolean have_cursor = view_cursor_visible(fw->view);
 
 	filer_cancel_thumbnails(fw);
+	fw->scroll_dir = 0;
 
 	tooltip_show(NULL);
 
@@ -1943,6 +2016,7 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->right_link_idle = 0;
 	filer_window->accept_timeout = 0;
 	filer_window->pointer_idle = 0;
+	filer_window->recheck_timeout = 0;
 	filer_window->resize_drag_width = 0;
 
 	tidy_sympath(filer_window->sym_path);
@@ -1957,6 +2031,9 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->temp_item_selected = FALSE;
 	filer_window->flags = (FilerFlags) 0;
 	filer_window->thumb_queue = g_queue_new();
+	filer_window->thumb_parked = g_queue_new();
+	filer_window->scroll_value = 0;
+	filer_window->scroll_dir = 0;
 	filer_window->thumb_bar_time = 0;
 	filer_window->max_thumbs = 0;
 	filer_window->trying_thumbs = 0;
@@ -2239,6 +2316,10 @@ static void filer_add_widgets(FilerWindow *filer_window, const gchar *wm_class)
 
 	/* Create this now to make the Adjustment before the View */
 	filer_window->scrollbar = gtk_vscrollbar_new(NULL);
+	g_signal_connect(filer_window->scrollbar, "value-changed",
+			G_CALLBACK(scrolled), filer_window);
+	g_signal_connect(filer_window->scrollbar, "size-allocate",
+			G_CALLBACK(scrollbar_resized), filer_window);
 
 	vbox = gtk_vbox_new(FALSE, 0);
 	gtk_container_add(GTK_CONTAINER(filer_window->window), vbox);
@@ -2869,6 +2950,7 @@ static gboolean make_dir_thumb_link()
 			goto done;
 		case 1:
 			{
+			pixmap_export_thumb(sp);
 			char *sub_thumb_path = pixmap_make_thumb_path(sp);
 			char *rel_path = get_relative_path(thumb_path, sub_thumb_path);
 			g_free(sub_thumb_path);
@@ -2893,7 +2975,7 @@ done:
 	return FALSE;
 }
 
-void filer_cancel_thumbnails(FilerWindow *filer_window)
+static void hide_thumb_bar(FilerWindow *filer_window)
 {
 	filer_window->thumb_bar_time = 0;
 	if (gtk_widget_get_visible(filer_window->thumb_bar))
@@ -2901,12 +2983,22 @@ void filer_cancel_thumbnails(FilerWindow *filer_window)
 		gtk_widget_hide(filer_window->thumb_bar);
 		filer_autosize(filer_window);
 	}
+}
+
+/* Forget all the thumbnails still to be made, and stop any being made */
+void filer_cancel_thumbnails(FilerWindow *filer_window)
+{
+	hide_thumb_bar(filer_window);
 
 	g_queue_free_full(filer_window->thumb_queue, g_free);
 	filer_window->thumb_queue = g_queue_new();
+	g_queue_free_full(filer_window->thumb_parked, g_free);
+	filer_window->thumb_parked = g_queue_new();
 
 	filer_window->max_thumbs = 0;
 
+	pixmap_cancel_thumbs(filer_window->window);
+
 	if (sdinfo.fw == filer_window)
 		sdinfo.cancel = TRUE;
 }
@@ -2955,7 +3047,14 @@ static gboolean filer_next_thumb_real(GObject *window)
 	if (g_queue_is_empty(filer_window->thumb_queue))
 	{
 		filer_window->trying_thumbs--;
-		if (filer_window->trying_thumbs == 0)
+		if (filer_window->trying_thumbs == 0 &&
+				!g_queue_is_empty(filer_window->thumb_parked))
+		{
+			/* The rest wait until they're scrolled to */
+			hide_thumb_bar(filer_window);
+			filer_window->max_thumbs = 0;
+		}
+		else if (filer_window->trying_thumbs == 0)
 			filer_cancel_thumbnails(filer_window);
 		g_object_unref(window);
 		return FALSE;
@@ -3046,6 +3145,106 @@ static void start_thumb_scanning(FilerWindow *filer_window)
 	filer_next_thumb(G_OBJECT(filer_window->window), NULL);
 }
 
+/* The leafname of 'path' if it's directly inside fw's directory */
+static const char *thumb_leaf(FilerWindow *fw, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	int len;
+
+	if (!slash)
+		return NULL;
+
+	len = slash - path;
+	if (len == 0)
+		return strcmp(fw->real_path, "/") == 0 ? slash + 1 : NULL;
+	if (strncmp(path, fw->real_path, len) != 0 || fw->real_path[len])
+		return NULL;
+
+	return slash + 1;
+}
+
+typedef struct {
+	int	rank;
+	gchar	*path;
+} ThumbJob;
+
+static gint by_rank(gconstpointer a, gconstpointer b)
+{
+	return ((ThumbJob *) a)->rank - ((ThumbJob *) b)->rank;
+}
+
+/* Order the thumbnail queue like 'visible' (see view_visible_items()), so
+ * that what's on screen is done first, then what's just ahead of the
+ * scrolling. Other items in the directory are far offscreen; they are
+ * parked in thumb_parked until they come near again. Anything else (eg,
+ * the files a directory's thumbnail is being chosen from) follows in its
+ * old order.
+ */
+static void sort_thumb_queue(FilerWindow *fw, GPtrArray *visible)
+{
+	GHashTable *rank;
+	GArray *near;
+	GQueue *parked, *other;
+	guint was_parked;
+	gchar *path;
+	int i;
+
+	if (!visible->len || (g_queue_is_empty(fw->thumb_queue) &&
+			      g_queue_is_empty(fw->thumb_parked)))
+		return;
+
+	rank = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = visible->len - 1; i >= 0; i--)
+		g_hash_table_insert(rank,
+				((DirItem *) visible->pdata[i])->leafname,
+				GINT_TO_POINTER(i + 1));
+
+	near = g_array_new(FALSE, FALSE, sizeof(ThumbJob));
+	parked = g_queue_new();
+	other = g_queue_new();
+	was_parked = g_queue_get_length(fw->thumb_parked);
+
+	/* In the order they would have been done (tail first) */
+	while ((path = g_queue_pop_tail(fw->thumb_queue)) ||
+	       (path = g_queue_pop_tail(fw->thumb_parked)))
+	{
+		const char *leaf = thumb_leaf(fw, path);
+		ThumbJob job;
+
+		if (!leaf)
+			g_queue_push_head(other, path);
+		else if ((job.rank = GPOINTER_TO_INT(
+				g_hash_table_lookup(rank, leaf))))
+		{
+			job.path = path;
+			g_array_append_val(near, job);
+		}
+		else
+			g_queue_push_head(parked, path);
+	}
+	g_hash_table_destroy(rank);
+
+	g_array_sort(near, by_rank);
+
+	/* Rebuild so that popping from the tail gives near, then other */
+	for (i = 0; i < near->len; i++)
+		g_queue_push_head(fw->thumb_queue,
+				  g_array_index(near, ThumbJob, i).path);
+	while ((path = g_queue_pop_tail(other)))
+		g_queue_push_head(fw->thumb_queue, path);
+	g_queue_free(other);
+	g_array_free(near, TRUE);
+
+	g_queue_free(fw->thumb_parked);
+	fw->thumb_parked = parked;
+
+	/* The progress bar only counts what will actually be done */
+	fw->max_thumbs += (int) was_parked - (int) g_queue_get_length(parked);
+
+	if (!g_queue_is_empty(fw->thumb_queue))
+		start_thumb_scanning(fw);
+}
+
 /* Set this image to be loaded some time in the future */
 void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 {
@@ -3102,6 +3301,9 @@ void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items)
 		path = make_path(filer_window->real_path, item->leafname);
 		filer_create_thumb(filer_window, path);
 	}
+
+	/* Put them in order, or park them */
+	filer_recheck_visible(filer_window);
 }
 
 static void filer_options_changed(void)
@@ -3907,6 +4109,8 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 
 		thumb_path = pixmap_make_thumb_path(path);
 		unlink(thumb_path); ///////////////////////////
+		thumbpack_remove(path);
+		pixmap_forget_failed_thumb(path);
 
 		dir_force_update_path(path, TRUE);
 
@@ -3936,6 +4140,29 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 		start_thumb_scanning(filer_window);
 }
 
+/* Try again to make the thumbnails we couldn't make before (eg, after
+ * installing a thumbnailer). Good thumbnails are left alone.
+ */
+void filer_retry_failed_thumbs(FilerWindow *filer_window)
+{
+	ViewIter iter;
+	DirItem *item;
+
+	view_get_iter(filer_window->view, &iter, 0);
+	while ((item = iter.next(&iter)))
+	{
+		const guchar *path;
+
+		if (item->base_type != TYPE_FILE)
+			continue;
+
+		path = make_path(filer_window->real_path, item->leafname);
+		if (pixmap_forget_failed_thumb(path) &&
+				filer_window->show_thumbs)
+			filer_create_thumb(filer_window, path);
+	}
+}
+
 static inline gboolean is_hidden(const char *dir, DirItem *item)
 {
 	/* If the leaf name starts with '.' then the item is hidden */
@@ -3974,11 +4201,11 @@ gboolean filer_match_filter(FilerWindow *filer_window, DirItem *item)
 	g_return_val_if_fail(item != NULL, FALSE);
 
 	if (filer_window->files_only &&
-			item->base_type == TYPE_DIRECTORY)
+			di_base_type(item) == TYPE_DIRECTORY)
 		return FALSE;
 
 	if (filer_window->dirs_only &&
-			item->base_type != TYPE_DIRECTORY)
+			di_base_type(item) != TYPE_DIRECTORY)
 		return FALSE;
 
 	if(is_hidden(filer_window->real_path, item) &&
@@ -3990,7 +4217,7 @@ gboolean filer_match_filter(FilerWindow *filer_window, DirItem *item)
 		if (!(
 			fnmatch(filer_window->filter_string,
 				item->leafname, 0) == 0 ||
-			(item->base_type == TYPE_DIRECTORY &&
+			(di_base_type(item) == TYPE_DIRECTORY &&
 				!filer_window->filter_directories)
 		))
 			return FALSE;
@@ -106,9 +106,13 @@ struct _FilerWindow
 	guint accept_timeout;
 
 	guint pointer_idle;
+	guint recheck_timeout;	/* See filer_recheck_visible() */
+	gdouble scroll_value;	/* Last scrollbar position */
+	int scroll_dir;		/* Which way it last moved (-1, 0, 1) */
 
 	gboolean	show_thumbs;
 	GQueue		*thumb_queue;		/* paths to thumbnail */
+	GQueue		*thumb_parked;		/* far offscreen, for later */
 	GtkWidget	*thumb_bar;
 	gint64		thumb_bar_time;
 	int		max_thumbs;		/* total for this batch */
@@ -195,6 +199,7 @@ void filer_create_thumb(FilerWindow *filer_window, const gchar *pathname);
 void filer_cancel_thumbnails(FilerWindow *filer_window);
 void filer_set_title(FilerWindow *filer_window);
 void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items);
+void filer_recheck_visible(FilerWindow *fw);
 void filer_add_tip_details(FilerWindow *filer_window,
 			   GString *tip, DirItem *item);
 void filer_selection_changed(FilerWindow *filer_window, gint time);
@@ -212,6 +217,7 @@ gint filer_key_press_event(GtkWidget *widget, GdkEventKey *event,
 void filer_set_autoscroll(FilerWindow *filer_window, gboolean auto_scroll);
 void filer_refresh(FilerWindow *filer_window);
 void filer_refresh_thumbs(FilerWindow *filer_window);
+void filer_retry_failed_thumbs(FilerWindow *filer_window);
 
 gboolean filer_match_filter(FilerWindow *filer_window, DirItem *item);
 gboolean filer_set_filter(FilerWindow *filer_window,
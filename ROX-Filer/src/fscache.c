@@ -39,15 +39,49 @@
 		 && data->mode == info.st_mode)		\
 
 
+/* Recent stat() results by path, shared by all caches. Every lookup starts
+ * with a stat(), and the thumbnail code looks the same file up in several
+ * caches in turn. An entry lasts until the end of the main loop iteration
+ * (or STAT_MEMO_TIME, for lookups from other threads), or until a
+ * directory monitor or g_fscache_update() says the file has changed.
+ */
+#define STAT_MEMO_TIME 50000	/* Microseconds */
+#define STAT_MEMO_MAX 64	/* Per shard */
+#define STAT_MEMO_SHARDS 16
+
+typedef struct _StatMemo StatMemo;
+struct _StatMemo
+{
+	struct stat info;
+	gint64	    time;
+};
+
+static struct {
+	GHashTable *table;	/* Path -> StatMemo */
+	GMutex	   mutex;
+} stat_memo[STAT_MEMO_SHARDS];
+static gint memo_clear = 0;		/* Idle to empty stat_memo queued */
+static guint stats_saved = 0, stats_made = 0;
+
+/* Times a thread had to wait for a lock on a shard */
+static guint lock_waits = 0;
+
 /* Static prototypes */
 
+static int memo_stat(const char *pathname, struct stat *info);
+static void lock_counted(GMutex *mutex);
+static GFSCacheShard *shard_for(GFSCache *cache, GFSCacheKey *key);
 static guint hash_key(gconstpointer key);
 static gint cmp_stats(gconstpointer a, gconstpointer b);
+static gint cmp_last_used(gconstpointer a, gconstpointer b);
+static gboolean trim_idle_cb(gpointer data);
 static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data);
 static gboolean purge_hash_entry(gpointer key, gpointer data,
 				 gpointer user_data);
+static void note_cost(GFSCache *cache, GFSCacheData *data);
 static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type);
+					FSCacheLookup lookup_type,
+					GFSCacheShard **locked);
 
 
 struct PurgeInfo
@@ -55,6 +89,24 @@ struct PurgeInfo
 	GFSCache *cache;
 	gint	 age;
 	time_t	 now;
+	gsize	 freed;		/* Cost of the entries removed */
+};
+
+/* An object g_fscache_foreach() is holding, with a copy of its key */
+typedef struct _ForeachEntry ForeachEntry;
+struct _ForeachEntry
+{
+	GFSCacheKey	key;
+	GObject		*object;
+};
+
+/* An entry being considered by g_fscache_trim() */
+typedef struct _TrimEntry TrimEntry;
+struct _TrimEntry
+{
+	GFSCacheShard	*shard;
+	GFSCacheKey	*key;
+	GFSCacheData	*data;
 };
 
 /****************************************************************
@@ -80,23 +132,45 @@ GFSCache *g_fscache_new(GFSLoadFunc load,
 			gpointer user_data)
 {
 	GFSCache *cache;
+	int i;
 
 	cache = g_new(GFSCache, 1);
-	cache->inode_to_stats = g_hash_table_new(hash_key, cmp_stats);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		cache->shards[i].inode_to_stats =
+			g_hash_table_new(hash_key, cmp_stats);
+		g_mutex_init(&cache->shards[i].mutex);
+	}
 	g_mutex_init(&cache->mutex);
 	cache->load = load;
 	cache->update = update;
 	cache->user_data = user_data;
+	cache->cost = NULL;
+	cache->budget = 0;
+	cache->total = 0;
+	cache->trim_idle = 0;
+	cache->evicted = 0;
 
 	return cache;
 }
 
 void g_fscache_destroy(GFSCache *cache)
 {
+	int i;
+
 	g_return_if_fail(cache != NULL);
 
-	g_hash_table_foreach(cache->inode_to_stats, destroy_hash_entry, NULL);
-	g_hash_table_destroy(cache->inode_to_stats);
+	if (cache->trim_idle)
+		g_source_remove(cache->trim_idle);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+
+		g_hash_table_foreach(shard->inode_to_stats,
+				     destroy_hash_entry, NULL);
+		g_hash_table_destroy(shard->inode_to_stats);
+		g_mutex_clear(&shard->mutex);
+	}
 	g_mutex_clear(&cache->mutex);
 
 	g_free(cache);
@@ -127,19 +201,24 @@ void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 		      gboolean update_details)
 {
 	GFSCacheData	*data;
+	GFSCacheShard	*shard;
+	GObject		*old;
 
 	data = lookup_internal(cache, pathname,
 			update_details ? FSCACHE_LOOKUP_INIT
-				       : FSCACHE_LOOKUP_INSERT);
+				       : FSCACHE_LOOKUP_INSERT, &shard);
 
 	if (!data)
 		return;
 
 	if (obj)
 		g_object_ref(obj);
-	if (data->data)
-		g_object_unref(data->data);
+	old = data->data;
 	data->data = obj;
+	g_mutex_unlock(&shard->mutex);
+
+	if (old)
+		g_object_unref(old);
 }
 
 /* As g_fscache_lookup, but 'lookup_type' controls what happens if the data
@@ -154,10 +233,12 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				gboolean *found)
 {
 	GFSCacheData *data;
+	GFSCacheShard *shard;
+	GObject *obj;
 
 	g_return_val_if_fail(lookup_type != FSCACHE_LOOKUP_INIT, NULL);
 
-	data = lookup_internal(cache, pathname, lookup_type);
+	data = lookup_internal(cache, pathname, lookup_type, &shard);
 
 	if (!data)
 	{
@@ -169,10 +250,15 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 	if (found)
 		*found = TRUE;
 
-	if (data->data)
-		g_object_ref(data->data);
+	/* Ref it before unlocking, so that g_fscache_trim() can see
+	 * it's in use.
+	 */
+	obj = data->data;
+	if (obj)
+		g_object_ref(obj);
+	g_mutex_unlock(&shard->mutex);
 
-	return data->data;
+	return obj;
 }
 
 /* Call the update() function on this item if it's in the cache
@@ -181,6 +267,7 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 void g_fscache_may_update(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
 	struct stat 	info;
 
@@ -188,14 +275,15 @@ void g_fscache_may_update(GFSCache *cache, const char *pathname)
 	g_return_if_fail(pathname != NULL);
 	g_return_if_fail(cache->update != NULL);
 
-	if (mc_stat(pathname, &info))
+	if (memo_stat(pathname, &info))
 		return;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	shard = shard_for(cache, &key);
+	lock_counted(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
 	if (data && !UPTODATE(data, info))
 	{
@@ -205,13 +293,14 @@ void g_fscache_may_update(GFSCache *cache, const char *pathname)
 		data->length = info.st_size;
 		data->mode = info.st_mode;
 	}
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_unlock(&shard->mutex);
 }
 
 /* Call the update() function on this item iff it's in the cache. */
 void g_fscache_update(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
 	struct stat 	info;
 
@@ -219,14 +308,16 @@ void g_fscache_update(GFSCache *cache, const char *pathname)
 	g_return_if_fail(pathname != NULL);
 	g_return_if_fail(cache->update != NULL);
 
+	g_fscache_forget_stat(pathname);
 	if (mc_stat(pathname, &info))
 		return;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	shard = shard_for(cache, &key);
+	lock_counted(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
 	if (data)
 	{
@@ -236,12 +327,13 @@ void g_fscache_update(GFSCache *cache, const char *pathname)
 		data->length = info.st_size;
 		data->mode = info.st_mode;
 	}
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_unlock(&shard->mutex);
 }
 
 void g_fscache_remove(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey key;
+	GFSCacheShard *shard;
 	GFSCacheData *data;
 	struct stat info;
 
@@ -254,10 +346,18 @@ void g_fscache_remove(GFSCache *cache, const char *pathname)
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
 
-	g_mutex_lock(&cache->mutex);
-	data = (GFSCacheData *) g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_hash_table_remove(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
+	shard = shard_for(cache, &key);
+	lock_counted(&shard->mutex);
+	data = (GFSCacheData *) g_hash_table_lookup(shard->inode_to_stats, &key);
+	g_hash_table_remove(shard->inode_to_stats, &key);
+	g_mutex_unlock(&shard->mutex);
+
+	if (data)
+	{
+		g_mutex_lock(&cache->mutex);
+		cache->total -= MIN(cache->total, data->cost);
+		g_mutex_unlock(&cache->mutex);
+	}
 
 	if (data && data->data)
 		g_object_unref(data->data);
@@ -271,25 +371,494 @@ void g_fscache_remove(GFSCache *cache, const char *pathname)
 void g_fscache_purge(GFSCache *cache, gint age)
 {
 	struct PurgeInfo info;
+	int i;
 
 	g_return_if_fail(cache != NULL);
 
 	info.age = age;
 	info.cache = cache;
 	info.now = time(NULL);
+	info.freed = 0;
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+
+		lock_counted(&shard->mutex);
+		g_hash_table_foreach_remove(shard->inode_to_stats,
+				purge_hash_entry, (gpointer) &info);
+		g_mutex_unlock(&shard->mutex);
+	}
+
+	g_mutex_lock(&cache->mutex);
+	cache->total -= MIN(cache->total, info.freed);
+	g_mutex_unlock(&cache->mutex);
+}
+
+/* Call func(GFSCacheKey, GObject, user_data) for each loaded object. The
+ * cache isn't locked while func runs, so func may use it; the key is a copy
+ * and the object is held until func returns, so both stay valid even if the
+ * entry is removed or replaced meanwhile.
+ */
+void g_fscache_foreach(GFSCache *cache, GHFunc func, gpointer user_data)
+{
+	GHashTableIter iter;
+	GArray *entries;
+	GFSCacheShard *shard;
+	GFSCacheKey *key;
+	GFSCacheData *data;
+	ForeachEntry entry;
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	entries = g_array_new(FALSE, FALSE, sizeof(ForeachEntry));
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		shard = &cache->shards[i];
+
+		lock_counted(&shard->mutex);
+		g_hash_table_iter_init(&iter, shard->inode_to_stats);
+		while (g_hash_table_iter_next(&iter, (gpointer *) &key,
+					      (gpointer *) &data))
+		{
+			if (!data->data)
+				continue;
+			entry.key = *key;
+			entry.object = g_object_ref(data->data);
+			g_array_append_val(entries, entry);
+		}
+		g_mutex_unlock(&shard->mutex);
+	}
+
+	for (i = 0; i < entries->len; i++)
+	{
+		ForeachEntry *e = &g_array_index(entries, ForeachEntry, i);
+
+		func(&e->key, e->object, user_data);
+		g_object_unref(e->object);
+	}
+
+	g_array_free(entries, TRUE);
+}
+
+/* Limit the cache to about 'budget' bytes, as measured by cost(). When
+ * it's over, the least recently used objects that nobody else has a ref
+ * on are dropped until it isn't. A budget of 0 means no limit.
+ * Objects' costs may grow after they're loaded (eg, a Directory being
+ * scanned), so they're all measured again each time we trim; that's done
+ * in the main loop soon after a load takes the cache over budget, and
+ * when the owner calls g_fscache_trim().
+ */
+void g_fscache_set_budget(GFSCache *cache, GFSCostFunc cost, gsize budget)
+{
+	g_return_if_fail(cache != NULL);
+
+	g_mutex_lock(&cache->mutex);
+	cache->cost = cost;
+	cache->budget = cost ? budget : 0;
+	g_mutex_unlock(&cache->mutex);
+
+	g_fscache_trim(cache);
+}
+
+/* Drop objects until the cache is within its budget (if it has one) */
+void g_fscache_trim(GFSCache *cache)
+{
+	GHashTableIter iter;
+	GArray *entries;
+	TrimEntry entry;
+	gsize total = 0, budget;
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	g_mutex_lock(&cache->mutex);
+	budget = cache->budget;
+	g_mutex_unlock(&cache->mutex);
+	if (!budget)
+		return;
+
+	/* Always lock the shards in order, and before cache->mutex */
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+		lock_counted(&cache->shards[i].mutex);
+
+	entries = g_array_new(FALSE, FALSE, sizeof(TrimEntry));
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		entry.shard = &cache->shards[i];
+		g_hash_table_iter_init(&iter, entry.shard->inode_to_stats);
+		while (g_hash_table_iter_next(&iter, (gpointer *) &entry.key,
+					      (gpointer *) &entry.data))
+		{
+			GFSCacheData *data = entry.data;
+
+			data->cost = data->data ?
+				cache->cost(data->data, cache->user_data) : 0;
+			total += data->cost + sizeof(GFSCacheData);
+			g_array_append_val(entries, entry);
+		}
+	}
+
+	if (total > budget)
+	{
+		g_array_sort(entries, cmp_last_used);
+
+		for (i = 0; i < entries->len && total > budget; i++)
+		{
+			TrimEntry *e = &g_array_index(entries, TrimEntry, i);
+			GFSCacheData *data = e->data;
+
+			/* Still loading, or someone's using it, so dropping
+			 * it would save nothing.
+			 */
+			if (!data->data || data->data->ref_count > 1)
+				continue;
+
+			total -= data->cost + sizeof(GFSCacheData);
+			g_hash_table_remove(e->shard->inode_to_stats, e->key);
+			destroy_hash_entry(e->key, data, NULL);
+			cache->evicted++;
+		}
+	}
+
+	g_mutex_lock(&cache->mutex);
+	cache->total = total;
+	g_mutex_unlock(&cache->mutex);
+
+	for (i = FSCACHE_SHARDS - 1; i >= 0; i--)
+		g_mutex_unlock(&cache->shards[i].mutex);
+
+	g_array_free(entries, TRUE);
+}
+
+/* g_fscache_trim() from the main loop, eg once the caller has dropped
+ * its ref on something.
+ */
+void g_fscache_trim_soon(GFSCache *cache)
+{
+	g_return_if_fail(cache != NULL);
 
 	g_mutex_lock(&cache->mutex);
-	g_hash_table_foreach_remove(cache->inode_to_stats, purge_hash_entry,
-			(gpointer) &info);
+	if (cache->budget && !cache->trim_idle)
+		cache->trim_idle = g_idle_add(trim_idle_cb, cache);
 	g_mutex_unlock(&cache->mutex);
 }
 
+/* Forget any stat() of this path that later lookups would reuse, because
+ * it has just changed. NULL forgets them all.
+ */
+void g_fscache_forget_stat(const char *pathname)
+{
+	int i;
+
+	for (i = 0; i < STAT_MEMO_SHARDS; i++)
+	{
+		if (pathname &&
+		    i != (int) (g_str_hash(pathname) % STAT_MEMO_SHARDS))
+			continue;
+
+		g_mutex_lock(&stat_memo[i].mutex);
+		if (stat_memo[i].table)
+		{
+			if (pathname)
+				g_hash_table_remove(stat_memo[i].table,
+						    pathname);
+			else
+				g_hash_table_remove_all(stat_memo[i].table);
+		}
+		g_mutex_unlock(&stat_memo[i].mutex);
+	}
+}
+
+/* How many stat()s the cache has made, and how many it saved by reusing
+ * a recent result. Either may be NULL.
+ */
+void g_fscache_stat_counts(guint *saved, guint *made)
+{
+	if (saved)
+		*saved = g_atomic_int_get(&stats_saved);
+	if (made)
+		*made = g_atomic_int_get(&stats_made);
+}
+
+/* How many times a lookup had to wait for another thread using the same
+ * part of a cache (or of the stat() memo).
+ */
+guint g_fscache_lock_waits(void)
+{
+	return g_atomic_int_get(&lock_waits);
+}
+
+#ifdef UNIT_TESTS
+static GObject *test_load(const char *pathname, gpointer user_data)
+{
+	return g_object_new(G_TYPE_OBJECT, NULL);
+}
+
+typedef struct {
+	GFSCache *cache;
+	GPtrArray *paths;
+} BenchJob;
+
+static gpointer bench_thread(gpointer data)
+{
+	BenchJob *job = (BenchJob *) data;
+	int n, i;
+
+	for (n = 0; n < 100; n++)
+		for (i = 0; i < job->paths->len; i++)
+		{
+			GObject *obj = g_fscache_lookup(job->cache,
+							job->paths->pdata[i]);
+			if (obj)
+				g_object_unref(obj);
+		}
+
+	return NULL;
+}
+
+typedef struct {
+	GFSCache *cache;
+	const char *path;
+	GObject *got;
+} RaceJob;
+
+static gpointer race_thread(gpointer data)
+{
+	RaceJob *job = (RaceJob *) data;
+
+	job->got = g_fscache_lookup(job->cache, job->path);
+
+	return NULL;
+}
+
+/* Several threads missing on the same file at once must all get the same
+ * object, and the cache must hold the only other ref to it.
+ */
+static void race_tests(const char *path)
+{
+	GFSCache *cache;
+	GThread *threads[4];
+	RaceJob jobs[4];
+	int i;
+
+	cache = g_fscache_new(test_load, NULL, NULL);
+	g_fscache_forget_stat(path);
+
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+	{
+		jobs[i].cache = cache;
+		jobs[i].path = path;
+		threads[i] = g_thread_new("fscache_race", race_thread, &jobs[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+		g_thread_join(threads[i]);
+
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+		if (jobs[i].got != jobs[0].got)
+			g_error("fscache: racing lookups got different objects");
+	if (jobs[0].got->ref_count != G_N_ELEMENTS(threads) + 1)
+		g_error("fscache: %d refs after racing lookups",
+			jobs[0].got->ref_count);
+
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+		g_object_unref(jobs[i].got);
+	g_fscache_destroy(cache);
+}
+
+/* Look up everything in $ROX_FSCACHE_BENCH (eg /usr/share/pixmaps) from
+ * four threads at once, and report how often they had to wait for each
+ * other.
+ */
+static void lookup_bench(void)
+{
+	const char *dirpath = g_getenv("ROX_FSCACHE_BENCH");
+	GThread *threads[4];
+	const gchar *leaf;
+	BenchJob job;
+	guint waits;
+	GTimer *timer;
+	GDir *dir;
+	int i;
+
+	if (!dirpath || !(dir = g_dir_open(dirpath, 0, NULL)))
+		return;
+
+	job.cache = g_fscache_new(test_load, NULL, NULL);
+	job.paths = g_ptr_array_new_with_free_func(g_free);
+	while ((leaf = g_dir_read_name(dir)))
+		g_ptr_array_add(job.paths,
+				g_build_filename(dirpath, leaf, NULL));
+	g_dir_close(dir);
+
+	waits = g_fscache_lock_waits();
+	timer = g_timer_new();
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+		threads[i] = g_thread_new("fscache_bench", bench_thread, &job);
+	for (i = 0; i < G_N_ELEMENTS(threads); i++)
+		g_thread_join(threads[i]);
+	g_timer_stop(timer);
+
+	g_print("fscache: %u lookups in %.3fs, %u lock waits\n",
+			job.paths->len * 100 * G_N_ELEMENTS(threads),
+			g_timer_elapsed(timer, NULL),
+			g_fscache_lock_waits() - waits);
+
+	g_timer_destroy(timer);
+	g_ptr_array_free(job.paths, TRUE);
+	g_fscache_destroy(job.cache);
+}
+
+/* Looking a file up twice (in two caches) should stat() it once, and
+ * g_fscache_forget_stat() should make the next lookup stat() again.
+ */
+void fscache_tests(void)
+{
+	GFSCache *a, *b;
+	gchar *path;
+	guint saved0, made0, saved, made;
+	int fd;
+
+	fd = g_file_open_tmp("rox-fscache-XXXXXX", &path, NULL);
+	g_return_if_fail(fd != -1);
+	close(fd);
+
+	a = g_fscache_new(test_load, NULL, NULL);
+	b = g_fscache_new(test_load, NULL, NULL);
+	g_fscache_forget_stat(path);
+	g_fscache_stat_counts(&saved0, &made0);
+
+	g_object_unref(g_fscache_lookup(a, path));
+	g_object_unref(g_fscache_lookup(b, path));
+	g_fscache_stat_counts(&saved, &made);
+	if (made - made0 != 1 || saved - saved0 != 1)
+		g_error("fscache: %u stats for two lookups", made - made0);
+
+	g_fscache_forget_stat(path);
+	g_object_unref(g_fscache_lookup(a, path));
+	g_fscache_stat_counts(&saved, &made);
+	if (made - made0 != 2)
+		g_error("fscache: forgotten stat was reused");
+
+	g_print("fscache: %u stats saved, %u made\n", saved, made);
+
+	race_tests(path);
+
+	g_fscache_destroy(a);
+	g_fscache_destroy(b);
+	unlink(path);
+	g_free(path);
+
+	lookup_bench();
+}
+#endif
 
 /****************************************************************
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
 
 
+/* Sorts TrimEntries, least recently used first */
+static gint cmp_last_used(gconstpointer a, gconstpointer b)
+{
+	const GFSCacheData *da = ((TrimEntry *) a)->data;
+	const GFSCacheData *db = ((TrimEntry *) b)->data;
+
+	return da->last_used < db->last_used ? -1 :
+	       da->last_used > db->last_used ? 1 : 0;
+}
+
+static void lock_counted(GMutex *mutex)
+{
+	if (g_mutex_trylock(mutex))
+		return;
+
+	g_atomic_int_inc(&lock_waits);
+	g_mutex_lock(mutex);
+}
+
+static GFSCacheShard *shard_for(GFSCache *cache, GFSCacheKey *key)
+{
+	/* Multiplicative hash; the top bits are the best mixed */
+	guint32 h = (guint32) (key->inode ^ key->device) * 2654435761u;
+
+	return &cache->shards[h >> 28];
+}
+
+static gboolean trim_idle_cb(gpointer data)
+{
+	GFSCache *cache = (GFSCache *) data;
+
+	g_mutex_lock(&cache->mutex);
+	cache->trim_idle = 0;
+	g_mutex_unlock(&cache->mutex);
+
+	g_fscache_trim(cache);
+
+	return FALSE;
+}
+
+static gboolean clear_memo(gpointer data)
+{
+	int i;
+
+	g_atomic_int_set(&memo_clear, 0);
+
+	for (i = 0; i < STAT_MEMO_SHARDS; i++)
+	{
+		g_mutex_lock(&stat_memo[i].mutex);
+		if (stat_memo[i].table)
+			g_hash_table_remove_all(stat_memo[i].table);
+		g_mutex_unlock(&stat_memo[i].mutex);
+	}
+
+	return FALSE;
+}
+
+/* stat() pathname, unless we did so very recently */
+static int memo_stat(const char *pathname, struct stat *info)
+{
+	StatMemo *memo;
+	gint64 now = g_get_monotonic_time();
+	int i = g_str_hash(pathname) % STAT_MEMO_SHARDS;
+
+	lock_counted(&stat_memo[i].mutex);
+	memo = stat_memo[i].table ?
+		g_hash_table_lookup(stat_memo[i].table, pathname) : NULL;
+	if (memo && now - memo->time < STAT_MEMO_TIME)
+	{
+		*info = memo->info;
+		g_mutex_unlock(&stat_memo[i].mutex);
+		g_atomic_int_inc(&stats_saved);
+		return 0;
+	}
+	g_mutex_unlock(&stat_memo[i].mutex);
+
+	g_atomic_int_inc(&stats_made);
+	if (mc_stat(pathname, info))
+		return -1;
+
+	memo = g_new(StatMemo, 1);
+	memo->info = *info;
+	memo->time = now;
+
+	lock_counted(&stat_memo[i].mutex);
+	if (!stat_memo[i].table)
+		stat_memo[i].table = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free, g_free);
+	if (g_hash_table_size(stat_memo[i].table) >= STAT_MEMO_MAX)
+		g_hash_table_remove_all(stat_memo[i].table);
+	g_hash_table_replace(stat_memo[i].table, g_strdup(pathname), memo);
+	g_mutex_unlock(&stat_memo[i].mutex);
+
+	/* High priority, so it runs first thing in the next iteration */
+	if (g_atomic_int_compare_and_exchange(&memo_clear, 0, 1))
+		g_idle_add_full(G_PRIORITY_HIGH, clear_memo, NULL, NULL);
+
+	return 0;
+}
+
 /* Generate a hash number for some stats */
 static guint hash_key(gconstpointer key)
 {
@@ -332,6 +901,8 @@ static gboolean purge_hash_entry(gpointer key, gpointer data,
 		&& cache_data->last_lookup >= info->now - info->age)
 		return FALSE;
 
+	info->freed += cache_data->cost;
+
 	if (cache_data->data)
 		g_object_unref(cache_data->data);
 
@@ -341,28 +912,57 @@ static gboolean purge_hash_entry(gpointer key, gpointer data,
 	return TRUE;
 }
 
+/* Add the cost of data's newly loaded object to the cache's total, and
+ * trim it soon if that takes it over budget.
+ */
+static void note_cost(GFSCache *cache, GFSCacheData *data)
+{
+	gsize cost;
+	gboolean over;
+
+	if (!data->data || !cache->cost)
+		return;
+
+	cost = cache->cost(data->data, cache->user_data);
+
+	g_mutex_lock(&cache->mutex);
+	cache->total += cost - MIN(cost, data->cost);
+	data->cost = cost;
+	over = cache->total > cache->budget;
+	g_mutex_unlock(&cache->mutex);
+
+	if (over)
+		g_fscache_trim_soon(cache);
+}
+
 /* As for g_fscache_lookup_full, but return the GFSCacheData rather than
- * the data it contains. Doesn't increment the refcount.
+ * the data it contains. Doesn't increment the refcount. If it returns
+ * non-NULL, the shard it's in is still locked and stored in 'locked'; the
+ * caller must unlock it once it has finished with the GFSCacheData, which
+ * g_fscache_trim() may free after that.
  */
 static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type)
+					FSCacheLookup lookup_type,
+					GFSCacheShard **locked)
 {
 	struct stat 	info;
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
 
 	g_return_val_if_fail(cache != NULL, NULL);
 	g_return_val_if_fail(pathname != NULL, NULL);
 
-	if (mc_stat(pathname, &info))
+	if (memo_stat(pathname, &info))
 		return NULL;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
+	shard = shard_for(cache, &key);
+retry:
+	lock_counted(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
 	if (data)
 	{
@@ -381,7 +981,10 @@ static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 			goto out;
 
 		if (lookup_type == FSCACHE_LOOKUP_ONLY_NEW)
+		{
+			g_mutex_unlock(&shard->mutex);
 			return NULL;
+		}
 
 		/* Out-of-date */
 		if (cache->update)
@@ -395,20 +998,49 @@ static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
 	}
 	else
 	{
-		GFSCacheKey *new_key;
+		GObject *obj = NULL;
 
 		if (lookup_type != FSCACHE_LOOKUP_CREATE &&
 		    lookup_type != FSCACHE_LOOKUP_INIT)
+		{
+			g_mutex_unlock(&shard->mutex);
 			return NULL;
+		}
 
-		new_key = g_memdup(&key, sizeof(key));
+		if (lookup_type == FSCACHE_LOOKUP_CREATE && cache->load)
+		{
+			/* Don't hold up lookups of other files in this
+			 * shard while we load it.
+			 */
+			g_mutex_unlock(&shard->mutex);
+			obj = cache->load(pathname, cache->user_data);
+			lock_counted(&shard->mutex);
+
+			if (g_hash_table_lookup(shard->inode_to_stats, &key))
+			{
+				/* Another thread loaded it meanwhile. Use
+				 * theirs, so that there's only ever one.
+				 */
+				g_mutex_unlock(&shard->mutex);
+				if (obj)
+					g_object_unref(obj);
+				goto retry;
+			}
+		}
 
 		data = g_new(GFSCacheData, 1);
-		data->data = NULL;
+		data->data = obj;
+		data->cost = 0;
 
-		g_mutex_lock(&cache->mutex);
-		g_hash_table_insert(cache->inode_to_stats, new_key, data);
-		g_mutex_unlock(&cache->mutex);
+		g_hash_table_insert(shard->inode_to_stats,
+				    g_memdup(&key, sizeof(key)), data);
+		note_cost(cache, data);
+
+		data->m_time = info.st_mtime;
+		data->c_time = info.st_ctime;
+		data->length = info.st_size;
+		data->mode = info.st_mode;
+		goto out;
 	}
 
 init:
@@ -424,10 +1056,12 @@ init:
 		/* Create the object for the file (ie, not an update) */
 		if (cache->load)
 			data->data = cache->load(pathname, cache->user_data);
+		note_cost(cache, data);
 	}
 out:
 	data->last_lookup = time(NULL);
+	data->last_used = g_get_monotonic_time();
 
+	*locked = shard;
 	return data;
 }
-
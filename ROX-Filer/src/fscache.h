@@ -18,6 +18,7 @@ typedef GObject *(*GFSLoadFunc)(const char *pathname, gpointer user_data);
 typedef void (*GFSUpdateFunc)(gpointer object,
 			      const char *pathname,
 			      gpointer user_data);
+typedef gsize (*GFSCostFunc)(gpointer object, gpointer user_data);
 typedef enum {
 	FSCACHE_LOOKUP_CREATE,	/* Load if missing. Update as needed. */
 	FSCACHE_LOOKUP_ONLY_NEW,/* Return NULL if not present AND uptodate */
@@ -26,13 +27,33 @@ typedef enum {
 	FSCACHE_LOOKUP_INSERT,	/* Internal use */
 } FSCacheLookup;
 
-struct _GFSCache
+/* Each cache's table is split by inode, so that threads looking up
+ * different files don't wait for each other.
+ */
+#define FSCACHE_SHARDS 16
+
+typedef struct _GFSCacheShard GFSCacheShard;
+
+struct _GFSCacheShard
 {
 	GHashTable    *inode_to_stats;
 	GMutex        mutex;
+};
+
+struct _GFSCache
+{
+	GFSCacheShard shards[FSCACHE_SHARDS];
+	GMutex        mutex;	/* For the budget fields */
 	GFSLoadFunc   load;
 	GFSUpdateFunc update;
 	gpointer      user_data;
+
+	/* See g_fscache_set_budget() */
+	GFSCostFunc   cost;
+	gsize         budget;	/* 0 => no limit */
+	gsize         total;	/* Cost of everything, as last worked out */
+	guint         trim_idle;
+	guint         evicted;	/* Number of objects dropped for the budget */
 };
 typedef struct _GFSCacheKey GFSCacheKey;
 typedef struct _GFSCacheData GFSCacheData;
@@ -47,6 +68,8 @@ struct _GFSCacheData
 {
 	GObject *data;		/* The object from the file */
 	time_t  last_lookup;
+	gint64  last_used;	/* Monotonic time, for the budget */
+	gsize   cost;		/* From cache->cost, when last worked out */
 
 	/* Details of the file last time we checked it */
 	time_t  m_time, c_time;
@@ -66,8 +89,19 @@ void g_fscache_may_update(GFSCache *cache, const char *pathname);
 void g_fscache_update(GFSCache *cache, const char *pathname);
 void g_fscache_remove(GFSCache *cache, const char *pathname);
 void g_fscache_purge(GFSCache *cache, gint age);
+void g_fscache_set_budget(GFSCache *cache, GFSCostFunc cost, gsize budget);
+void g_fscache_trim(GFSCache *cache);
+void g_fscache_trim_soon(GFSCache *cache);
+void g_fscache_forget_stat(const char *pathname);
+void g_fscache_stat_counts(guint *saved, guint *made);
+guint g_fscache_lock_waits(void);
+void g_fscache_foreach(GFSCache *cache, GHFunc func, gpointer user_data);
 
 void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 		      gboolean update_details);
 
+#ifdef UNIT_TESTS
+void fscache_tests(void);
+#endif
+
 #endif /* _FSCACHE_H */
@@ -33,6 +33,9 @@ typedef struct _Directory Directory;
  */
 typedef struct _DirItem DirItem;
 
+/* Memory for the DirItems of one Directory; see diritem_new_in() */
+typedef struct _DirArena DirArena;
+
 /* Widgets which can display directories implement the View interface.
  * This should be used in preference to the old collection interface because
  * it isn't specific to a particular type of display.
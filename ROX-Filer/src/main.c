@@ -61,6 +61,8 @@
 #include "type.h"
 #include "pixmaps.h"
 #include "dir.h"
+#include "fscache.h"
+#include "boxscale.h"
 #include "diritem.h"
 #include "action.h"
 #include "i18n.h"
@@ -607,6 +609,13 @@ int main(int argc, char **argv)
 	pinboard_init();
 	panel_init();
 
+#ifdef UNIT_TESTS
+	diritem_tests();
+	fscache_tests();
+	pixmaps_tests();
+	boxscale_tests();
+#endif
+
 	/* When we get a signal, we can't do much right then. Instead,
 	 * we send a char down this pipe, which causes the main loop to
 	 * deal with the event next time we're idle.
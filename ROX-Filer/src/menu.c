@@ -156,6 +156,8 @@ static void only_dirs(gpointer data, guint action, GtkWidget *widget);
 static void show_thumbs(gpointer data, guint action, GtkWidget *widget);
 static void refresh(gpointer data, guint action, GtkWidget *widget);
 static void refresh_thumbs(gpointer data, guint action, GtkWidget *widget);
+static void retry_failed_thumbs(gpointer data, guint action,
+				GtkWidget *widget);
 static void save_settings(gpointer data, guint action, GtkWidget *widget);
 static void save_settings_parent(gpointer data, guint action, GtkWidget *widget);
 
@@ -682,6 +684,7 @@ gboolean ensure_filer_menu(void)
 	adt(N_("Show Thumbnails"              ), show_thumbs   , 0, &filer_thumb_menu);
 	ads(N_("Refresh"                      ), refresh       , 0, GTK_STOCK_REFRESH);
 	ads(N_("Refresh Thumbs"               ), refresh_thumbs, 0, GTK_STOCK_REFRESH);
+	adi(N_("Retry Failed Thumbs"          ), retry_failed_thumbs, 0);
 
 	adi(N_("Save Display Settings..."           ), save_settings, 0);
 	adi(N_("Save Display Settings to parent ..."), save_settings_parent, 0);
@@ -1266,6 +1269,14 @@ static void refresh_thumbs(gpointer data, guint action, GtkWidget *widget)
 	filer_refresh_thumbs(window_with_focus);
 }
 
+static void retry_failed_thumbs(gpointer data, guint action,
+				GtkWidget *widget)
+{
+	g_return_if_fail(window_with_focus != NULL);
+
+	filer_retry_failed_thumbs(window_with_focus);
+}
+
 static void save_settings(gpointer data, guint action, GtkWidget *widget)
 {
 	g_return_if_fail(window_with_focus != NULL);
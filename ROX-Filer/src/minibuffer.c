@@ -54,6 +54,14 @@
 
 static GList *shell_history = NULL;
 
+/* A stat_async() of the directory typed into the path minibuffer */
+typedef struct _PathCheck PathCheck;
+struct _PathCheck {
+	FilerWindow	*filer_window;
+	gchar		*text;		/* The minibuffer's contents then */
+	gchar		*leaf;
+};
+
 /* Static prototypes */
 static gint key_press_event(GtkWidget	*widget,
 			GdkEventKey	*event,
@@ -513,6 +521,33 @@ static void complete(FilerWindow *filer_window)
 	}
 }
 
+/* The directory typed into the path minibuffer has been statted */
+static void path_checked(const char *path, int err, const struct stat *info,
+			 gpointer data)
+{
+	PathCheck *check = (PathCheck *) data;
+	FilerWindow *filer_window = check->filer_window;
+
+	/* Ignore it if the window's gone or the user has typed on */
+	if (g_list_find(all_filer_windows, filer_window) &&
+	    filer_window->mini_type == MINI_PATH &&
+	    strcmp(gtk_entry_get_text(GTK_ENTRY(filer_window->minibuffer)),
+		   check->text) == 0)
+	{
+		if (err == 0 && S_ISDIR(info->st_mode))
+		{
+			filer_change_to(filer_window, path, check->leaf);
+			entry_set_error(filer_window->minibuffer, FALSE);
+		}
+		else
+			entry_set_error(filer_window->minibuffer, TRUE);
+	}
+
+	g_free(check->text);
+	g_free(check->leaf);
+	g_free(check);
+}
+
 static void path_changed(FilerWindow *filer_window)
 {
 	GtkWidget *mini = filer_window->minibuffer;
@@ -520,6 +555,7 @@ static void path_changed(FilerWindow *filer_window)
 	char		*path;
 	char		*new = NULL;
 	gboolean	error = FALSE;
+	gboolean	pending = FALSE;
 
 	rawnew = gtk_entry_get_text(GTK_ENTRY(mini));
 	if (!*rawnew)
@@ -588,16 +624,16 @@ static void path_changed(FilerWindow *filer_window)
 
 	if (strcmp(path, filer_window->sym_path) != 0)
 	{
-		/* The new path is in a different directory */
-		struct stat info;
+		/* The new path is in a different directory. It might be
+		 * on a hung mount, so don't wait for it.
+		 */
+		PathCheck *check = g_new(PathCheck, 1);
 
-		if (stat_with_timeout(path, &info) == 0 &&
-				S_ISDIR(info.st_mode))
-		{
-			filer_change_to(filer_window, path, leaf);
-		}
-		else
-			error = TRUE;
+		check->filer_window = filer_window;
+		check->text = g_strdup(rawnew);
+		check->leaf = g_strdup(leaf);
+		stat_async(path, path_checked, check);
+		pending = TRUE;
 	}
 	else
 	{
@@ -615,7 +651,8 @@ static void path_changed(FilerWindow *filer_window)
 	g_free(new);
 	g_free(path);
 
-	entry_set_error(mini, error);
+	if (!pending)
+		entry_set_error(mini, error);
 }
 
 /* Look for an exact match, and move the cursor to it if found.
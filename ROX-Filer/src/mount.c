@@ -70,12 +70,37 @@ static GHashTable *user_mounts = NULL;
 #define THE_FSTAB "/etc/fstab"
 #endif
 
+#ifdef DO_MOUNT_POINTS
+/* Watches THE_FSTAB, so that mount_update() needn't stat it each time */
+static GFileMonitor *fstab_monitor = NULL;
+#endif
+
+#ifdef __linux__
+# include <unistd.h>
+# define MOUNTINFO "/proc/self/mountinfo"
+
+/* What the kernel says is mounted now, from MOUNTINFO. Keys are the mount
+ * points. The file polls as readable-with-priority when it changes, and
+ * we reload it then. NULL if we can't read it.
+ */
+static GHashTable *live_mounts = NULL;
+static GMutex m_live_mounts;
+static int mountinfo_fd = -1;
+#endif
+
 /* Static prototypes */
 #ifdef DO_MOUNT_POINTS
 static void read_table(void);
 static void clear_table(void);
 static time_t read_time(char *path);
 static gboolean free_mp(gpointer key, gpointer value, gpointer data);
+static void fstab_changed(GFileMonitor *m, GFile *f, GFile *o,
+			  GFileMonitorEvent e, gpointer data);
+#endif
+#ifdef MOUNTINFO
+static void read_mountinfo(void);
+static gboolean mountinfo_changed(GIOChannel *source,
+				  GIOCondition condition, gpointer data);
 #endif
 
 
@@ -104,6 +129,27 @@ void mount_init(void)
 #endif
 	}
 	read_table();
+
+	GFile *fstab = g_file_new_for_path(THE_FSTAB);
+	fstab_monitor = g_file_monitor_file(fstab, G_FILE_MONITOR_NONE,
+					    NULL, NULL);
+	g_object_unref(fstab);
+	if (fstab_monitor)
+		g_signal_connect(fstab_monitor, "changed",
+				 G_CALLBACK(fstab_changed), NULL);
+#endif
+
+#ifdef MOUNTINFO
+	mountinfo_fd = open(MOUNTINFO, O_RDONLY | O_CLOEXEC);
+	if (mountinfo_fd != -1)
+	{
+		GIOChannel *chan = g_io_channel_unix_new(mountinfo_fd);
+
+		g_io_add_watch(chan, G_IO_PRI | G_IO_ERR,
+			       mountinfo_changed, NULL);
+		g_io_channel_unref(chan);
+		read_mountinfo();
+	}
 #endif
 }
 
@@ -113,6 +159,10 @@ void mount_update(gboolean force)
 #ifdef DO_MOUNT_POINTS
 	time_t	time;
 
+	/* fstab_changed() will tell us */
+	if (fstab_monitor && !force)
+		return;
+
 	time = read_time(THE_FSTAB);
 	if (force || time != fstab_time)
 	{
@@ -140,12 +190,36 @@ void mount_user_mount(const char *path)
  * device -- this should detect mount points for all Unix and POSIX variants.
  *
  * 'info' and 'parent' are both optional, saving one stat() each.
+ *
+ * Where we have the kernel's mount table, a path given with 'info' (ie,
+ * from a scan, which must be a real path) is also looked up in that. This
+ * needs no stat() of path/.., and finds bind mounts from the same device.
+ * Other callers are checking after a (u)mount, which the table may not
+ * have caught up with yet, so they still stat.
  */
 gboolean mount_is_mounted(const guchar *path, struct stat *info,
 					      struct stat *parent)
 {
 	struct stat info_path, info_parent;
 
+#ifdef MOUNTINFO
+	if (info)
+	{
+		gboolean listed = FALSE, have_table;
+
+		g_mutex_lock(&m_live_mounts);
+		have_table = live_mounts != NULL;
+		if (have_table)
+			listed = g_hash_table_contains(live_mounts, path);
+		g_mutex_unlock(&m_live_mounts);
+
+		if (listed)
+			return TRUE;
+		if (have_table && !parent)
+			return FALSE;
+	}
+#endif
+
 	if (!info)
 	{
 		info = &info_path;
@@ -175,6 +249,49 @@ gboolean mount_is_mounted(const guchar *path, struct stat *info,
 	return FALSE;
 }
 
+/* The mount point that 'path' (an absolute path) is under, according to
+ * the kernel's mount table. g_free() the result. NULL if we don't have
+ * the table. Symlinks in path aren't followed, since that might hang.
+ */
+gchar *mount_point_of(const char *path)
+{
+#ifdef MOUNTINFO
+	gchar *dir, *slash;
+	gboolean found = FALSE;
+
+	if (path[0] != '/')
+		return NULL;
+
+	dir = g_strdup(path);
+
+	g_mutex_lock(&m_live_mounts);
+	if (!live_mounts)
+	{
+		g_mutex_unlock(&m_live_mounts);
+		g_free(dir);
+		return NULL;
+	}
+	while (!(found = g_hash_table_contains(live_mounts, dir)))
+	{
+		slash = strrchr(dir, '/');
+		if (slash == dir)
+		{
+			if (dir[1] == '\0')
+				break;
+			dir[1] = '\0';
+		}
+		else
+			*slash = '\0';
+	}
+	g_mutex_unlock(&m_live_mounts);
+
+	if (found)
+		return dir;
+	g_free(dir);
+#endif
+	return NULL;
+}
+
 /* TRUE if this mount point was mounted by the user, and still is */
 gboolean mount_is_user_mounted(const gchar *path)
 {
@@ -215,6 +332,18 @@ static gboolean free_mp(gpointer key, gpointer value, gpointer data)
 	return TRUE;
 }
 
+static void fstab_changed(GFileMonitor *m, GFile *f, GFile *o,
+			  GFileMonitorEvent e, gpointer data)
+{
+	if (e == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+	    e == G_FILE_MONITOR_EVENT_CREATED ||
+	    e == G_FILE_MONITOR_EVENT_DELETED)
+	{
+		fstab_time = read_time(THE_FSTAB);
+		read_table();
+	}
+}
+
 /* Remove all entries from mounts table, freeing them as we go */
 static void clear_table(void)
 {
@@ -352,6 +481,107 @@ static void read_table(void)
 
 #endif /* DO_MOUNT_POINTS */
 
+#ifdef MOUNTINFO
+
+/* Undo the octal escapes (eg '\040' for space) used in MOUNTINFO, in place */
+static void unescape_mount_point(char *s)
+{
+	char *out = s;
+
+	for (; *s; s++)
+	{
+		if (s[0] == '\\' &&
+		    s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' &&
+		    s[3] >= '0' && s[3] <= '7')
+		{
+			*out++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) |
+				  (s[3] - '0');
+			s += 3;
+		}
+		else
+			*out++ = *s;
+	}
+	*out = '\0';
+}
+
+/* Rebuild live_mounts from MOUNTINFO. Each line is
+ * "id parent major:minor root mount-point options ..."
+ */
+static void read_mountinfo(void)
+{
+	GString *text;
+	GHashTable *table, *old;
+	char buf[4096];
+	char *line, *next;
+	ssize_t got;
+
+	text = g_string_new(NULL);
+	if (lseek(mountinfo_fd, 0, SEEK_SET) == 0)
+	{
+		while ((got = read(mountinfo_fd, buf, sizeof(buf))) > 0)
+			g_string_append_len(text, buf, got);
+	}
+	else
+		got = -1;
+
+	if (got < 0)
+	{
+		g_string_free(text, TRUE);
+		return;		/* Keep the old table */
+	}
+
+	table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (line = text->str; *line; line = next)
+	{
+		char *field, *end;
+		int i;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+
+		/* Skip to the fifth field */
+		field = line;
+		for (i = 0; i < 4 && field; i++)
+		{
+			field = strchr(field, ' ');
+			if (field)
+				field++;
+		}
+		if (!field)
+			continue;
+		end = strchr(field, ' ');
+		if (end)
+			*end = '\0';
+
+		unescape_mount_point(field);
+		g_hash_table_add(table, g_strdup(field));
+	}
+	g_string_free(text, TRUE);
+
+	g_mutex_lock(&m_live_mounts);
+	old = live_mounts;
+	live_mounts = table;
+	g_mutex_unlock(&m_live_mounts);
+
+	if (old)
+		g_hash_table_destroy(old);
+}
+
+static gboolean mountinfo_changed(GIOChannel *source,
+				  GIOCondition condition, gpointer data)
+{
+	read_mountinfo();
+
+	return TRUE;
+}
+
+#endif /* MOUNTINFO */
+
 gchar *mount_get_fs_size(const gchar *dir)
 {
   int ok=FALSE;
@@ -28,6 +28,7 @@ void mount_user_mount(const char *path);
 gboolean mount_is_user_mounted(const gchar *path);
 gboolean mount_is_mounted(const guchar *path, struct stat *info,
 					      struct stat *parent);
+gchar *mount_point_of(const char *path);
 gchar *mount_get_fs_size(const gchar *dir);
 
 #endif /* _MOUNT_H */
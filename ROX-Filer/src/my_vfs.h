@@ -63,6 +63,11 @@ int mc_fstat (int fd, struct stat *buf);
 #  define mc_seekdir(x, o) seekdir(x, o)
 #  define mc_telldir(x) telldir(x)
 
+#  ifdef HAVE_FSTATAT
+#    include <fcntl.h>
+#    define mc_fstatat(d, x, y, f) fstatat(d, x, y, f)
+#  endif
+
 #endif
 
 #endif /* _MY_VFS_H */
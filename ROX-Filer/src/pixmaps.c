@@ -37,6 +37,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <setjmp.h>
+#include <sys/resource.h>
 
 #include <gtk/gtk.h>
 
@@ -54,6 +56,13 @@
 #include "options.h"
 #include "action.h"
 #include "type.h"
+#include "thumbpack.h"
+#include "boxscale.h"
+
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+# define USE_LIBJPEG
+# include <jpeglib.h>
+#endif
 
 GFSCache *pixmap_cache = NULL;
 GFSCache *thumb_cache = NULL;
@@ -93,13 +102,20 @@ gchar *thumb_dir = "normal";
 
 Option o_pixmap_thumb_file_size;
 Option o_jpeg_thumbs;
+static Option o_thumb_pack;
+static Option o_thumb_pack_budget;
 static Option o_purge_time;
+static Option o_pixmap_cache_budget;
+static Option o_thumb_cache_budget;
+static Option o_view_thumbs_budget;
 Option o_purge_days;
 
 
 typedef struct _ChildThumbnail ChildThumbnail;
 
-/* There is one of these for each active child process */
+/* There is one of these for each thumbnail being made, either by a
+ * MIME-thumb child process or by one of the thumb_pool threads.
+ */
 struct _ChildThumbnail {
 	gchar	 *path;
 	GFunc	 callback;
@@ -107,10 +123,66 @@ struct _ChildThumbnail {
 	pid_t	 child;
 	guint	 timeout;
 	guint	 order;
+	MIME_type *type;	/* For thumb_pool jobs */
+	gint	 cancelled;	/* See pixmap_cancel_thumbs() */
 };
 static guint ordered_num = 0;
+static GList *thumb_jobs = NULL;	/* ChildThumbnails being made */
 static guint next_order = 0;
 
+/* The freedesktop details from a thumbnail's PNG text chunks */
+typedef struct _ThumbText ThumbText;
+struct _ThumbText {
+	gchar	*uri, *mtime, *size;
+};
+
+typedef enum {
+	THUMB_UNREADABLE,	/* Missing, or cut short */
+	THUMB_TEXT_READ,	/* The ThumbText is filled in (if present) */
+	THUMB_NEEDS_DECODE,	/* Compressed text, or not PNG/JPEG */
+} ThumbHeader;
+
+#define THUMB_TEXT_MAX 65536	/* Longer text chunks aren't ours */
+
+/* Image types we can load ourselves are decoded and scaled here, rather
+ * than in a forked copy of the filer. Threads are capped so that a
+ * directory of large photos doesn't need dozens of full-size images in
+ * memory at once.
+ */
+#define THUMB_THREADS_MAX 4
+static GThreadPool *thumb_pool = NULL;
+static gint thumb_tmp_serial = 0;	/* Makes temporary names unique */
+
+/* Finding a file's thumbnail means a realpath(), a URI and an MD5 hash.
+ * Refreshing a big directory does that again and again for the same files,
+ * so the results are kept here, in a slot chosen by (device, inode). Each
+ * entry remembers the path it was worked out for. If the file is renamed
+ * (or a parent directory is), a lookup with the new path finds the same
+ * slot, sees that the path differs and replaces the entry. A new file at
+ * the old path has a different inode, so it can't pick up a stale entry.
+ */
+typedef struct _ThumbName ThumbName;
+struct _ThumbName {
+	dev_t	dev;
+	ino_t	ino;
+	gchar	*path;		/* As given */
+	gchar	*real;		/* pathdup(path), or path if not resolved */
+	gboolean resolved;
+	gchar	*uri;		/* URI of real */
+	gchar	md5[33];	/* Hash of uri (the thumbnail's leafname) */
+};
+
+#define THUMB_NAMES 32768	/* Slots (a power of two) */
+static ThumbName *thumb_names[THUMB_NAMES];
+static GMutex thumb_names_lock;	/* write_thumbnail() runs in threads */
+
+/* The thumbnails the views hold for their items aren't in any cache, so
+ * they have a budget of their own (see pixmap_trim_held_thumbs()). These
+ * are for the Options box.
+ */
+static GHashTable *held_thumb_bytes = NULL;	/* View -> bytes it holds */
+static guint held_thumbs_dropped = 0;
+
 static const char *stocks[] = {
 	ROX_STOCK_SHOW_DETAILS,
 	ROX_STOCK_SHOW_HIDDEN,
@@ -126,15 +198,39 @@ static void load_default_pixmaps(void);
 static gint purge_pixmaps(gpointer data);
 static gint purge_thumbs(gpointer data);
 static MaskedPixmap *image_from_file(const char *path);
+static gsize image_cost(gpointer object, gpointer data);
 static MaskedPixmap *get_bad_image(void);
 static GdkPixbuf *get_thumbnail_for(const char *path, gboolean forcheck);
+static gboolean have_thumbnail_for(const char *pathname, gboolean forcheck);
+static gboolean try_thumb(const gchar *path, gboolean *forcheck,
+			  GdkPixbuf **ret);
+static gboolean thumb_text_chunk(ThumbText *text, const char *type,
+				 const char *data, guint32 len);
+static int option_atoi(GdkPixbuf *pixbuf, const char *key);
 static void ordered_update(ChildThumbnail *info);
 static void thumbnail_done(ChildThumbnail *info);
 static void create_thumbnail(const gchar *path, MIME_type *type);
+static void write_thumbnail(const char *pathname, const struct stat *info,
+		GdkPixbuf *thumb, int original_width, int original_height);
+static void thumb_thread(gpointer data, gpointer unused);
+static gboolean thumb_made(gpointer data);
 static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label);
+static GList *thumbs_memory(Option *option, xmlNode *node, guchar *label);
+static GList *stat_counts(Option *option, xmlNode *node, guchar *label);
+static gsize pixbuf_cost(GdkPixbuf *pixbuf);
 static gchar *thumbnail_path(const gchar *path);
+static void thumb_name_for(const char *path, gboolean resolve,
+			   gchar **real, gchar **uri, gchar *md5);
+static gchar *thumb_file_path(const gchar *md5);
+static gchar *thumb_fail_path(const gchar *md5, gboolean make_dirs);
+static void thumb_fail_record(const char *path);
+static gboolean thumb_failed(const char *path);
+static ThumbHeader read_thumb_text(const char *thumb_path, ThumbText *text);
 static gchar *thumbnail_program(MIME_type *type);
 static GdkPixbuf *extract_tiff_thumbnail(const gchar *path);
+#ifdef USE_LIBJPEG
+static GdkPixbuf *jpeg_load_scaled(const gchar *path, int size);
+#endif
 static void make_dir_thumb(const gchar *path);
 
 /****************************************************************
@@ -170,8 +266,22 @@ static void options_changed()
 	if (o_jpeg_thumbs.has_changed)
 		g_fscache_purge(thumb_cache, 0);
 
+	if (o_pixmap_thumb_file_size.has_changed || o_thumb_pack.has_changed ||
+			o_thumb_pack_budget.has_changed)
+		thumbpack_use(o_thumb_pack.int_value ? thumb_dir : NULL,
+				thumb_size,
+				(guint64) o_thumb_pack_budget.int_value << 20);
+
 	if (o_purge_time.has_changed)
 		g_fscache_purge(thumb_cache, o_purge_time.int_value);
+
+	if (o_pixmap_cache_budget.has_changed)
+		g_fscache_set_budget(pixmap_cache, image_cost,
+			(gsize) o_pixmap_cache_budget.int_value << 20);
+
+	if (o_thumb_cache_budget.has_changed)
+		g_fscache_set_budget(thumb_cache, image_cost,
+			(gsize) o_thumb_cache_budget.int_value << 20);
 }
 
 void pixmaps_init(void)
@@ -183,13 +293,22 @@ void pixmaps_init(void)
 //	option_add_int(&o_purge_time, "purge_time", PIXMAP_PURGE_TIME);
 	option_add_int(&o_purge_time, "purge_time", 0);
 	option_add_int(&o_jpeg_thumbs, "jpeg_thumbs", TRUE);
+	option_add_int(&o_thumb_pack, "thumb_pack", TRUE);
+	option_add_int(&o_thumb_pack_budget, "thumb_pack_budget", 0);
 	option_add_int(&o_purge_days, "purge_days", 90);
+	option_add_int(&o_pixmap_cache_budget, "pixmap_cache_budget", 32);
+	option_add_int(&o_thumb_cache_budget, "thumb_cache_budget", 64);
+	option_add_int(&o_view_thumbs_budget, "view_thumbs_budget", 64);
 	option_add_notify(options_changed);
 
 	gtk_widget_push_colormap(gdk_rgb_get_colormap());
 
 	pixmap_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
 	thumb_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
+	g_fscache_set_budget(pixmap_cache, image_cost,
+			(gsize) o_pixmap_cache_budget.int_value << 20);
+	g_fscache_set_budget(thumb_cache, image_cost,
+			(gsize) o_thumb_cache_budget.int_value << 20);
 
 	g_timeout_add(6000, purge_thumbs, NULL);
 	g_timeout_add(PIXMAP_PURGE_TIME / 2 * 1000, purge_pixmaps, NULL);
@@ -225,7 +344,246 @@ void pixmaps_init(void)
 	load_default_pixmaps();
 	set_thumb_size();
 	option_register_widget("thumbs-purge-cache", thumbs_purge_cache);
+	option_register_widget("thumbs-memory", thumbs_memory);
+	option_register_widget("stat-counts", stat_counts);
+}
+
+#ifdef UNIT_TESTS
+/* Peak resident set size so far, in KB */
+static long peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return usage.ru_maxrss;
+}
+
+/* Make a thumbnail of each file in $ROX_THUMB_BENCH (eg, a directory of
+ * camera JPEGs), first with jpeg_load_scaled() and then with gdk-pixbuf's
+ * loader (which also decodes at a reduced size). Prints the time per image
+ * and how much each pass raised the peak RSS. The reduced-size pass goes
+ * first, since the peak never falls.
+ */
+static void thumb_decode_bench(void)
+{
+	const char *dirpath = g_getenv("ROX_THUMB_BENCH");
+	GPtrArray *paths;
+	const gchar *leaf;
+	GTimer *timer;
+	GDir *dir;
+	int pass, i;
+
+	if (!dirpath || !(dir = g_dir_open(dirpath, 0, NULL)))
+		return;
+
+	paths = g_ptr_array_new_with_free_func(g_free);
+	while ((leaf = g_dir_read_name(dir)))
+		g_ptr_array_add(paths, g_build_filename(dirpath, leaf, NULL));
+	g_dir_close(dir);
+
+	timer = g_timer_new();
+	for (pass = 0; pass < 2; pass++)
+	{
+		long peak0 = peak_rss_kb();
+		int made = 0;
+
+		g_timer_start(timer);
+		for (i = 0; i < paths->len; i++)
+		{
+			GdkPixbuf *image = NULL;
+#ifdef USE_LIBJPEG
+			if (pass == 0)
+				image = jpeg_load_scaled(paths->pdata[i],
+						thumb_size);
+#endif
+			if (!image)
+				image = rox_pixbuf_new_from_file_at_scale(
+						paths->pdata[i], thumb_size,
+						thumb_size, TRUE, NULL);
+			if (image)
+			{
+				made++;
+				g_object_unref(image);
+			}
+		}
+		g_timer_stop(timer);
+
+		g_print("%s: %d thumbnails, %.1fms each, peak RSS +%ldK\n",
+			pass ? "gdk-pixbuf" : "libjpeg", made,
+			made ? g_timer_elapsed(timer, NULL) * 1000 / made : 0,
+			peak_rss_kb() - peak0);
+	}
+
+	g_timer_destroy(timer);
+	g_ptr_array_free(paths, TRUE);
+}
+
+/* The thumbnail name the slow way, for checking thumb_name_for() */
+static gchar *thumb_name_uncached(const char *path, gboolean resolve)
+{
+	gchar *real, *uri, *md5;
+
+	real = resolve ? pathdup(path) : g_strdup(path);
+	uri = g_filename_to_uri(real, NULL, NULL);
+	if (!uri)
+		uri = g_strconcat("file://", real, NULL);
+	md5 = md5_hash(uri);
+	g_free(uri);
+	g_free(real);
+	return md5;
+}
+
+static void check_thumb_name(const char *path, gboolean resolve)
+{
+	gchar *want, got[33];
+	int i;
+
+	want = thumb_name_uncached(path, resolve);
+	for (i = 0; i < 2; i++)	/* Miss, then hit */
+	{
+		thumb_name_for(path, resolve, NULL, NULL, got);
+		if (strcmp(got, want) != 0)
+			g_error("thumb_name_for('%s', %d) gave %s, not %s",
+				path, resolve, got, want);
+	}
+	g_free(want);
+}
+
+static void thumb_name_tests(void)
+{
+	gchar *tmp, *a, *b, *link, *via_link;
+
+	tmp = g_dir_make_tmp("rox-thumbname-XXXXXX", NULL);
+	if (!tmp)
+		g_error("Can't make a temporary directory");
+	a = g_build_filename(tmp, "a", NULL);
+	b = g_build_filename(tmp, "b", NULL);
+	link = g_build_filename(tmp, "link", NULL);
+	via_link = g_build_filename(link, "b", NULL);
+
+	g_file_set_contents(a, "", 0, NULL);
+	check_thumb_name(a, TRUE);
+	check_thumb_name(a, FALSE);
+
+	/* Same inode, new name */
+	if (rename(a, b) != 0)
+		g_error("rename: %s", g_strerror(errno));
+	check_thumb_name(b, TRUE);
+
+	/* Only resolving should see through the link */
+	if (symlink(".", link) != 0)
+		g_error("symlink: %s", g_strerror(errno));
+	check_thumb_name(via_link, FALSE);
+	check_thumb_name(via_link, TRUE);
+	check_thumb_name(via_link, FALSE);
+
+	unlink(link);
+	unlink(b);
+	rmdir(tmp);
+	g_free(via_link);
+	g_free(link);
+	g_free(b);
+	g_free(a);
+	g_free(tmp);
+}
+
+/* Time looking up the thumbnail name of each file in $ROX_THUMB_BENCH,
+ * as get_thumbnail_for() does, with and without thumb_name_for().
+ */
+static void thumb_name_bench(void)
+{
+	const char *dirpath = g_getenv("ROX_THUMB_BENCH");
+	GPtrArray *paths;
+	const gchar *leaf;
+	GTimer *timer;
+	GDir *dir;
+	int pass, i, rounds = 10, r;
+
+	if (!dirpath || !(dir = g_dir_open(dirpath, 0, NULL)))
+		return;
+
+	paths = g_ptr_array_new_with_free_func(g_free);
+	while ((leaf = g_dir_read_name(dir)))
+		g_ptr_array_add(paths, g_build_filename(dirpath, leaf, NULL));
+	g_dir_close(dir);
+	if (paths->len == 0)
+		goto out;
+
+	timer = g_timer_new();
+	for (pass = 0; pass < 2; pass++)
+	{
+		g_timer_start(timer);
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < paths->len; i++)
+			{
+				gchar md5[33], *real;
+
+				if (pass)
+				{
+					g_free(thumb_name_uncached(
+						paths->pdata[i], TRUE));
+					continue;
+				}
+				thumb_name_for(paths->pdata[i], TRUE,
+						&real, NULL, md5);
+				g_free(real);
+			}
+		}
+		g_timer_stop(timer);
+
+		g_print("%s: %.2fus per thumbnail name\n",
+			pass ? "uncached" : "thumb_name_for",
+			g_timer_elapsed(timer, NULL) * 1e6 /
+			(rounds * paths->len));
+	}
+	g_timer_destroy(timer);
+out:
+	g_ptr_array_free(paths, TRUE);
+}
+
+/* Failure records are kept, noticed, and dropped when the file changes or
+ * when asked to retry.
+ */
+static void thumb_fail_tests(void)
+{
+	gchar *tmp, *path;
+
+	tmp = g_dir_make_tmp("rox-thumbfail-XXXXXX", NULL);
+	if (!tmp)
+		g_error("Can't make a temporary directory");
+	path = g_build_filename(tmp, "broken.png", NULL);
+	g_file_set_contents(path, "not a PNG", -1, NULL);
+
+	if (thumb_failed(path))
+		g_error("'%s' failed before we tried it", path);
+	thumb_fail_record(path);
+	if (!thumb_failed(path))
+		g_error("Failure for '%s' not recorded", path);
+
+	g_file_set_contents(path, "still not a PNG", -1, NULL);
+	if (thumb_failed(path))
+		g_error("Failure for '%s' outlived a change", path);
+
+	thumb_fail_record(path);
+	if (!pixmap_forget_failed_thumb(path) || thumb_failed(path))
+		g_error("Failure for '%s' not forgotten", path);
+
+	unlink(path);
+	rmdir(tmp);
+	g_free(path);
+	g_free(tmp);
+}
+
+void pixmaps_tests(void)
+{
+	thumb_name_tests();
+	thumb_fail_tests();
+	thumb_name_bench();
+	thumb_decode_bench();
 }
+#endif
 
 /* Load image <appdir>/images/name.png.
  * Always returns with a valid image.
@@ -293,7 +651,7 @@ void pixmap_make_small(MaskedPixmap *mp)
 	mp->sm_height = gdk_pixbuf_get_height(mp->sm_pixbuf);
 }
 
-/* -1:not thumb target 0:not created 1:created and loaded */
+/* -2:failed before -1:not thumb target 0:not created 1:created and loaded */
 gint pixmap_check_thumb(const gchar *path)
 {
 	gboolean found;
@@ -305,13 +663,9 @@ gint pixmap_check_thumb(const gchar *path)
 		if (found) return -2;
 
 	gboolean forcheck = TRUE;
-	GdkPixbuf *image = pixmap_try_thumb(path, &forcheck);
 
-	if (image)
-	{
-		g_object_unref(image);
+	if (try_thumb(path, &forcheck, NULL))
 		return 1;
-	}
 	if (forcheck)
 		return -1;
 
@@ -323,6 +677,14 @@ gint pixmap_check_thumb(const gchar *path)
 				(thumb_prog = thumbnail_program(type)))
 		{
 			g_free(thumb_prog);
+
+			if (thumb_failed(path))
+			{
+				/* Don't look on disk again this session */
+				g_fscache_insert(pixmap_cache, path,
+						NULL, TRUE);
+				return -2;
+			}
 			return 0;
 		}
 	}
@@ -384,16 +746,14 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	gchar		*thumb_prog, *base;
 
 	gboolean forcheck = TRUE;
-	image = pixmap_try_thumb(path, &forcheck);
 
-	if (image)
+	if (try_thumb(path, &forcheck, NULL))
 	{
-		g_object_unref(image);
-		/* Thumbnail loaded */
+		/* Thumbnail exists */
 		callback(data, (gpointer)path);
 		return;
 	}
-	if (forcheck)
+	if (forcheck || thumb_failed(path))
 	{
 		callback(data, NULL);
 		return;
@@ -443,15 +803,35 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	info->path = g_strdup(path);
 	info->callback = callback;
 	info->data = data;
+	info->child = 0;
 	info->timeout = 0;
 	info->order = ordered_num++;
+	info->type = type;
+	info->cancelled = FALSE;
 	if (noorder) info->order = 0;
 
+	thumb_jobs = g_list_prepend(thumb_jobs, info);
+
+	if (!thumb_prog)
+	{
+		if (!thumb_pool)
+			thumb_pool = g_thread_pool_new(thumb_thread, NULL,
+				CLAMP(g_get_num_processors(),
+				      1, THUMB_THREADS_MAX),
+				FALSE, NULL);
+		g_thread_pool_push(thumb_pool, info, NULL);
+		return;
+	}
+
 	child = fork();
 	if (child == -1)
 	{
 		g_free(thumb_prog);
 		delayed_error("fork(): %s", g_strerror(errno));
+		thumb_jobs = g_list_remove(thumb_jobs, info);
+		g_fscache_remove(thumb_cache, path);
+		g_free(info->path);
+		g_free(info);
 		callback(data, NULL);
 		return;
 	}
@@ -460,28 +840,21 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	{
 		/* We are the child process.  (We are sloppy with freeing
 		   memory, but since we go away very quickly, that's ok.) */
-		if (thumb_prog)
-		{
-			DirItem *item;
-
-			base = g_path_get_basename(thumb_prog);
-			item = diritem_new(base);
-			g_free(base);
-			diritem_restat(thumb_prog, item, NULL, TRUE);
-			if (item->flags & ITEM_FLAG_APPDIR)
-				thumb_prog = g_strconcat(thumb_prog, "/AppRun",
-						NULL);
-
-			execl(thumb_prog, thumb_prog, path,
-					thumbnail_path(path),
-					g_strdup_printf("%d", thumb_size),
-					NULL);
-
-			_exit(1);
-		}
+		DirItem *item;
+
+		base = g_path_get_basename(thumb_prog);
+		item = diritem_new(base);
+		g_free(base);
+		diritem_restat(thumb_prog, item, NULL, TRUE);
+		if (item->flags & ITEM_FLAG_APPDIR)
+			thumb_prog = g_strconcat(thumb_prog, "/AppRun", NULL);
+
+		execl(thumb_prog, thumb_prog, path,
+				thumbnail_path(path),
+				g_strdup_printf("%d", thumb_size),
+				NULL);
 
-		create_thumbnail(path, type);
-		_exit(0);
+		_exit(1);
 	}
 
 	g_free(thumb_prog);
@@ -491,14 +864,110 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	on_child_death(child, (CallbackFn) thumbnail_done, info);
 }
 
+/* Stop making the thumbnails that were asked for with this 'data' (eg,
+ * because the window they were for has left the directory). MIME-thumb
+ * programs are killed, and thumb_pool jobs not yet started are skipped.
+ * The callbacks still happen, as for a failure, but it isn't remembered as
+ * one.
+ */
+void pixmap_cancel_thumbs(gpointer data)
+{
+	GList *next;
+
+	for (next = thumb_jobs; next; next = next->next)
+	{
+		ChildThumbnail *info = next->data;
+
+		if (info->data != data || info->cancelled)
+			continue;
+
+		g_atomic_int_set(&info->cancelled, TRUE);
+		if (info->child > 0)
+			kill(info->child, 9);
+	}
+}
+
+static gint held_by_use(gconstpointer a, gconstpointer b)
+{
+	gint64 ua = ((HeldThumb *) a)->used, ub = ((HeldThumb *) b)->used;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* 'held' is every thumbnail 'view' has (HeldThumb). If they use more than
+ * the view_thumbs_budget option allows, drop the least recently drawn of
+ * those not near the screen, until they are back under three quarters of
+ * it. Dropped ones have their *thumb set to NULL; the view should load them
+ * again if they are drawn. Sorts 'held'. Returns the number dropped.
+ */
+guint pixmap_trim_held_thumbs(gpointer view, GArray *held)
+{
+	gsize total = 0, budget = (gsize) o_view_thumbs_budget.int_value << 20;
+	guint dropped = 0;
+	int i;
+
+	for (i = 0; i < held->len; i++)
+		total += pixbuf_cost(*g_array_index(held, HeldThumb, i).thumb);
+
+	if (budget && total > budget)
+	{
+		g_array_sort(held, held_by_use);
+
+		for (i = 0; i < held->len && total > budget / 4 * 3; i++)
+		{
+			HeldThumb *h = &g_array_index(held, HeldThumb, i);
+
+			if (h->near)
+				continue;
+			total -= pixbuf_cost(*h->thumb);
+			g_clear_object(h->thumb);
+			dropped++;
+		}
+		held_thumbs_dropped += dropped;
+	}
+
+	if (!held_thumb_bytes)
+		held_thumb_bytes = g_hash_table_new(NULL, NULL);
+	g_hash_table_insert(held_thumb_bytes, view, GSIZE_TO_POINTER(total));
+
+	return dropped;
+}
+
+/* 'view' is going, with all its thumbnails */
+void pixmap_held_thumbs_gone(gpointer view)
+{
+	if (held_thumb_bytes)
+		g_hash_table_remove(held_thumb_bytes, view);
+}
+
 /*
  * Return the thumbnail for a file, only if available.
  */
 GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
+{
+	GdkPixbuf *pixbuf = NULL;
+
+	try_thumb(path, forcheck, &pixbuf);
+
+	return pixbuf;
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* TRUE if there is a thumbnail for 'path'. If so, and 'ret' isn't NULL,
+ * it is stored there. If not, *forcheck is cleared if one should be made.
+ * The pixels are only loaded if they're wanted (by the caller, or
+ * for thumb_cache).
+ */
+static gboolean try_thumb(const gchar *path, gboolean *forcheck,
+			  GdkPixbuf **ret)
 {
 	gboolean  found;
 	GdkPixbuf *image;
-	GdkPixbuf *pixbuf;
+	GdkPixbuf *pixbuf = NULL;
+	gboolean  load = ret || o_purge_time.int_value > 0;
 
 	if (o_purge_time.int_value > 0) {
 		image = g_fscache_lookup_full(thumb_cache, path,
@@ -508,11 +977,20 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
 		{
 			/* Thumbnail is known, or being created */
 			if (image)
-				return image;
+			{
+				if (ret)
+					*ret = image;
+				else
+					g_object_unref(image);
+				return TRUE;
+			}
 		}
 	}
 
-	pixbuf = get_thumbnail_for(path, *forcheck);
+	if (load)
+		pixbuf = get_thumbnail_for(path, *forcheck);
+	else if (have_thumbnail_for(path, *forcheck))
+		return TRUE;
 
 	if (!pixbuf)
 	{
@@ -522,7 +1000,7 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
 		/* Skip zero-byte files. They're either empty, or
 		 * special (may cause us to hang, e.g. /proc/kmsg). */
 		if (mc_stat(path, &info1) == 0 && info1.st_size == 0) {
-			return NULL;
+			return FALSE;
 		}
 
 		dir = g_path_get_dirname(path);
@@ -533,7 +1011,7 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
 		if (mc_stat(dir, &info1) != 0)
 		{
 			g_free(dir);
-			return NULL;
+			return FALSE;
 		}
 		g_free(dir);
 
@@ -542,12 +1020,15 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
 			    info1.st_dev == info2.st_dev &&
 			    info1.st_ino == info2.st_ino)
 		{
+			if (!load)
+				return TRUE;
+
 			pixbuf = rox_pixbuf_new_from_file_at_scale(path,
 					thumb_size, thumb_size,
 								   TRUE, NULL);
 			if (!pixbuf)
 			{
-				return NULL;
+				return FALSE;
 			}
 		}
 	}
@@ -557,27 +1038,22 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck)
 		if (o_purge_time.int_value > 0)
 			g_fscache_insert(thumb_cache, path, pixbuf, TRUE);
 
-		return pixbuf;
+		if (ret)
+			*ret = pixbuf;
+		else
+			g_object_unref(pixbuf);
+		return TRUE;
 	}
 
 	*forcheck = FALSE;
-	return NULL;
+	return FALSE;
 }
 
-/****************************************************************
- *			INTERNAL FUNCTIONS			*
- ****************************************************************/
-
 /* Create a thumbnail file for this image */
 static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 {
 	struct stat info;
-	gchar *path;
 	int original_width, original_height;
-	GString *to;
-	char *md5, *swidth, *sheight, *ssize, *smtime, *uri;
-	mode_t old_mask;
-	int name_len;
 	GdkPixbuf *thumb;
 
 	if (mc_stat(pathname, &info) != 0)
@@ -588,17 +1064,32 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	original_width = gdk_pixbuf_get_width(full);
 	original_height = gdk_pixbuf_get_height(full);
 
+	write_thumbnail(pathname, &info, thumb,
+			original_width, original_height);
+
+	if (o_thumb_pack.int_value)
+		thumbpack_add(pathname, &info, thumb,
+				original_width, original_height);
+
+	g_object_unref(thumb);
+}
+
+/* Write 'thumb' to the standard thumbnails directory, as the thumbnail for
+ * 'pathname' (whose details are 'info').
+ */
+static void write_thumbnail(const char *pathname, const struct stat *info,
+		GdkPixbuf *thumb, int original_width, int original_height)
+{
+	GString *to;
+	char md5[33], *swidth, *sheight, *ssize, *smtime, *uri;
+	int name_len;
+
 	swidth = g_strdup_printf("%d", original_width);
 	sheight = g_strdup_printf("%d", original_height);
-	ssize = g_strdup_printf("%" SIZE_FMT, info.st_size);
-	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
+	ssize = g_strdup_printf("%" SIZE_FMT, info->st_size);
+	smtime = g_strdup_printf("%ld", (long) info->st_mtime);
 
-	path = pathdup(pathname);
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if (!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(path);
+	thumb_name_for(pathname, TRUE, NULL, &uri, md5);
 
 	to = g_string_new(home_dir);
 	g_string_append(to, "/.cache");
@@ -612,12 +1103,13 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	mkdir(to->str, 0700);
 	g_string_append(to, md5);
 	name_len = to->len + 4; /* Truncate to this length when renaming */
-	g_string_append_printf(to, ".%s.ROX-Filer-%ld",
-			o_jpeg_thumbs.int_value ? "jpg" : "png", (long) getpid());
+	g_string_append_printf(to, ".%s.ROX-Filer-%ld-%d",
+			o_jpeg_thumbs.int_value ? "jpg" : "png", (long) getpid(),
+			g_atomic_int_add(&thumb_tmp_serial, 1));
 
-	g_free(md5);
-
-	old_mask = umask(0077);
+	/* This runs in the thumb_pool threads, so we can't change the
+	 * (process-wide) umask here. The directory is 0700 anyway.
+	 */
 	if (o_jpeg_thumbs.int_value == 1)
 	{
 		//At least we don't need extensions being '.jpg'
@@ -636,7 +1128,7 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 				"tEXt::Software", PROJECT,
 				NULL);
 	}
-	umask(old_mask);
+	chmod(to->str, 0600);
 
 	/* We create the file ###.png.ROX-Filer-PID and rename it to avoid
 	 * a race condition if two programs create the same thumb at
@@ -652,7 +1144,6 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 		g_free(final);
 	}
 
-	g_object_unref(thumb);
 	g_string_free(to, TRUE);
 	g_free(swidth);
 	g_free(sheight);
@@ -661,16 +1152,205 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	g_free(uri);
 }
 
+static ThumbName **thumb_name_slot(const struct stat *info)
+{
+	guint64 key = ((guint64) info->st_dev << 32) ^ (guint64) info->st_ino;
+
+	key *= G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+	return &thumb_names[key >> 49];	/* Top 15 bits */
+}
+
+static void thumb_name_free(ThumbName *name)
+{
+	if (name->real != name->path)
+		g_free(name->real);
+	g_free(name->path);
+	g_free(name->uri);
+	g_free(name);
+}
+
+/* Find the canonical form of 'path' (pathdup), its file: URI and the MD5 of
+ * that (the thumbnail's leafname). If 'resolve' is FALSE, 'path' is used
+ * as it is. 'real' and 'uri' may be NULL; otherwise g_free() them.
+ * 'md5' must have room for 33 bytes.
+ * Thread-safe.
+ */
+static void thumb_name_for(const char *path, gboolean resolve,
+			   gchar **real, gchar **uri, gchar *md5)
+{
+	ThumbName *name, **slot = NULL;
+	struct stat info;
+	gchar *hash;
+
+	if (mc_stat(path, &info) == 0)
+	{
+		slot = thumb_name_slot(&info);
+
+		g_mutex_lock(&thumb_names_lock);
+		name = *slot;
+		if (name && name->dev == info.st_dev &&
+		    name->ino == info.st_ino &&
+		    strcmp(name->path, path) == 0 &&
+		    (resolve ? name->resolved : name->real == name->path))
+		{
+			if (real)
+				*real = g_strdup(name->real);
+			if (uri)
+				*uri = g_strdup(name->uri);
+			memcpy(md5, name->md5, 33);
+			g_mutex_unlock(&thumb_names_lock);
+			return;
+		}
+		g_mutex_unlock(&thumb_names_lock);
+	}
+
+	name = g_new(ThumbName, 1);
+	name->path = g_strdup(path);
+	name->real = resolve ? pathdup(path) : name->path;
+	/* Share the string if it's already canonical (lookups rely on this) */
+	if (name->real != name->path && strcmp(name->real, path) == 0)
+	{
+		g_free(name->real);
+		name->real = name->path;
+	}
+	name->resolved = resolve;
+	name->uri = g_filename_to_uri(name->real, NULL, NULL);
+	if (!name->uri)
+		name->uri = g_strconcat("file://", name->real, NULL);
+	hash = md5_hash(name->uri);
+	memcpy(name->md5, hash, 33);
+	g_free(hash);
+
+	if (real)
+		*real = g_strdup(name->real);
+	if (uri)
+		*uri = g_strdup(name->uri);
+	memcpy(md5, name->md5, 33);
+
+	if (!slot)
+	{
+		/* Doesn't exist; nothing to remember it by */
+		thumb_name_free(name);
+		return;
+	}
+
+	name->dev = info.st_dev;
+	name->ino = info.st_ino;
+
+	g_mutex_lock(&thumb_names_lock);
+	if (*slot)
+		thumb_name_free(*slot);
+	*slot = name;
+	g_mutex_unlock(&thumb_names_lock);
+}
+
+/* The standard thumbnail file for a file whose URI hashes to 'md5' */
+static gchar *thumb_file_path(const gchar *md5)
+{
+	return g_strdup_printf("%s/.cache/thumbnails/%s/%s.%s",
+			home_dir, thumb_dir, md5,
+			o_jpeg_thumbs.int_value ? "jpg" : "png");
+}
+
+/* Where we note that we couldn't make a thumbnail for a file, as the
+ * freedesktop spec's fail/ directory does. Failing doesn't depend on the
+ * thumbnail size, so there's just the one directory.
+ */
+static gchar *thumb_fail_path(const gchar *md5, gboolean make_dirs)
+{
+	gchar *dir, *path;
+
+	dir = g_strconcat(home_dir, "/.cache/thumbnails/fail/" PROJECT, NULL);
+	if (make_dirs)
+		g_mkdir_with_parents(dir, 0700);
+	path = g_strconcat(dir, "/", md5, ".png", NULL);
+	g_free(dir);
+
+	return path;
+}
+
+/* Remember that we couldn't make a thumbnail for 'path' (as it is now), so
+ * that we don't keep trying every time its directory is opened. The record
+ * is a blank PNG with the usual text chunks.
+ */
+static void thumb_fail_record(const char *path)
+{
+	struct stat info;
+	GdkPixbuf *blank;
+	gchar md5[33], *uri, *fail, *tmp, *ssize, *smtime;
+
+	if (mc_stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+		return;
+
+	blank = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+	if (!blank)
+		return;
+	gdk_pixbuf_fill(blank, 0);
+
+	thumb_name_for(path, TRUE, NULL, &uri, md5);
+	fail = thumb_fail_path(md5, TRUE);
+	tmp = g_strdup_printf("%s.ROX-Filer-%ld", fail, (long) getpid());
+	ssize = g_strdup_printf("%" SIZE_FMT, info.st_size);
+	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
+
+	if (!gdk_pixbuf_save(blank, tmp, "png", NULL,
+			"tEXt::Thumb::URI", uri,
+			"tEXt::Thumb::MTime", smtime,
+			"tEXt::Thumb::Size", ssize,
+			"tEXt::Software", PROJECT,
+			NULL) || rename(tmp, fail) != 0)
+		unlink(tmp);
+
+	g_object_unref(blank);
+	g_free(smtime);
+	g_free(ssize);
+	g_free(tmp);
+	g_free(fail);
+	g_free(uri);
+}
+
+/* Have we already failed to make a thumbnail for 'path'? Records for older
+ * versions of the file are deleted.
+ * Only the PNG's text chunks are read.
+ */
+static gboolean thumb_failed(const char *path)
+{
+	ThumbText text = {NULL, NULL, NULL};
+	struct stat info;
+	gchar md5[33], *fail;
+	gboolean failed = FALSE;
+
+	if (mc_stat(path, &info) != 0)
+		return FALSE;
+
+	thumb_name_for(path, TRUE, NULL, NULL, md5);
+	fail = thumb_fail_path(md5, FALSE);
+
+	if (read_thumb_text(fail, &text) != THUMB_UNREADABLE)
+	{
+		if (text.mtime && text.size &&
+		    atol(text.mtime) == info.st_mtime &&
+		    atol(text.size) == info.st_size)
+			failed = TRUE;
+		else
+			unlink(fail);	/* Changed; worth another go */
+	}
+
+	g_free(text.uri);
+	g_free(text.mtime);
+	g_free(text.size);
+	g_free(fail);
+
+	return failed;
+}
+
 static gchar *thumbnail_path(const char *path)
 {
-	gchar *uri, *md5;
+	gchar md5[33];
 	GString *to;
 	gchar *ans;
 
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if(!uri)
-	       uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
+	thumb_name_for(path, FALSE, NULL, NULL, md5);
 
 	to = g_string_new(home_dir);
 	g_string_append(to, "/.cache");
@@ -685,9 +1365,6 @@ static gchar *thumbnail_path(const char *path)
 	g_string_append(to, md5);
 	g_string_append(to, o_jpeg_thumbs.int_value ? ".jpg" : ".png");
 
-	g_free(md5);
-	g_free(uri);
-
 	ans=to->str;
 	g_string_free(to, FALSE);
 
@@ -720,8 +1397,8 @@ static gchar *thumbnail_program(MIME_type *type)
 	return path;
 }
 
-/* Load path and create the thumbnail
- * file. Parent will notice when we die.
+/* Load path and create the thumbnail file.
+ * Called from a thumb_pool thread.
  */
 static void create_thumbnail(const gchar *path, MIME_type *type)
 {
@@ -730,6 +1407,11 @@ static void create_thumbnail(const gchar *path, MIME_type *type)
         if(strcmp(type->subtype, "jpeg")==0)
             image=extract_tiff_thumbnail(path);
 
+#ifdef USE_LIBJPEG
+	if (!image && strcmp(type->subtype, "jpeg") == 0)
+		image = jpeg_load_scaled(path, thumb_size);
+#endif
+
 	if(!image)
             image = rox_pixbuf_new_from_file_at_scale(path,
 			thumb_size, thumb_size, TRUE, NULL);
@@ -743,35 +1425,78 @@ static void create_thumbnail(const gchar *path, MIME_type *type)
 
 char *pixmap_make_thumb_path(const char *path)
 {
-	char *thumb_path, *md5, *uri;
-
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if (!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(uri);
+	char md5[33];
 
-	thumb_path = g_strdup_printf(
-			"%s/.cache/thumbnails/%s/%s.%s",
-			home_dir, thumb_dir, md5, o_jpeg_thumbs.int_value ? "jpg" : "png");
-	g_free(md5);
+	thumb_name_for(path, FALSE, NULL, NULL, md5);
 
-	return thumb_path; /* This return is used unlink! Be carefull */
+	return thumb_file_path(md5); /* This return is used unlink! Be carefull */
 }
 
-static void make_dir_thumb(const gchar *path)
+/* Make sure the standard thumbnail file for 'path' exists if we have a
+ * thumbnail for it, writing it out from the pack if necessary (eg, so that
+ * a directory's thumbnail can be linked to it, or for other programs).
+ */
+void pixmap_export_thumb(const gchar *path)
 {
-	gchar *dir = g_path_get_dirname(path);
-	gchar *dir_thumb_path = pixmap_make_thumb_path(dir);
-	GdkPixbuf *image = gdk_pixbuf_new_from_file(dir_thumb_path, NULL);
-	if (image)
+	char *thumb_path;
+	struct stat info;
+	GdkPixbuf *thumb;
+
+	if (!o_thumb_pack.int_value || mc_stat(path, &info) != 0)
+		return;
+
+	thumb_path = pixmap_make_thumb_path(path);
+	if (access(thumb_path, F_OK) != 0 &&
+			(thumb = thumbpack_lookup(path, &info)))
 	{
-		g_object_unref(image);
+		write_thumbnail(path, &info, thumb,
+			option_atoi(thumb, "tEXt::Thumb::Image::Width"),
+			option_atoi(thumb, "tEXt::Thumb::Image::Height"));
+		g_object_unref(thumb);
 	}
-	else
-	{
+	g_free(thumb_path);
+}
+
+/* Forget that we failed to make a thumbnail for 'path', so that the next
+ * check tries again. TRUE if we had failed.
+ */
+gboolean pixmap_forget_failed_thumb(const gchar *path)
+{
+	gchar md5[33], *fail;
+	gboolean found, failed;
+	GdkPixbuf *pixmap;
+
+	pixmap = g_fscache_lookup_full(pixmap_cache, path,
+			FSCACHE_LOOKUP_ONLY_NEW, &found);
+	if (pixmap)
+		g_object_unref(pixmap);
+	else if (found)
+		g_fscache_remove(pixmap_cache, path);
+	failed = found && !pixmap;
+
+	thumb_name_for(path, TRUE, NULL, NULL, md5);
+	fail = thumb_fail_path(md5, FALSE);
+	if (unlink(fail) == 0)
+		failed = TRUE;
+	g_free(fail);
+
+	return failed;
+}
+
+static void make_dir_thumb(const gchar *path)
+{
+	gchar *dir = g_path_get_dirname(path);
+	gchar *dir_thumb_path = pixmap_make_thumb_path(dir);
+	GdkPixbuf *image = gdk_pixbuf_new_from_file(dir_thumb_path, NULL);
+	if (image)
+	{
+		g_object_unref(image);
+	}
+	else
+	{
 		unlink(dir_thumb_path); //////////////////////////
 
+		pixmap_export_thumb(path);
 		char *thumb_path = pixmap_make_thumb_path(path);
 		char *rel_path = get_relative_path(dir_thumb_path, thumb_path);
 
@@ -814,44 +1539,194 @@ static void ordered_update(ChildThumbnail *info)
 			g_slist_delete_link(done_stack, n);
 	}
 }
+/* Make one thumbnail in the background (see pixmap_background_thumb) */
+static void thumb_thread(gpointer data, gpointer unused)
+{
+	ChildThumbnail *info = data;
+
+	if (!g_atomic_int_get(&info->cancelled))
+		create_thumbnail(info->path, info->type);
+
+	g_idle_add(thumb_made, info);
+}
+
+/* Back in the main thread; pass the result on as if a child had died */
+static gboolean thumb_made(gpointer data)
+{
+	thumbnail_done((ChildThumbnail *) data);
+
+	return FALSE;
+}
+
 static void thumbnail_done(ChildThumbnail *info)
 {
 	if (info->timeout)
 		g_source_remove(info->timeout);
 
-	GdkPixbuf *thumb = get_thumbnail_for(info->path, FALSE);
-	if (thumb)
-	{
-		g_object_unref(thumb);
-		g_fscache_remove(thumb_cache, info->path);
-	}
+	thumb_jobs = g_list_remove(thumb_jobs, info);
+
+	gboolean made = have_thumbnail_for(info->path, FALSE);
+	if (made || info->cancelled)
+		g_fscache_remove(thumb_cache, info->path); /* Can try again */
 	else
+	{
 		g_fscache_insert(pixmap_cache, info->path, NULL, TRUE);
+		thumb_fail_record(info->path);
+	}
 
-	info->callback(info->data, thumb ? info->path : NULL);
+	info->callback(info->data, made ? info->path : NULL);
 
 	ordered_update(info);
 }
 
 
-/* Check if we have an up-to-date thumbnail for this image.
- * If so, return it. Otherwise, returns NULL.
+static int option_atoi(GdkPixbuf *pixbuf, const char *key)
+{
+	const char *value = gdk_pixbuf_get_option(pixbuf, key);
+
+	return value ? atoi(value) : 0;
+}
+
+/* Read the freedesktop text chunks from the PNG at 'thumb_path', stopping
+ * at the image data. A JPEG has none, but is THUMB_TEXT_READ anyway.
  */
-static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
+static ThumbHeader read_thumb_text(const char *thumb_path, ThumbText *text)
 {
+	static const guchar png_sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+	ThumbHeader ret = THUMB_UNREADABLE;
+	guchar buf[8];
+	FILE *in;
+
+	in = fopen(thumb_path, "rb");
+	if (!in)
+		return THUMB_UNREADABLE;
+
+	if (fread(buf, 1, 8, in) != 8)
+		goto out;
+
+	if (buf[0] == 0xff && buf[1] == 0xd8)
+	{
+		ret = THUMB_TEXT_READ;
+		goto out;
+	}
+
+	if (memcmp(buf, png_sig, 8) != 0)
+	{
+		ret = THUMB_NEEDS_DECODE;	/* Let gdk-pixbuf decide */
+		goto out;
+	}
+
+	while (fread(buf, 1, 8, in) == 8)
+	{
+		guint32 len = (buf[0] << 24) | (buf[1] << 16) |
+			      (buf[2] << 8) | buf[3];
+		const guchar *type = buf + 4;
+		gchar *data;
+
+		if (memcmp(type, "IDAT", 4) == 0 ||
+				memcmp(type, "IEND", 4) == 0)
+		{
+			ret = THUMB_TEXT_READ;
+			break;
+		}
+
+		if (memcmp(type, "tEXt", 4) != 0 &&
+				memcmp(type, "iTXt", 4) != 0 &&
+				memcmp(type, "zTXt", 4) != 0)
+		{
+			if (len > G_MAXINT32 - 4 ||
+					fseek(in, len + 4, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+
+		if (len > THUMB_TEXT_MAX)
+		{
+			ret = THUMB_NEEDS_DECODE;
+			break;
+		}
+
+		data = g_malloc(len + 1);
+		if (fread(data, 1, len, in) != len || fseek(in, 4, SEEK_CUR))
+		{
+			g_free(data);
+			break;
+		}
+		data[len] = '\0';
+
+		if (!thumb_text_chunk(text, (char *) type, data, len))
+			ret = THUMB_NEEDS_DECODE;
+		g_free(data);
+		if (ret == THUMB_NEEDS_DECODE)
+			break;
+	}
+out:
+	fclose(in);
+	return ret;
+}
+
+/* Store the value of one text chunk in 'text', if it's one we want.
+ * FALSE if it is, but it's compressed.
+ */
+static gboolean thumb_text_chunk(ThumbText *text, const char *type,
+				 const char *data, guint32 len)
+{
+	const char *value;
+	gchar **field;
+	gsize key_len = strlen(data);
+
+	if (key_len >= len)
+		return TRUE;	/* No value; ignore it */
+
+	if (strcmp(data, "Thumb::URI") == 0)
+		field = &text->uri;
+	else if (strcmp(data, "Thumb::MTime") == 0)
+		field = &text->mtime;
+	else if (strcmp(data, "Thumb::Size") == 0)
+		field = &text->size;
+	else
+		return TRUE;
+
+	value = data + key_len + 1;
+	if (strncmp(type, "zTXt", 4) == 0)
+		return FALSE;
+	if (strncmp(type, "iTXt", 4) == 0)
+	{
+		/* Compression flag and method, language, translated key */
+		if (value + 2 > data + len || value[0])
+			return FALSE;
+		value += 2;
+		value += strlen(value) + 1;
+		if (value > data + len)
+			return TRUE;
+		value += strlen(value) + 1;
+		if (value > data + len)
+			return TRUE;
+	}
+
+	g_free(*field);
+	*field = g_strdup(value);
+	return TRUE;
+}
+
+/* Is the thumbnail at 'thumb_path' an up-to-date one for 'path' (which has
+ * been through pathdup)? Only the PNG's text chunks (or a JPEG's ctime)
+ * are needed for this. Out-of-date thumbnails are deleted.
+ * If 'ret' isn't NULL, the thumbnail is then loaded into it.
+ */
+static gboolean thumbnail_current(const char *path, const char *thumb_path,
+				  gboolean forcheck, GdkPixbuf **ret)
+{
+	ThumbText text = {NULL, NULL, NULL};
 	GdkPixbuf *thumb = NULL;
-	char *thumb_path, *path, *pic_path = NULL;
-	const char *pic_uri, *ssize, *smtime;
 	struct stat info, thumbinfo;
+	gchar *pic_path = NULL;
+	gboolean ok = FALSE;
 	time_t ttime, now;
 
-	path = pathdup(pathname);
-
-	thumb_path = pixmap_make_thumb_path(path);
-
-	thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
-	if (!thumb)
+	switch (read_thumb_text(thumb_path, &text))
 	{
+	case THUMB_UNREADABLE:
 		if (forcheck
 				&& !mc_lstat(thumb_path, &thumbinfo)
 				&& S_ISLNK(thumbinfo.st_mode)
@@ -860,28 +1735,40 @@ static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 			unlink(thumb_path);
 
 		goto out;
+	case THUMB_NEEDS_DECODE:
+		thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
+		if (!thumb)
+			goto out;
+		g_free(text.uri);
+		g_free(text.mtime);
+		g_free(text.size);
+		text.uri = g_strdup(gdk_pixbuf_get_option(thumb,
+					"tEXt::Thumb::URI"));
+		text.mtime = g_strdup(gdk_pixbuf_get_option(thumb,
+					"tEXt::Thumb::MTime"));
+		text.size = g_strdup(gdk_pixbuf_get_option(thumb,
+					"tEXt::Thumb::Size"));
+		break;
+	case THUMB_TEXT_READ:
+		break;
 	}
 
-	/* Note that these don't need freeing... */
-	pic_uri = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::URI");
-	if (pic_uri)
+	if (text.uri)
 	{
-		pic_path = g_filename_from_uri(pic_uri, NULL, NULL);
+		pic_path = g_filename_from_uri(text.uri, NULL, NULL);
 
-		if (mc_stat(pic_path, &info) != 0)
+		if (!pic_path || mc_stat(pic_path, &info) != 0)
 			goto err;
 
-		smtime = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::MTime");
-		if (!smtime)
+		if (!text.mtime)
 			goto err;
-		ttime=(time_t) atol(smtime);
+		ttime=(time_t) atol(text.mtime);
 		time(&now);
 		if (info.st_mtime != ttime && now>ttime+PIXMAP_THUMB_TOO_OLD_TIME)
 			goto err;
 
 		/* This is optional, so don't flag an error if it is missing */
-		ssize = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::Size");
-		if (ssize && info.st_size < atol(ssize))
+		if (text.size && info.st_size < atol(text.size))
 			goto err;
 	}
 	else
@@ -904,19 +1791,93 @@ static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 			goto err;
 	}
 
+	if (ret && !thumb)
+	{
+		thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
+		if (!thumb)
+			goto err;	/* Corrupted; make it again */
+	}
+
+	ok = TRUE;
 	goto out;
 err:
-	g_object_unref(thumb);
 	unlink(thumb_path);
-	thumb = NULL;
-
 out:
+	if (ok && ret)
+		*ret = thumb;
+	else if (thumb)
+		g_object_unref(thumb);
+	g_free(text.uri);
+	g_free(text.mtime);
+	g_free(text.size);
 	g_free(pic_path);
+	return ok;
+}
+
+/* Check if we have an up-to-date thumbnail for this image.
+ * If so, return it. Otherwise, returns NULL.
+ */
+static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
+{
+	GdkPixbuf *thumb = NULL;
+	char *thumb_path, *path, md5[33];
+	struct stat packinfo;
+	gboolean packable = FALSE;
+
+	/* The pack is much quicker, when it has it */
+	if (o_thumb_pack.int_value && pathname[0] == '/' &&
+			mc_stat(pathname, &packinfo) == 0 &&
+			S_ISREG(packinfo.st_mode))
+	{
+		thumb = thumbpack_lookup(pathname, &packinfo);
+		if (thumb)
+			return thumb;
+		packable = !thumbpack_evicted(pathname);
+	}
+
+	thumb_name_for(pathname, TRUE, &path, NULL, md5);
+	thumb_path = thumb_file_path(md5);
+
+	/* Made by another program, or before we had a pack */
+	if (thumbnail_current(path, thumb_path, forcheck, &thumb) && packable)
+		thumbpack_add(pathname, &packinfo, thumb,
+			option_atoi(thumb, "tEXt::Thumb::Image::Width"),
+			option_atoi(thumb, "tEXt::Thumb::Image::Height"));
+
 	g_free(path);
 	g_free(thumb_path);
 	return thumb;
 }
 
+/* Like get_thumbnail_for, but only says whether there is an up-to-date
+ * thumbnail. Nothing is decoded.
+ */
+static gboolean have_thumbnail_for(const char *pathname, gboolean forcheck)
+{
+	GdkPixbuf *thumb;
+	char *thumb_path, *path, md5[33];
+	struct stat info;
+	gboolean ret;
+
+	if (o_thumb_pack.int_value && pathname[0] == '/' &&
+			mc_stat(pathname, &info) == 0 &&
+			S_ISREG(info.st_mode) &&
+			(thumb = thumbpack_lookup(pathname, &info)))
+	{
+		g_object_unref(thumb);
+		return TRUE;
+	}
+
+	thumb_name_for(pathname, TRUE, &path, NULL, md5);
+	thumb_path = thumb_file_path(md5);
+
+	ret = thumbnail_current(path, thumb_path, forcheck, NULL);
+
+	g_free(path);
+	g_free(thumb_path);
+	return ret;
+}
+
 /* Load the image 'path' and return a pointer to the resulting
  * MaskedPixmap. NULL on failure.
  * Doesn't check for thumbnails (this is for small icons).
@@ -1028,12 +1989,23 @@ GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h)
 		float scale_x = ((float) w) / max_w;
 		float scale_y = ((float) h) / max_h;
 		float scale = MAX(scale_x, scale_y);
-		int dest_w = w / scale;
-		int dest_h = h / scale;
+		int dest_w = MAX(w / scale, 1);
+		int dest_h = MAX(h / scale, 1);
+		GdkPixbuf *scaled;
+
+		/* Area-averaging is much faster than gdk-pixbuf's generic
+		 * filter when shrinking large images to icon size. Nearer
+		 * to 1:1, each output pixel covers too few source pixels
+		 * for a box filter to look as smooth as bilinear.
+		 */
+		if (scale >= 2)
+		{
+			scaled = boxscale_pixbuf(src, dest_w, dest_h);
+			if (scaled)
+				return scaled;
+		}
 
-		return gdk_pixbuf_scale_simple(src,
-						MAX(dest_w, 1),
-						MAX(dest_h, 1),
+		return gdk_pixbuf_scale_simple(src, dest_w, dest_h,
 						GDK_INTERP_BILINEAR);
 	}
 }
@@ -1053,15 +2025,45 @@ static MaskedPixmap *get_bad_image(void)
 	return mp;
 }
 
+static gsize pixbuf_cost(GdkPixbuf *pixbuf)
+{
+	if (!pixbuf)
+		return 0;
+	return gdk_pixbuf_get_rowstride(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+}
+
+/* Roughly how much memory an object in pixmap_cache or thumb_cache (a
+ * MaskedPixmap or a GdkPixbuf) is using.
+ */
+static gsize image_cost(gpointer object, gpointer data)
+{
+	MaskedPixmap *mp;
+	gsize cost;
+
+	if (GDK_IS_PIXBUF(object))
+		return pixbuf_cost(object);
+
+	mp = (MaskedPixmap *) object;
+	cost = sizeof(MaskedPixmap) + pixbuf_cost(mp->src_pixbuf);
+	if (mp->pixbuf != mp->src_pixbuf)
+		cost += pixbuf_cost(mp->pixbuf);
+	if (mp->sm_pixbuf != mp->pixbuf)
+		cost += pixbuf_cost(mp->sm_pixbuf);
+
+	return cost;
+}
+
 /* Called now and then to clear out old pixmaps */
 static gint purge_pixmaps(gpointer data)
 {
 	g_fscache_purge(pixmap_cache, PIXMAP_PURGE_TIME);
+	g_fscache_trim(pixmap_cache);
 	return TRUE;
 }
 static gint purge_thumbs(gpointer data)
 {
 	g_fscache_purge(thumb_cache, o_purge_time.int_value);
+	g_fscache_trim(thumb_cache);
 
 	g_timeout_add(MIN(60000, o_purge_time.int_value * 300 + 2000), purge_thumbs, NULL);
 	return FALSE;
@@ -1209,45 +2211,67 @@ static void load_default_pixmaps(void)
 	}
 }
 
-/* Also purges memory cache */
-static void purge_disk_cache(GtkWidget *button, gpointer data)
+/* Add the files in 'path' (ending in '/') not used since 'checktime' (or
+ * all of them, if it's 0) to 'list'. FALSE if the directory can't be read.
+ */
+static gboolean list_old_thumbs(const char *path, time_t checktime,
+				GList **list)
 {
-	char *path;
-	GList *list = NULL;
 	DIR *dir;
 	struct dirent *ent;
-
-	g_fscache_purge(thumb_cache, 0);
-
-	path = g_strconcat(home_dir, "/.cache/thumbnails/", thumb_dir, "/", NULL);
+	struct stat info;
 
 	dir = opendir(path);
 	if (!dir)
-	{
-		report_error(_("Can't delete thumbnails in %s:\n%s"),
-				path, g_strerror(errno));
-		goto out;
-	}
-
-	time_t checktime = o_purge_days.int_value ?
-		time(0) - (o_purge_days.int_value * 3600 * 24): 0;
-	struct stat info;
+		return FALSE;
 
 	while ((ent = readdir(dir)))
 	{
 		if (ent->d_name[0] == '.')
 			continue;
 
-		if (o_purge_days.int_value
+		if (checktime
 				&& !mc_lstat(make_path(path, ent->d_name), &info)
 				&& info.st_atime > checktime)
 			continue;
 
-		list = g_list_prepend(list,
-				      g_strconcat(path, ent->d_name, NULL));
+		*list = g_list_prepend(*list,
+				       g_strconcat(path, ent->d_name, NULL));
 	}
 
 	closedir(dir);
+	return TRUE;
+}
+
+/* Also purges memory cache */
+static void purge_disk_cache(GtkWidget *button, gpointer data)
+{
+	char *path, *fail;
+	GList *list = NULL;
+
+	g_fscache_purge(thumb_cache, 0);
+
+	thumbpack_purge(o_purge_days.int_value ?
+			time(0) - (o_purge_days.int_value * 3600 * 24) :
+			time(0) + 1);
+
+	path = g_strconcat(home_dir, "/.cache/thumbnails/", thumb_dir, "/", NULL);
+
+	time_t checktime = o_purge_days.int_value ?
+		time(0) - (o_purge_days.int_value * 3600 * 24): 0;
+
+	if (!list_old_thumbs(path, checktime, &list))
+	{
+		report_error(_("Can't delete thumbnails in %s:\n%s"),
+				path, g_strerror(errno));
+		goto out;
+	}
+
+	/* Failures are forgotten too, so that they get another go */
+	fail = g_strconcat(home_dir, "/.cache/thumbnails/fail/" PROJECT "/",
+			   NULL);
+	list_old_thumbs(fail, checktime, &list);
+	g_free(fail);
 
 	if (list)
 	{
@@ -1275,6 +2299,85 @@ static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label)
 	return g_list_append(NULL, align);
 }
 
+static gboolean update_thumbs_memory(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer bytes;
+	gsize total = 0;
+	gchar *text;
+
+	if (held_thumb_bytes)
+	{
+		g_hash_table_iter_init(&iter, held_thumb_bytes);
+		while (g_hash_table_iter_next(&iter, NULL, &bytes))
+			total += GPOINTER_TO_SIZE(bytes);
+	}
+
+	text = g_strdup_printf(_("Thumbnails held by windows: %.1f MB "
+				 "(%u dropped to stay under the limit)"),
+			total / 1048576.0, held_thumbs_dropped);
+	gtk_label_set_text(GTK_LABEL(data), text);
+	g_free(text);
+
+	return TRUE;
+}
+
+static gboolean update_stat_counts(gpointer data)
+{
+	guint saved, made;
+	gchar *text;
+
+	g_fscache_stat_counts(&saved, &made);
+	text = g_strdup_printf(_("File details looked up: %u, "
+				 "and %u more reused from a recent lookup"),
+			made, saved);
+	gtk_label_set_text(GTK_LABEL(data), text);
+	g_free(text);
+
+	return TRUE;
+}
+
+static void stop_stats_label(GtkWidget *label, gpointer data)
+{
+	g_source_remove(GPOINTER_TO_UINT(data));
+}
+
+/* A label set by 'update', and kept up to date while the Options box is
+ * open.
+ */
+static GList *stats_label(GSourceFunc update)
+{
+	GtkWidget *text, *align;
+	guint timeout;
+
+	align = gtk_alignment_new(0, 0.5, 0, 0);
+	text = gtk_label_new(NULL);
+	gtk_container_add(GTK_CONTAINER(align), text);
+
+	update(text);
+	timeout = g_timeout_add_seconds(2, update, text);
+	g_signal_connect(text, "destroy", G_CALLBACK(stop_stats_label),
+			 GUINT_TO_POINTER(timeout));
+
+	return g_list_append(NULL, align);
+}
+
+/* How much memory windows' thumbnails use */
+static GList *thumbs_memory(Option *option, xmlNode *node, guchar *label)
+{
+	g_return_val_if_fail(option == NULL, NULL);
+
+	return stats_label(update_thumbs_memory);
+}
+
+/* How many stat()s the caches made and saved; g_fscache_stat_counts() */
+static GList *stat_counts(Option *option, xmlNode *node, guchar *label)
+{
+	g_return_val_if_fail(option == NULL, NULL);
+
+	return stats_label(update_stat_counts);
+}
+
 /* Exif reading.
  * Based on Thierry Bousch's public domain exifdump.py.
  */
@@ -1428,6 +2531,166 @@ static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
     return buf;
 }
 
+#ifdef USE_LIBJPEG
+/* The size of a w x h image scaled to fit in size x size, as
+ * rox_pixbuf_new_from_file_at_scale() does it.
+ */
+static void fit_thumb_size(int w, int h, int size, int *fit_w, int *fit_h)
+{
+	if (h > w)
+	{
+		*fit_w = MAX(1, 0.5 + (double) w * size / h);
+		*fit_h = size;
+	}
+	else
+	{
+		*fit_h = MAX(1, 0.5 + (double) h * size / w);
+		*fit_w = size;
+	}
+}
+
+/* gdk-pixbuf's JPEG loader already has libjpeg scale in the IDCT (by 1/2,
+ * 1/4 or 1/8) when asked for a smaller size, as
+ * rox_pixbuf_new_from_file_at_scale() does. Decoding ourselves also lets us
+ * use the fast IDCT and plain upsampling, which are good enough for a
+ * thumbnail. And at 1/8 only the DC coefficients are used, so for a
+ * progressive JPEG we can stop reading as soon as the scans with those are
+ * complete.
+ */
+typedef struct _JpegError JpegError;
+struct _JpegError {
+	struct jpeg_error_mgr	mgr;
+	jmp_buf			jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((JpegError *) cinfo->err)->jump, 1);
+}
+
+static void jpeg_no_message(j_common_ptr cinfo)
+{
+}
+
+/* TRUE if the scans read so far give every component's DC coefficients.
+ * libjpeg only tracks this for progressive JPEGs.
+ */
+static gboolean jpeg_dc_complete(j_decompress_ptr cinfo)
+{
+	int c;
+
+	if (!cinfo->progressive_mode || !cinfo->coef_bits)
+		return FALSE;
+
+	for (c = 0; c < cinfo->num_components; c++)
+		if (cinfo->coef_bits[c][0] != 0)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Load the JPEG at 'path', scaled to fit in size x size. NULL on error (or
+ * if it's a kind libjpeg can't convert to RGB, eg CMYK), in which case
+ * gdk-pixbuf should be tried.
+ */
+static GdkPixbuf *jpeg_load_scaled(const gchar *path, int size)
+{
+	struct jpeg_decompress_struct cinfo;
+	JpegError jerr;
+	GdkPixbuf *volatile image = NULL;
+	GdkPixbuf *scaled;
+	FILE *in;
+	guchar *pixels;
+	int rowstride, w, h, denom, out_w, out_h;
+	gboolean dc_only;
+
+	in = fopen(path, "rb");
+	if (!in)
+		return NULL;
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_error_exit;
+	jerr.mgr.output_message = jpeg_no_message;
+	if (setjmp(jerr.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		fclose(in);
+		if (image)
+			g_object_unref(image);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, in);
+	jpeg_read_header(&cinfo, TRUE);
+
+	fit_thumb_size(cinfo.image_width, cinfo.image_height, size, &w, &h);
+
+	/* The smallest scale that is still at least as big as the result */
+	for (denom = 8; denom > 1; denom /= 2)
+		if (cinfo.image_width / denom >= w &&
+				cinfo.image_height / denom >= h)
+			break;
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+
+	/* A sequential JPEG can have several scans too (one per component),
+	 * but all of a block's coefficients are in the same scan.
+	 */
+	dc_only = denom == 8 && cinfo.progressive_mode;
+	cinfo.buffered_image = dc_only;
+
+	jpeg_start_decompress(&cinfo);
+
+	if (dc_only)
+	{
+		int ret;
+
+		do
+			ret = jpeg_consume_input(&cinfo);
+		while (ret != JPEG_REACHED_EOI && ret != JPEG_SUSPENDED &&
+			!(ret == JPEG_SCAN_COMPLETED && jpeg_dc_complete(&cinfo)));
+
+		jpeg_start_output(&cinfo, cinfo.input_scan_number);
+	}
+
+	image = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
+			cinfo.output_width, cinfo.output_height);
+	if (!image)
+		longjmp(jerr.jump, 1);
+	pixels = gdk_pixbuf_get_pixels(image);
+	rowstride = gdk_pixbuf_get_rowstride(image);
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW row = pixels + cinfo.output_scanline * rowstride;
+
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	out_w = cinfo.output_width;
+	out_h = cinfo.output_height;
+
+	/* No need to read the rest of the file */
+	jpeg_destroy_decompress(&cinfo);
+	fclose(in);
+
+	if (out_w != w || out_h != h)
+	{
+		scaled = gdk_pixbuf_scale_simple(image, w, h,
+				GDK_INTERP_BILINEAR);
+		g_object_unref(image);
+		image = scaled;
+	}
+
+	return image;
+}
+#endif
+
 
 static cairo_status_t suf_to_bufcb(void *p,
 		const unsigned char *data, unsigned int len)
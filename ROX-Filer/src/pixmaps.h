@@ -68,18 +68,37 @@ struct _MaskedPixmap
 	int		sm_width, sm_height;
 };
 
+/* A thumbnail a view is holding, for pixmap_trim_held_thumbs() */
+typedef struct _HeldThumb HeldThumb;
+
+struct _HeldThumb {
+	GdkPixbuf **thumb;	/* Set to NULL if dropped */
+	gint64	  used;		/* When last drawn (g_get_monotonic_time) */
+	gboolean  near;		/* On or near the screen; never dropped */
+	gpointer  data;		/* For the view */
+};
+
 void pixmaps_init(void);
 void pixmap_make_huge(MaskedPixmap *mp);
 void pixmap_make_small(MaskedPixmap *mp);
 MaskedPixmap *load_pixmap(const char *name);
 void pixmap_background_thumb(const gchar *path, gboolean noorder, GFunc callback, gpointer data);
+void pixmap_cancel_thumbs(gpointer data);
+guint pixmap_trim_held_thumbs(gpointer view, GArray *held);
+void pixmap_held_thumbs_gone(gpointer view);
 GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck);
 MaskedPixmap *masked_pixmap_new(GdkPixbuf *full_size);
 GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h);
 gint pixmap_check_thumb(const gchar *path);
 GdkPixbuf *pixmap_load_thumb(const gchar *path);
 char *pixmap_make_thumb_path(const char *path);
+void pixmap_export_thumb(const gchar *path);
+gboolean pixmap_forget_failed_thumb(const gchar *path);
 GdkPixbuf *pixmap_make_lined(GdkPixbuf *src, GdkColor *colour);
 MaskedPixmap *pixmap_from_desktop_file(const char *path);
 
+#ifdef UNIT_TESTS
+void pixmaps_tests(void);
+#endif
+
 #endif /* _PIXMAP_H */
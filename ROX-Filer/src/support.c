@@ -48,10 +48,42 @@
 #include "fscache.h"
 #include "main.h"
 #include "xml.h"
+#include "mount.h"
 
 static GHashTable *uid_hash = NULL;	/* UID -> User name */
 static GHashTable *gid_hash = NULL;	/* GID -> Group name */
 
+/* stat_async() hands its stat() calls to a few threads, so a hung
+ * filesystem blocks one of those rather than the caller. A mount point
+ * under which a stat() didn't finish in time is 'dead' until it does, and
+ * later requests under it fail at once.
+ */
+#define STAT_THREADS 4
+#define STAT_TIMEOUT 3		/* Seconds */
+
+typedef struct _StatJob StatJob;
+struct _StatJob
+{
+	gint		ref;
+	gchar		*path;
+	gchar		*mount;		/* What the stat is waiting on, or NULL */
+	StatCallback	callback;
+	gpointer	data;
+	guint		timeout;	/* Main thread only; 0 once it's run */
+	gboolean	reported;	/* Main thread only */
+
+	/* Protected by m_stat */
+	gboolean	started, done;
+	gboolean	timed_out;	/* The callback got ETIMEDOUT */
+	gboolean	hung;		/* Counted in dead_mounts */
+	int		err;
+	struct stat	info;
+};
+
+static GThreadPool *stat_pool = NULL;
+static GMutex m_stat;
+static GHashTable *dead_mounts = NULL;	/* Mount point -> hung stats */
+
 /* Static prototypes */
 static void MD5Transform(guint32 buf[4], guint32 const in[16]);
 
@@ -947,6 +979,7 @@ static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
  */
 static char *MD5Final(MD5Context *ctx)
 {
+	static const char hex[] = "0123456789abcdef";
 	char *retval;
 	int i;
 	int count = ctx->bytes[0] & 0x3f;	/* Number of bytes in ctx->in */
@@ -979,7 +1012,10 @@ static char *MD5Final(MD5Context *ctx)
 	retval = g_malloc(33);
 	bytes = (guint8 *) ctx->buf;
 	for (i = 0; i < 16; i++)
-		sprintf(retval + (i * 2), "%02x", bytes[i]);
+	{
+		retval[i * 2] = hex[bytes[i] >> 4];
+		retval[i * 2 + 1] = hex[bytes[i] & 0xf];
+	}
 	retval[32] = '\0';
 
 	return retval;
@@ -991,13 +1027,18 @@ static char *MD5Final(MD5Context *ctx)
 
 /* #define F1(x, y, z) (x & y | ~x & z) */
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
 #define F3(x, y, z) (x ^ y ^ z)
 #define F4(x, y, z) (y ^ (x | ~z))
 
 /* This is the central step in the MD5 algorithm. */
 #define MD5STEP(f,w,x,y,z,in,s) \
-	 (w += f(x,y,z) + in, w = (w<<s | w>>(32-s)) + x)
+	 (w += in, w += f(x,y,z), w = (w<<s | w>>(32-s)) + x)
+
+/* F2 is (x & z) | (y & ~z). The halves don't overlap, so they can be added
+ * separately, and (y & ~z) doesn't have to wait for x.
+ */
+#define MD5STEP2(w,x,y,z,in,s) \
+	 (w += in, w += y & ~z, w += x & z, w = (w<<s | w>>(32-s)) + x)
 
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
@@ -1030,22 +1071,22 @@ static void MD5Transform(guint32 buf[4], guint32 const in[16])
 	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
 	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
 
-	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+	MD5STEP2(a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP2(d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP2(c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP2(b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP2(a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP2(d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP2(c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP2(b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP2(a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP2(d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP2(c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP2(b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP2(a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP2(d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP2(c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP2(b, c, d, a, in[12] + 0x8d2a4c8a, 20);
 
 	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
 	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
@@ -1346,34 +1387,222 @@ GPtrArray *list_dir(const guchar *path)
 	return names;
 }
 
-int stat_with_timeout(const char *path, struct stat *info)
+static void stat_job_unref(StatJob *job)
+{
+	if (!g_atomic_int_dec_and_test(&job->ref))
+		return;
+
+	g_free(job->path);
+	g_free(job->mount);
+	g_free(job);
+}
+
+/* Pass the result to the callback, unless the timeout already has */
+static void stat_job_report(StatJob *job, int err)
 {
-	int status;
-	pid_t child;
-	gboolean retval;
+	if (job->reported)
+		return;
+	job->reported = TRUE;
 
-	child = fork();
-	if (child < 0)
+	job->callback(job->path, err, err ? NULL : &job->info, job->data);
+}
+
+static gboolean stat_job_finished(gpointer data)
+{
+	StatJob *job = (StatJob *) data;
+
+	if (job->timeout)
 	{
-		g_warning("stat_with_timeout: fork(): %s", g_strerror(errno));
-		return -1;
+		g_source_remove(job->timeout);
+		job->timeout = 0;
+		stat_job_unref(job);	/* The timeout's ref */
 	}
 
-	if (child == 0)
+	stat_job_report(job, job->err);
+
+	stat_job_unref(job);
+	return FALSE;
+}
+
+static gboolean stat_job_timeout(gpointer data)
+{
+	StatJob *job = (StatJob *) data;
+	gboolean done;
+
+	job->timeout = 0;
+
+	g_mutex_lock(&m_stat);
+	done = job->done;
+	if (!done)
 	{
-		/* Child */
-		alarm(3);
-		_exit(mc_stat(path, info) ? 1 : 0);
+		job->timed_out = TRUE;
+
+		/* If it's still waiting for a thread, the threads are all
+		 * busy with other paths, and this mount may be fine.
+		 */
+		if (job->started && job->mount)
+		{
+			gint n = GPOINTER_TO_INT(g_hash_table_lookup(
+						dead_mounts, job->mount));
+			g_hash_table_insert(dead_mounts, g_strdup(job->mount),
+					    GINT_TO_POINTER(n + 1));
+			job->hung = TRUE;
+		}
 	}
+	g_mutex_unlock(&m_stat);
 
-	waitpid(child, &status, 0);
+	/* If it's done, stat_job_finished() is on its way */
+	if (!done)
+		stat_job_report(job, ETIMEDOUT);
+
+	stat_job_unref(job);
+	return FALSE;
+}
 
-	if (status == 0)
-		retval = mc_stat(path, info);
+/* Say which mount point job's stat is now waiting on (or NULL if we can't
+ * tell). Takes 'mount'. Left alone once the job has timed out, so that
+ * stat_thread() gives back the mount that stat_job_timeout() blamed.
+ */
+static void stat_job_set_mount(StatJob *job, gchar *mount)
+{
+	g_mutex_lock(&m_stat);
+	if (job->timed_out)
+		g_free(mount);
 	else
-		retval = -1;
+	{
+		g_free(job->mount);
+		job->mount = mount;
+	}
+	g_mutex_unlock(&m_stat);
+}
 
-	return retval;
+/* stat() job->path, keeping job->mount set to the mount point the call is
+ * waiting on. Each leading directory is lstat()ed in turn, so that a hang
+ * is blamed on the filesystem it happened in. Once one is a symlink we
+ * can't tell where the rest goes without following it, so then nothing is
+ * blamed. Returns 0 or an errno value.
+ */
+static int stat_job_stat(StatJob *job, struct stat *info)
+{
+	gchar *prefix, *slash;
+	int err = 0;
+
+	if (job->path[0] != '/')
+		return mc_stat(job->path, info) ? errno : 0;
+
+	prefix = g_strdup(job->path);
+	slash = prefix;
+	do
+	{
+		slash = strchr(slash + 1, '/');
+		if (slash)
+			*slash = '\0';
+
+		stat_job_set_mount(job, mount_point_of(prefix));
+		if (mc_lstat(prefix, info))
+		{
+			err = errno;
+			break;
+		}
+
+		if (S_ISLNK(info->st_mode))
+		{
+			stat_job_set_mount(job, NULL);
+			if (mc_stat(job->path, info))
+				err = errno;
+			break;
+		}
+
+		if (slash)
+			*slash = '/';
+	} while (slash);
+	g_free(prefix);
+
+	return err;
+}
+
+static void stat_thread(gpointer data, gpointer unused)
+{
+	StatJob *job = (StatJob *) data;
+	struct stat info;
+	int err;
+
+	g_mutex_lock(&m_stat);
+	if (job->timed_out)
+	{
+		/* Gave up before we got to it */
+		g_mutex_unlock(&m_stat);
+		stat_job_unref(job);
+		return;
+	}
+	job->started = TRUE;
+	g_mutex_unlock(&m_stat);
+
+	err = stat_job_stat(job, &info);
+
+	g_mutex_lock(&m_stat);
+	job->err = err;
+	if (!err)
+		job->info = info;
+	job->done = TRUE;
+	if (job->hung)
+	{
+		/* Not so dead after all */
+		gint n = GPOINTER_TO_INT(g_hash_table_lookup(dead_mounts,
+							     job->mount));
+		if (n > 1)
+			g_hash_table_insert(dead_mounts, g_strdup(job->mount),
+					    GINT_TO_POINTER(n - 1));
+		else
+			g_hash_table_remove(dead_mounts, job->mount);
+	}
+	g_mutex_unlock(&m_stat);
+
+	g_idle_add(stat_job_finished, job);
+}
+
+/* stat() path in the pool, giving up after STAT_TIMEOUT seconds. Returns
+ * at once and calls 'callback' from the main loop later, with ETIMEDOUT if
+ * it gave up. It is always called, exactly once.
+ */
+void stat_async(const char *path, StatCallback callback, gpointer data)
+{
+	StatJob *job;
+	gchar *mount;
+	gboolean dead;
+
+	mount = mount_point_of(path);
+
+	g_mutex_lock(&m_stat);
+	if (!stat_pool)
+	{
+		stat_pool = g_thread_pool_new(stat_thread, NULL, STAT_THREADS,
+					      FALSE, NULL);
+		dead_mounts = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    g_free, NULL);
+	}
+	dead = mount && g_hash_table_lookup(dead_mounts, mount);
+	g_mutex_unlock(&m_stat);
+	g_free(mount);
+
+	job = g_new0(StatJob, 1);
+	job->path = g_strdup(path);
+	job->callback = callback;
+	job->data = data;
+
+	if (dead)
+	{
+		job->ref = 1;
+		job->err = ETIMEDOUT;
+		job->done = TRUE;
+		g_idle_add(stat_job_finished, job);
+		return;
+	}
+
+	job->ref = 2;		/* The thread's and the timeout's */
+	job->timeout = g_timeout_add_seconds(STAT_TIMEOUT,
+					     stat_job_timeout, job);
+	g_thread_pool_push(stat_pool, job, NULL);
 }
 
 /* From glib. */
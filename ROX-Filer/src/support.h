@@ -12,6 +12,12 @@
 
 #include <glib-object.h>
 
+/* Called from the main loop when stat_async() finishes. 'err' is 0 on
+ * success, or an errno (ETIMEDOUT if it took too long).
+ */
+typedef void (*StatCallback)(const char *path, int err,
+			     const struct stat *info, gpointer data);
+
 XMLwrapper *xml_cache_load(const gchar *pathname);
 int save_xml_file(xmlDocPtr doc, const gchar *filename);
 xmlDocPtr soap_new(xmlNodePtr *ret_body);
@@ -51,7 +57,7 @@ gboolean file_exists(const char *path);
 GPtrArray *list_dir_all(const guchar *path);
 GPtrArray *list_dir(const guchar *path);
 gint strcmp2(gconstpointer a, gconstpointer b);
-int stat_with_timeout(const char *path, struct stat *info);
+void stat_async(const char *path, StatCallback callback, gpointer data);
 
 EscapedPath *escape_uri_path(const char *path);
 EscapedPath *encode_path_as_uri(const guchar *path);
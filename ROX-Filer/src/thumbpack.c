@@ -0,0 +1,1025 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* thumbpack.c - keep decoded thumbnails together in one mapped file */
+
+/* Loading a thumbnail from ~/.cache/thumbnails means hashing the file's URI,
+ * opening a PNG or JPEG and decoding it. For a directory of thousands of
+ * images that is most of the time taken to show it. So, as well as using
+ * the standard per-file cache (which other programs share), we append each
+ * thumbnail's pixels to
+ * ~/.cache/rox.sourceforge.net/ROX-Filer/thumbs/<size>.pack
+ * and use them from there directly next time.
+ *
+ * The pack is a header and then a series of records, each of which is a
+ * PackRecord, the original file's path and the pixel rows. Records are only
+ * ever appended; one is dead if a later record has the same path, or if the
+ * file's mtime or size no longer match. When too much of the pack is dead,
+ * or it gets too big, the newest live records are copied to a new pack by
+ * another thread (see compact_start_locked()).
+ *
+ * The <size>.index file lists where the records are, so that they don't all
+ * have to be read at startup. It is written from time to time (atomically),
+ * and records how much of the pack it covers; records after that are found
+ * by reading the rest of the pack, and a partly-written record at the end
+ * (eg, after a crash) is cut off. The pack and index are in the machine's
+ * own byte order.
+ *
+ * Other copies of the filer may have the same pack mapped, and would crash
+ * if it got shorter. Each holds a shared flock() on it while it has it
+ * open, so a pack is only cut off or started again by a filer which can
+ * get an exclusive lock; otherwise a bad tail is just left alone (it may be
+ * another filer's record, still being written).
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "global.h"
+
+#include "thumbpack.h"
+
+#define PACK_MAGIC "ROXtpk1"
+#define INDEX_MAGIC "ROXtpi1"
+#define RECORD_MAGIC 0x6b636150	/* "Pack" */
+
+/* Unless thumbpack_use() is given a limit, the pack has room for about
+ * this many thumbnails (of the largest, RGB kind).
+ */
+#define PACK_AUTO_THUMBS 10000
+#define PACK_MIN_BYTES (64 * 1024 * 1024)
+#define PACK_MIN_COMPACT (16 * 1024 * 1024)	/* Don't bother below this */
+#define PACK_MAX_DIM 1024
+
+/* Save the index this long after the first unsaved change */
+#define INDEX_SAVE_DELAY 10
+
+#define PAD8(n) (((n) + 7) & ~((guint64) 7))
+
+typedef struct _PackHeader PackHeader;
+struct _PackHeader
+{
+	char	magic[8];
+	guint32	size;		/* Thumbnail size, eg 128 */
+	guint32	serial;		/* Changes when the pack is rewritten */
+};
+
+typedef struct _PackRecord PackRecord;
+struct _PackRecord
+{
+	guint32	magic;
+	guint32	path_len;	/* Including the '\0', before padding */
+	gint64	mtime, size;	/* Of the original file */
+	gint64	added;		/* When this record was written */
+	guint32	orig_width, orig_height;
+	guint16	width, height;
+	guint16	has_alpha;
+	guint16	unused;
+	guint32	rowstride;
+	guint32	sum;		/* Of the padded path and pixels */
+};
+
+typedef struct _IndexHeader IndexHeader;
+struct _IndexHeader
+{
+	char	magic[8];
+	guint64	covered;	/* Bytes of the pack listed here */
+	guint32	n_entries;
+	guint32	serial;		/* Must match the pack's */
+};
+
+/* In the index file, and (as the values of pack_index) in memory */
+typedef struct _PackEntry PackEntry;
+struct _PackEntry
+{
+	guint64	hash;		/* Of the path */
+	guint64	offset;
+	guint64	length;
+};
+
+/* The pack is mapped again when it grows. Pixbufs from lookups point into
+ * it, so an old mapping stays until they are all gone.
+ */
+typedef struct _PackMap PackMap;
+struct _PackMap
+{
+	gint	ref;
+	guchar	*data;
+	gsize	len;
+};
+
+/* All of the below is guarded by m_pack. Lookups may happen in the
+ * scandir_thread, and thumbnails are added from the thumb_pool threads.
+ */
+static GMutex m_pack;
+static gchar *pack_name = NULL;		/* NULL => don't use a pack */
+static int pack_size = 0;
+static int pack_fd = -1;
+static gboolean pack_failed = FALSE;	/* Don't try to open it again */
+static guint32 pack_serial = 0;
+static PackMap *pack_map = NULL;
+static guint64 pack_end = 0;
+static guint64 pack_live = 0;		/* Bytes in records in the index */
+static GHashTable *pack_index = NULL;	/* &hash -> PackEntry */
+static guint index_save_timeout = 0;
+static gboolean index_dirty = FALSE;
+static guint64 pack_max_bytes = PACK_MIN_BYTES;
+static guint pack_generation = 0;	/* Changes when the pack is closed */
+static gboolean compacting = FALSE;	/* compact_thread() is running */
+/* &hash of each record the last compaction left out. Thumbnails found in
+ * the standard cache aren't copied to the pack again if they're in here,
+ * or every compaction would just start the next.
+ */
+static GHashTable *pack_evicted = NULL;
+
+typedef struct _CompactItem CompactItem;
+struct _CompactItem
+{
+	PackEntry	entry;		/* As it was when we started */
+	gint64		added;
+};
+
+/* A compaction in progress. compact_thread() copies the records without
+ * m_pack held; the pack is only locked again to switch over.
+ */
+typedef struct _Compaction Compaction;
+struct _Compaction
+{
+	GArray		*items;		/* CompactItems, newest first */
+	PackMap		*map;		/* The pack, as it was */
+	guint64		end;		/* pack_end, when we started */
+	guint		generation;
+	guint64		max_bytes;
+	int		size;
+	gchar		*path, *tmp;
+};
+
+/* Static prototypes */
+static gboolean index_save_cb(gpointer data);
+
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static guint64 path_hash(const char *path)
+{
+	guint64 hash = 0xcbf29ce484222325ULL;	/* 64-bit FNV-1a */
+
+	for (; *path; path++)
+		hash = (hash ^ (guchar) *path) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* 'len' must be a multiple of 4 */
+static guint32 checksum(const guchar *data, guint64 len)
+{
+	guint32 sum = 0, word;
+	guint64 i;
+
+	for (i = 0; i < len; i += 4)
+	{
+		memcpy(&word, data + i, 4);
+		sum = ((sum << 1) | (sum >> 31)) + word;
+	}
+
+	return sum;
+}
+
+static gchar *pack_file(const char *ext)
+{
+	gchar *leaf = g_strconcat(pack_name, ext, NULL);
+	gchar *path = g_build_filename(g_get_user_cache_dir(),
+			SITE, PROJECT, "thumbs", leaf, NULL);
+
+	g_free(leaf);
+	return path;
+}
+
+static PackMap *map_new(int fd, gsize len)
+{
+	PackMap *map;
+	void *data;
+
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	map = g_new(PackMap, 1);
+	map->ref = 1;
+	map->data = data;
+	map->len = len;
+	return map;
+}
+
+static void map_unref(PackMap *map)
+{
+	if (map && g_atomic_int_dec_and_test(&map->ref))
+	{
+		munmap(map->data, map->len);
+		g_free(map);
+	}
+}
+
+static void map_unref_pixels(guchar *pixels, gpointer data)
+{
+	map_unref((PackMap *) data);
+}
+
+/* Map the whole of the pack again, if it has grown (perhaps because another
+ * copy of the filer added to it).
+ */
+static void remap_locked(void)
+{
+	struct stat info;
+	PackMap *map;
+
+	if (fstat(pack_fd, &info) != 0 || info.st_size <= pack_map->len)
+		return;
+
+	map = map_new(pack_fd, info.st_size);
+	if (!map)
+		return;
+
+	map_unref(pack_map);
+	pack_map = map;
+}
+
+static guint64 record_length(const PackRecord *r)
+{
+	return sizeof(PackRecord) + PAD8(r->path_len) +
+		PAD8((guint64) r->rowstride * r->height);
+}
+
+/* Return the record at 'offset', or NULL if there isn't a sane one there */
+static const PackRecord *record_at(PackMap *map, guint64 offset)
+{
+	const PackRecord *r;
+	const char *path;
+	guint channels;
+
+	if (offset % 8 || offset + sizeof(PackRecord) > map->len)
+		return NULL;
+
+	r = (PackRecord *) (map->data + offset);
+	channels = r->has_alpha ? 4 : 3;
+	if (r->magic != RECORD_MAGIC ||
+			r->path_len < 2 || r->path_len > 4096 ||
+			r->width == 0 || r->width > PACK_MAX_DIM ||
+			r->height == 0 || r->height > PACK_MAX_DIM ||
+			r->rowstride < r->width * channels ||
+			r->rowstride > PACK_MAX_DIM * 4 ||
+			r->rowstride % 4 ||
+			offset + record_length(r) > map->len)
+		return NULL;
+
+	path = (char *) (r + 1);
+	if (path[r->path_len - 1] != '\0' || path[0] != '/')
+		return NULL;
+
+	return r;
+}
+
+static const char *record_path(const PackRecord *r)
+{
+	return (char *) (r + 1);
+}
+
+static const guchar *record_pixels(const PackRecord *r)
+{
+	return (guchar *) (r + 1) + PAD8(r->path_len);
+}
+
+/* Add an entry, replacing any older one for the same path */
+static void index_add_locked(guint64 hash, guint64 offset, guint64 length)
+{
+	PackEntry *entry, *old;
+
+	old = g_hash_table_lookup(pack_index, &hash);
+	if (old)
+		pack_live -= old->length;
+
+	entry = g_new(PackEntry, 1);
+	entry->hash = hash;
+	entry->offset = offset;
+	entry->length = length;
+	g_hash_table_replace(pack_index, &entry->hash, entry);
+	pack_live += length;
+}
+
+static void index_remove_locked(PackEntry *entry)
+{
+	pack_live -= entry->length;
+	g_hash_table_remove(pack_index, &entry->hash);
+}
+
+static void index_changed_locked(void)
+{
+	index_dirty = TRUE;
+	if (!index_save_timeout)
+		index_save_timeout = g_timeout_add_seconds(INDEX_SAVE_DELAY,
+				index_save_cb, NULL);
+}
+
+static void index_save_locked(void)
+{
+	GByteArray *data;
+	IndexHeader header;
+	GHashTableIter iter;
+	PackEntry *entry;
+	gchar *path;
+
+	if (pack_fd == -1 || !index_dirty)
+		return;
+	index_dirty = FALSE;
+
+	data = g_byte_array_sized_new(sizeof(header) +
+			g_hash_table_size(pack_index) * sizeof(PackEntry));
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, 8);
+	header.covered = pack_end;
+	header.n_entries = g_hash_table_size(pack_index);
+	header.serial = pack_serial;
+	g_byte_array_append(data, (guint8 *) &header, sizeof(header));
+
+	g_hash_table_iter_init(&iter, pack_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry))
+		g_byte_array_append(data, (guint8 *) entry, sizeof(*entry));
+
+	path = pack_file(".index");
+	g_file_set_contents(path, (gchar *) data->data, data->len, NULL);
+	g_free(path);
+
+	g_byte_array_free(data, TRUE);
+}
+
+static gboolean index_save_cb(gpointer data)
+{
+	g_mutex_lock(&m_pack);
+	index_save_timeout = 0;
+	index_save_locked();
+	g_mutex_unlock(&m_pack);
+
+	return FALSE;
+}
+
+/* Read the index, if it belongs to this pack. Returns how much of the pack
+ * it covers (0 if it couldn't be used).
+ */
+static guint64 index_load_locked(void)
+{
+	gchar *path = pack_file(".index");
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+	const IndexHeader *header;
+	const PackEntry *entries;
+	guint64 covered = 0;
+	gsize len;
+	int i;
+
+	g_free(path);
+	if (!file)
+		return 0;
+
+	len = g_mapped_file_get_length(file);
+	header = (IndexHeader *) g_mapped_file_get_contents(file);
+
+	if (len < sizeof(IndexHeader) ||
+			memcmp(header->magic, INDEX_MAGIC, 8) != 0 ||
+			header->serial != pack_serial ||
+			header->covered > pack_map->len ||
+			header->covered < sizeof(PackHeader) ||
+			len != sizeof(IndexHeader) +
+				(guint64) header->n_entries * sizeof(PackEntry))
+		goto out;
+
+	entries = (PackEntry *) (header + 1);
+	for (i = 0; i < header->n_entries; i++)
+	{
+		const PackEntry *e = &entries[i];
+
+		if (e->offset < sizeof(PackHeader) ||
+				e->offset + e->length > header->covered)
+			continue;
+		index_add_locked(e->hash, e->offset, e->length);
+	}
+	covered = header->covered;
+out:
+	g_mapped_file_unref(file);
+	return covered;
+}
+
+/* Add the records from 'offset' onwards to the index. Returns the end of
+ * the last good one.
+ */
+static guint64 scan_locked(guint64 offset)
+{
+	const PackRecord *r;
+
+	while ((r = record_at(pack_map, offset)))
+	{
+		guint64 len = record_length(r);
+
+		if (checksum((guchar *) (r + 1), len - sizeof(*r)) != r->sum)
+			break;
+
+		index_add_locked(path_hash(record_path(r)), offset, len);
+		offset += len;
+	}
+
+	return offset;
+}
+
+/* Start a new pack in the empty file 'fd'. Its serial number is stored in
+ * 'serial'.
+ */
+static gboolean pack_init_file(int fd, int size, guint32 *serial)
+{
+	PackHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, 8);
+	header.size = size;
+	header.serial = *serial = g_random_int();
+
+	return write(fd, &header, sizeof(header)) == sizeof(header);
+}
+
+static void pack_open_locked(void)
+{
+	struct stat info;
+	guint64 covered, end;
+	guint32 serial = 0;
+	gboolean alone;
+	gchar *path, *dir;
+	int fd;
+
+	path = pack_file(".pack");
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	g_free(path);
+	if (fd == -1)
+		goto err;
+
+	/* Held until we're ready, and then shared (see the top of the file) */
+	alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+	if (!alone && flock(fd, LOCK_SH) != 0)
+		goto err;
+
+	if (fstat(fd, &info) != 0)
+		goto err;
+
+	if (info.st_size >= sizeof(PackHeader))
+	{
+		PackHeader h;
+
+		if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+				memcmp(h.magic, PACK_MAGIC, 8) != 0 ||
+				h.size != pack_size)
+			info.st_size = 0;
+		serial = h.serial;
+	}
+	else
+		info.st_size = 0;
+
+	if (info.st_size == 0)
+	{
+		/* Another filer is using it (as a different size, perhaps) */
+		if (!alone)
+			goto err;
+		if (ftruncate(fd, 0) != 0 ||
+				!pack_init_file(fd, pack_size, &serial))
+			goto err;
+		info.st_size = sizeof(PackHeader);
+	}
+
+	pack_map = map_new(fd, info.st_size);
+	if (!pack_map)
+		goto err;
+
+	pack_fd = fd;
+	pack_serial = serial;
+	pack_live = 0;
+	pack_index = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			NULL, g_free);
+
+	covered = index_load_locked();
+	end = scan_locked(covered ? covered : sizeof(PackHeader));
+	if (end < pack_map->len && alone)
+	{
+		/* Lose the partly-written record (and anything after it) */
+		if (ftruncate(fd, end) != 0)
+			g_warning("Can't truncate thumbnail pack: %s",
+					g_strerror(errno));
+		map_unref(pack_map);
+		pack_map = map_new(fd, end);
+		if (!pack_map)
+		{
+			g_hash_table_destroy(pack_index);
+			pack_index = NULL;
+			pack_fd = -1;
+			goto err;
+		}
+	}
+	pack_end = end;
+	if (end != covered)
+		index_changed_locked();
+	if (alone)
+		flock(fd, LOCK_SH);
+	return;
+err:
+	if (fd != -1)
+		close(fd);
+	pack_failed = TRUE;
+}
+
+static void pack_close_locked(void)
+{
+	if (pack_fd == -1)
+		return;
+
+	index_save_locked();
+
+	close(pack_fd);
+	pack_fd = -1;
+	map_unref(pack_map);
+	pack_map = NULL;
+	g_hash_table_destroy(pack_index);
+	pack_index = NULL;
+	if (pack_evicted)
+	{
+		g_hash_table_destroy(pack_evicted);
+		pack_evicted = NULL;
+	}
+	pack_generation++;	/* Any compaction is now for nothing */
+}
+
+/* TRUE if the pack is open (opening it if needed) */
+static gboolean pack_ready_locked(void)
+{
+	if (pack_fd != -1)
+		return TRUE;
+	if (pack_failed || !pack_name)
+		return FALSE;
+
+	pack_open_locked();
+
+	return pack_fd != -1;
+}
+
+static gint cmp_newest_first(gconstpointer a, gconstpointer b)
+{
+	gint64 ta = ((CompactItem *) a)->added;
+	gint64 tb = ((CompactItem *) b)->added;
+
+	return ta > tb ? -1 : ta < tb;
+}
+
+static void compaction_free(Compaction *c)
+{
+	g_array_free(c->items, TRUE);
+	map_unref(c->map);
+	g_free(c->tmp);
+	g_free(c->path);
+	g_free(c);
+}
+
+/* Append the record 'old' in 'map' to 'fd', where it will be at
+ * 'new_offset', and add it to 'index'. FALSE on error.
+ */
+static gboolean copy_record(int fd, PackMap *map, const PackEntry *old,
+			    guint64 new_offset, GHashTable *index)
+{
+	PackEntry *new;
+
+	if (write(fd, map->data + old->offset, old->length) != old->length)
+		return FALSE;
+
+	new = g_new(PackEntry, 1);
+	new->hash = old->hash;
+	new->offset = new_offset;
+	new->length = old->length;
+	g_hash_table_replace(index, &new->hash, new);
+
+	return TRUE;
+}
+
+/* Copy the newest live records to a new pack, keeping them under half of
+ * the limit, and then switch to it. The pack is only locked at the end, to
+ * catch up with changes made while we were copying.
+ */
+static gpointer compact_thread(gpointer data)
+{
+	Compaction *c = (Compaction *) data;
+	GHashTable *new_index, *evicted;
+	GHashTableIter iter;
+	PackEntry *entry;
+	PackMap *map = NULL;
+	guint64 offset, live = 0;
+	guint32 serial;
+	int fd, i, copied;
+
+	new_index = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			NULL, g_free);
+	evicted = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			g_free, NULL);
+
+	/* A new file, so no other filer has it mapped. It's shared as soon
+	 * as it's renamed into place.
+	 */
+	fd = g_mkstemp_full(c->tmp, O_RDWR | O_APPEND, 0600);
+	if (fd == -1 || flock(fd, LOCK_SH) != 0 ||
+			!pack_init_file(fd, c->size, &serial))
+		goto err_unlocked;
+
+	offset = sizeof(PackHeader);
+	for (copied = 0; copied < c->items->len; copied++)
+	{
+		PackEntry *old = &g_array_index(c->items, CompactItem,
+						copied).entry;
+
+		if (offset + old->length > c->max_bytes / 2)
+			break;
+		if (!copy_record(fd, c->map, old, offset, new_index))
+			goto err_unlocked;
+		offset += old->length;
+	}
+	for (i = copied; i < c->items->len; i++)
+	{
+		guint64 hash = g_array_index(c->items, CompactItem,
+					     i).entry.hash;
+		g_hash_table_add(evicted, g_memdup(&hash, sizeof(hash)));
+	}
+
+	g_mutex_lock(&m_pack);
+	if (c->generation != pack_generation)
+	{
+		/* The pack was closed (eg, a different size was chosen) */
+		close(fd);
+		unlink(c->tmp);
+		g_hash_table_destroy(new_index);
+		g_hash_table_destroy(evicted);
+		goto out;
+	}
+
+	/* Drop the records which were removed or replaced meanwhile */
+	for (i = 0; i < copied; i++)
+	{
+		PackEntry *old = &g_array_index(c->items, CompactItem, i).entry;
+
+		entry = g_hash_table_lookup(pack_index, &old->hash);
+		if (!entry || entry->offset != old->offset)
+			g_hash_table_remove(new_index, &old->hash);
+	}
+
+	/* And copy the ones added meanwhile (not many) */
+	remap_locked();
+	g_hash_table_iter_init(&iter, pack_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry))
+	{
+		if (entry->offset < c->end ||
+		    !record_at(pack_map, entry->offset))
+			continue;
+		if (!copy_record(fd, pack_map, entry, offset, new_index))
+			goto err;
+		g_hash_table_remove(evicted, &entry->hash);
+		offset += entry->length;
+	}
+
+	g_hash_table_iter_init(&iter, new_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry))
+		live += entry->length;
+
+	map = map_new(fd, offset);
+	if (!map || rename(c->tmp, c->path) != 0)
+		goto err;
+
+	close(pack_fd);
+	map_unref(pack_map);
+	g_hash_table_destroy(pack_index);
+	if (pack_evicted)
+		g_hash_table_destroy(pack_evicted);
+
+	pack_fd = fd;
+	pack_map = map;
+	pack_serial = serial;
+	pack_index = new_index;
+	pack_evicted = evicted;
+	pack_end = offset;
+	pack_live = live;
+	index_dirty = TRUE;
+	index_save_locked();
+	goto out;
+err_unlocked:
+	g_mutex_lock(&m_pack);
+err:
+	g_warning("Can't compact thumbnail pack: %s", g_strerror(errno));
+	map_unref(map);
+	g_hash_table_destroy(new_index);
+	g_hash_table_destroy(evicted);
+	if (fd != -1)
+	{
+		close(fd);
+		unlink(c->tmp);
+	}
+	if (c->generation == pack_generation)
+	{
+		/* Rather than trying again after every thumbnail */
+		pack_close_locked();
+		pack_failed = TRUE;
+	}
+out:
+	compacting = FALSE;
+	g_mutex_unlock(&m_pack);
+
+	compaction_free(c);
+	return NULL;
+}
+
+/* Start copying the live records added since 'cutoff' to a new pack,
+ * keeping the newest if they won't all fit in half of pack_max_bytes.
+ * Does nothing if that's already happening.
+ */
+static void compact_start_locked(gint64 cutoff)
+{
+	GHashTableIter iter;
+	PackEntry *entry;
+	Compaction *c;
+
+	if (compacting)
+		return;
+
+	remap_locked();
+
+	c = g_new(Compaction, 1);
+	c->items = g_array_new(FALSE, FALSE, sizeof(CompactItem));
+	g_hash_table_iter_init(&iter, pack_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry))
+	{
+		const PackRecord *r = record_at(pack_map, entry->offset);
+		CompactItem item;
+
+		if (!r || r->added < cutoff)
+			continue;
+		item.entry = *entry;
+		item.added = r->added;
+		g_array_append_val(c->items, item);
+	}
+	g_array_sort(c->items, cmp_newest_first);
+
+	c->map = pack_map;
+	g_atomic_int_inc(&c->map->ref);
+	c->end = pack_end;
+	c->generation = pack_generation;
+	c->max_bytes = pack_max_bytes;
+	c->size = pack_size;
+	c->path = pack_file(".pack");
+	c->tmp = g_strconcat(c->path, ".XXXXXX", NULL);
+
+	compacting = TRUE;
+	g_thread_unref(g_thread_new("thumbpack", compact_thread, c));
+}
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* Use the pack called 'name' (eg "normal"), for thumbnails that fit in
+ * 'size' x 'size'. NULL to stop using packs. It is kept under about
+ * 'max_bytes'; 0 means room for about PACK_AUTO_THUMBS thumbnails.
+ */
+void thumbpack_use(const char *name, int size, guint64 max_bytes)
+{
+	g_mutex_lock(&m_pack);
+	pack_max_bytes = max_bytes ? max_bytes
+		: (guint64) PACK_AUTO_THUMBS * size * size * 3;
+	pack_max_bytes = MAX(pack_max_bytes, PACK_MIN_BYTES);
+
+	if (g_strcmp0(name, pack_name) != 0 || size != pack_size)
+	{
+		pack_close_locked();
+		g_free(pack_name);
+		pack_name = g_strdup(name);
+		pack_size = size;
+		pack_failed = FALSE;
+	}
+	g_mutex_unlock(&m_pack);
+}
+
+/* Return the thumbnail for the file at 'path', whose details are 'info',
+ * or NULL if the pack doesn't have an up-to-date one. The pixbuf uses the
+ * pack's memory directly. Its Thumb::Image::Width/Height, MTime and Size
+ * options are set, as if it had been loaded from a standard thumbnail.
+ */
+GdkPixbuf *thumbpack_lookup(const char *path, const struct stat *info)
+{
+	guint64 hash = path_hash(path);
+	const PackRecord *r;
+	PackEntry *entry;
+	PackMap *map;
+	GdkPixbuf *thumb;
+	gchar *opt;
+
+	g_mutex_lock(&m_pack);
+	if (!pack_ready_locked())
+		goto miss;
+
+	entry = g_hash_table_lookup(pack_index, &hash);
+	if (!entry)
+		goto miss;
+
+	if (entry->offset + entry->length > pack_map->len)
+		remap_locked();
+	r = record_at(pack_map, entry->offset);
+	if (!r || strcmp(record_path(r), path) != 0)
+		goto miss;
+
+	if (r->mtime != info->st_mtime || r->size != info->st_size)
+	{
+		/* The file has changed; this one will never be used again */
+		index_remove_locked(entry);
+		index_changed_locked();
+		goto miss;
+	}
+
+	map = pack_map;
+	g_atomic_int_inc(&map->ref);
+	g_mutex_unlock(&m_pack);
+
+	thumb = gdk_pixbuf_new_from_data(record_pixels(r), GDK_COLORSPACE_RGB,
+			r->has_alpha, 8, r->width, r->height, r->rowstride,
+			map_unref_pixels, map);
+
+	if (r->orig_width && r->orig_height)
+	{
+		opt = g_strdup_printf("%u", r->orig_width);
+		gdk_pixbuf_set_option(thumb, "tEXt::Thumb::Image::Width", opt);
+		g_free(opt);
+		opt = g_strdup_printf("%u", r->orig_height);
+		gdk_pixbuf_set_option(thumb, "tEXt::Thumb::Image::Height", opt);
+		g_free(opt);
+	}
+	opt = g_strdup_printf("%" G_GINT64_FORMAT, r->mtime);
+	gdk_pixbuf_set_option(thumb, "tEXt::Thumb::MTime", opt);
+	g_free(opt);
+	opt = g_strdup_printf("%" G_GINT64_FORMAT, r->size);
+	gdk_pixbuf_set_option(thumb, "tEXt::Thumb::Size", opt);
+	g_free(opt);
+
+	return thumb;
+miss:
+	g_mutex_unlock(&m_pack);
+	return NULL;
+}
+
+/* Append 'thumb', the thumbnail of the regular file at 'path' (details
+ * 'info'), to the pack. The original image's size is recorded too, if known
+ * (zero otherwise).
+ */
+void thumbpack_add(const char *path, const struct stat *info,
+		   GdkPixbuf *thumb, int orig_width, int orig_height)
+{
+	PackRecord r;
+	guchar *data, *pixels;
+	const guchar *src;
+	guint64 len, offset;
+	guint32 path_len = strlen(path) + 1;
+	guint64 r_hash = path_hash(path);
+	int y, row;
+
+	if (!S_ISREG(info->st_mode) || path[0] != '/' || path_len > 4096 ||
+			gdk_pixbuf_get_colorspace(thumb) != GDK_COLORSPACE_RGB ||
+			gdk_pixbuf_get_bits_per_sample(thumb) != 8 ||
+			gdk_pixbuf_get_width(thumb) > PACK_MAX_DIM ||
+			gdk_pixbuf_get_height(thumb) > PACK_MAX_DIM)
+		return;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = RECORD_MAGIC;
+	r.path_len = path_len;
+	r.mtime = info->st_mtime;
+	r.size = info->st_size;
+	r.added = time(NULL);
+	r.orig_width = MAX(orig_width, 0);
+	r.orig_height = MAX(orig_height, 0);
+	r.width = gdk_pixbuf_get_width(thumb);
+	r.height = gdk_pixbuf_get_height(thumb);
+	r.has_alpha = gdk_pixbuf_get_has_alpha(thumb) ? 1 : 0;
+	row = r.width * gdk_pixbuf_get_n_channels(thumb);
+	r.rowstride = (row + 3) & ~3;
+
+	/* The last row of a GdkPixbuf may be shorter than its rowstride, so
+	 * copy them one at a time.
+	 */
+	len = record_length(&r);
+	data = g_malloc0(len);
+	memcpy(data + sizeof(r), path, path_len);
+	pixels = data + sizeof(r) + PAD8(path_len);
+	src = gdk_pixbuf_get_pixels(thumb);
+	for (y = 0; y < r.height; y++)
+		memcpy(pixels + y * r.rowstride,
+			src + y * gdk_pixbuf_get_rowstride(thumb), row);
+	r.sum = checksum(data + sizeof(r), len - sizeof(r));
+	memcpy(data, &r, sizeof(r));
+
+	g_mutex_lock(&m_pack);
+	if (!pack_ready_locked())
+		goto out;
+
+	/* O_APPEND puts it at the end even if another filer has added
+	 * records since we last looked.
+	 */
+	if (write(pack_fd, data, len) != len)
+	{
+		g_warning("Can't add to thumbnail pack: %s",
+				g_strerror(errno));
+		goto out;
+	}
+	offset = lseek(pack_fd, 0, SEEK_CUR) - len;
+	pack_end = MAX(pack_end, offset + len);
+
+	index_add_locked(r_hash, offset, len);
+	index_changed_locked();
+
+	if (pack_evicted)
+		g_hash_table_remove(pack_evicted, &r_hash);
+
+	if (pack_end > pack_max_bytes ||
+			(pack_end > PACK_MIN_COMPACT && pack_live < pack_end / 2))
+		compact_start_locked(0);
+out:
+	g_mutex_unlock(&m_pack);
+	g_free(data);
+}
+
+/* Forget any thumbnail for 'path' (eg, so that it will be made again) */
+void thumbpack_remove(const char *path)
+{
+	guint64 hash = path_hash(path);
+	PackEntry *entry;
+
+	g_mutex_lock(&m_pack);
+	if (pack_fd != -1 &&
+			(entry = g_hash_table_lookup(pack_index, &hash)))
+	{
+		index_remove_locked(entry);
+		index_changed_locked();
+	}
+	g_mutex_unlock(&m_pack);
+}
+
+/* Drop thumbnails which were added to the pack before 'cutoff'. This
+ * happens in the background.
+ */
+void thumbpack_purge(time_t cutoff)
+{
+	g_mutex_lock(&m_pack);
+	if (pack_ready_locked())
+		compact_start_locked(cutoff);
+	g_mutex_unlock(&m_pack);
+}
+
+/* TRUE if the pack recently had to drop the thumbnail for 'path' to stay
+ * under its limit. Such a thumbnail, found in the standard cache, shouldn't
+ * be added again.
+ */
+gboolean thumbpack_evicted(const char *path)
+{
+	guint64 hash = path_hash(path);
+	gboolean evicted;
+
+	g_mutex_lock(&m_pack);
+	evicted = pack_evicted && g_hash_table_contains(pack_evicted, &hash);
+	g_mutex_unlock(&m_pack);
+
+	return evicted;
+}
@@ -0,0 +1,21 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Thomas Leonard, <tal197@users.sourceforge.net>
+ */
+
+
+#ifndef _THUMBPACK_H
+#define _THUMBPACK_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+void thumbpack_use(const char *name, int size, guint64 max_bytes);
+GdkPixbuf *thumbpack_lookup(const char *path, const struct stat *info);
+void thumbpack_add(const char *path, const struct stat *info,
+		   GdkPixbuf *thumb, int orig_width, int orig_height);
+void thumbpack_remove(const char *path);
+void thumbpack_purge(time_t cutoff);
+gboolean thumbpack_evicted(const char *path);
+
+#endif /* _THUMBPACK_H */
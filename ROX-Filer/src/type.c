@@ -314,14 +314,22 @@ MIME_type *type_get_type(const guchar *path)
 MIME_type *type_from_path(const char *path)
 {
 	MIME_type *mime_type = NULL;
-	const char *type_name;
 
 	/* Check for extended attribute first */
 	mime_type = xtype_get(path);
 	if (mime_type)
 		return mime_type;
 
-	/* Try name and contents next */
+	return type_guess_from_path(path);
+}
+
+/* As type_from_path(), but without checking for an extended attribute;
+ * for callers that already have. NULL if nothing matches.
+ */
+MIME_type *type_guess_from_path(const char *path)
+{
+	const char *type_name;
+
 	g_mutex_lock(&m_xdg);
 	type_name = xdg_mime_get_mime_type_for_file(path, NULL);
 	g_mutex_unlock(&m_xdg);
@@ -164,6 +164,7 @@ static DirItem *iter_prev(ViewIter *iter);
 static DirItem *iter_peek(ViewIter *iter);
 static void reset_thumb_func(ViewCollection *vc);
 static void clear_thumb_func(ViewCollection *vc);
+static void queue_trim_thumbs(ViewCollection *vc);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -177,6 +178,7 @@ GtkWidget *view_collection_new(FilerWindow *filer_window)
 	view_collection->filer_window = filer_window;
 
 	view_collection->thumb_func = 0;
+	view_collection->thumb_trim = 0;
 	reset_thumb_func(view_collection);
 
 	/* Starting with GTK+-2.2.2, the vadjustment is reset after init
@@ -233,6 +235,13 @@ static void view_collection_destroy(GtkObject *view_collection)
 
 	clear_thumb_func(VIEW_COLLECTION(view_collection));
 
+	if (VIEW_COLLECTION(view_collection)->thumb_trim)
+	{
+		g_source_remove(VIEW_COLLECTION(view_collection)->thumb_trim);
+		VIEW_COLLECTION(view_collection)->thumb_trim = 0;
+	}
+	pixmap_held_thumbs_gone(view_collection);
+
 	(*GTK_OBJECT_CLASS(parent_class)->destroy)(view_collection);
 }
 
@@ -539,6 +548,22 @@ static void draw_cursor(GtkWidget *widget,
 	cairo_destroy(cr);
 }
 
+/* Is item 'idx' in a row that's (at least partly) on screen? */
+static gboolean item_on_screen(Collection *collection, int idx)
+{
+	int row, col, top;
+
+	collection_item_to_rowcol(collection, idx, &row, &col);
+	top = row * collection->item_height;
+
+	return top + collection->item_height > collection->vadj->value &&
+		top < collection->vadj->value + collection->vadj->page_size;
+}
+
+/* Load the thumbnails of the items queued by draw_item(). Items that have
+ * been scrolled away since are skipped; they stay marked, so they are
+ * queued again if they're drawn again.
+ */
 static gboolean next_thumb(ViewCollection *vc)
 {
 	int i;
@@ -560,7 +585,8 @@ static gboolean next_thumb(ViewCollection *vc)
 			DirItem        *item = (DirItem *) colitem->data;
 			ViewData       *view = (ViewData *) colitem->view_data;
 
-			if (view->iconstatus != 4)
+			if (view->iconstatus != 4 ||
+					!item_on_screen(vc->collection, idx))
 				continue;
 
 			if (!view->thumb)
@@ -569,6 +595,8 @@ static gboolean next_thumb(ViewCollection *vc)
 						make_path(fw->real_path, item->leafname));
 				view->thumb = pixmap_load_thumb(path);
 				g_free(path);
+				if (view->thumb)
+					queue_trim_thumbs(vc);
 			}
 
 			if (!view->image || view->thumb)
@@ -589,6 +617,41 @@ static gboolean next_thumb(ViewCollection *vc)
 	return TRUE;
 }
 
+/* Drop the thumbnails of items far from the screen if the window's
+ * thumbnails are using too much memory. They are loaded again if they are
+ * drawn again.
+ */
+static gboolean trim_thumbs(gpointer data)
+{
+	ViewCollection *vc = (ViewCollection *) data;
+	GArray *held;
+	int i;
+
+	vc->thumb_trim = 0;
+
+	held = view_trim_thumbs((ViewIface *) vc);
+	if (!held)
+		return FALSE;
+
+	for (i = 0; i < held->len; i++)
+	{
+		HeldThumb *h = &g_array_index(held, HeldThumb, i);
+
+		if (!*h->thumb)
+			((ViewData *) h->data)->iconstatus = 4;
+	}
+	g_array_free(held, TRUE);
+
+	return FALSE;
+}
+
+/* A thumbnail has been loaded; check the budget soon */
+static void queue_trim_thumbs(ViewCollection *vc)
+{
+	if (!vc->thumb_trim)
+		vc->thumb_trim = g_timeout_add(500, trim_thumbs, vc);
+}
+
 static void clear_thumb_func(ViewCollection *vc)
 {
 	if (vc->thumb_func)
@@ -639,6 +702,14 @@ static void draw_item(GtkWidget *widget,
 	if (view->iconstatus == 0) {
 		if (fw->display_style == HUGE_ICONS && fw->sort_type == SORT_NAME &&
 				vc->collection->vadj->value == 0) return;
+
+		/* Not restatted yet, but readdir() told us the type */
+		if (!view->image && item->hint_type != TYPE_UNKNOWN)
+		{
+			view->image = di_image(item);
+			if (view->image)
+				g_object_ref(view->image);
+		}
 		goto end_image;
 	}
 
@@ -716,6 +787,8 @@ static void draw_item(GtkWidget *widget,
 			gchar *path = pathdup(make_path(fw->real_path, item->leafname));
 			view->thumb = pixmap_load_thumb(path);
 			g_free(path);
+			if (view->thumb)
+				queue_trim_thumbs(vc);
 		}
 
 		if (!view->thumb && !view->image)
@@ -751,7 +824,9 @@ end_image:
 
 	GdkPixbuf *sendi = view->thumb;
 
-	if (!sendi && view->image)
+	if (sendi)
+		view->thumb_used = g_get_monotonic_time();
+	else if (view->image)
 	{
 		if (template.icon.width <= small_width &&
 				template.icon.height <= small_height)
@@ -1143,6 +1218,70 @@ static void view_collection_scroll_to_top(ViewIface *view)
 	gtk_adjustment_set_value(col->vadj, 0);
 }
 
+/* Append the items in this row to 'items' */
+static void add_row_items(Collection *collection, int row, GPtrArray *items)
+{
+	int col, item;
+
+	for (col = 0; ; col++)
+	{
+		if (!collection->vertical_order && col >= collection->columns)
+			break;
+		item = collection_rowcol_to_item(collection, row, col);
+		if (item >= collection->number_of_items)
+			break;
+		g_ptr_array_add(items, collection->items[item].data);
+	}
+}
+
+static gboolean view_collection_visible_rows(ViewIface *view,
+					     int *first, int *last, int *n_rows)
+{
+	Collection *collection = ((ViewCollection *) view)->collection;
+
+	if (!collection->number_of_items || !collection->item_height ||
+			!gtk_widget_get_realized(GTK_WIDGET(collection)))
+		return FALSE;
+
+	*n_rows = (collection->number_of_items + collection->columns - 1) /
+		collection->columns;
+	*first = MAX(collection->vadj->value / collection->item_height, 0);
+	*last = (collection->vadj->value + collection->vadj->page_size - 1) /
+		collection->item_height;
+	*last = MIN(*last, *n_rows - 1);
+
+	return *first <= *last;
+}
+
+static void view_collection_row_items(ViewIface *view, int row,
+				      GPtrArray *items)
+{
+	add_row_items(((ViewCollection *) view)->collection, row, items);
+}
+
+static void view_collection_held_thumbs(ViewIface *view, GArray *held,
+					int near_first, int near_last)
+{
+	Collection *collection = ((ViewCollection *) view)->collection;
+	int row, col, i;
+
+	for (i = 0; i < collection->number_of_items; i++)
+	{
+		ViewData *view_data = collection->items[i].view_data;
+		HeldThumb h;
+
+		if (!view_data || !view_data->thumb)
+			continue;
+
+		collection_item_to_rowcol(collection, i, &row, &col);
+		h.thumb = &view_data->thumb;
+		h.used = view_data->thumb_used;
+		h.near = row >= near_first && row <= near_last;
+		h.data = view_data;
+		g_array_append_val(held, h);
+	}
+}
+
 /* Create the handers for the View interface */
 static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 {
@@ -1177,6 +1316,9 @@ static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_collection_extend_tip;
 	iface->auto_scroll_callback = view_collection_auto_scroll_callback;
 	iface->scroll_to_top = view_collection_scroll_to_top;
+	iface->visible_rows = view_collection_visible_rows;
+	iface->row_items = view_collection_row_items;
+	iface->held_thumbs = view_collection_held_thumbs;
 }
 
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
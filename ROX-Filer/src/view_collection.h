@@ -26,6 +26,7 @@ struct _ViewCollection {
 
 	GQueue		*thumbs_queue;
 	guint		thumb_func;
+	guint		thumb_trim;	/* See queue_trim_thumbs() */
 };
 
 #endif /* __VIEW_COLLECTION_H__ */
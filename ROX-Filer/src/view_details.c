@@ -406,7 +406,12 @@ static void details_get_value(GtkTreeModel *tree_model,
 			break;
 		case COL_SIZE:
 			g_value_init(value, G_TYPE_STRING);
-			g_value_set_string(value, format_size(item->size));
+			if (item->flags & ITEM_FLAG_MORE_ITEMS)
+				g_value_take_string(value, g_strdup_printf(
+						"%" SIZE_FMT " +", item->size));
+			else
+				g_value_set_string(value,
+						format_size(item->size));
 			break;
 		case COL_TYPE:
 			g_value_init(value, G_TYPE_STRING);
@@ -966,6 +971,13 @@ static void view_details_destroy(GtkObject *obj)
 	view_details->filer_window = NULL;
 	cancel_wink(view_details);
 
+	if (view_details->thumb_trim)
+	{
+		g_source_remove(view_details->thumb_trim);
+		view_details->thumb_trim = 0;
+	}
+	pixmap_held_thumbs_gone(view_details);
+
 	(*GTK_OBJECT_CLASS(parent_class)->destroy)(obj);
 }
 
@@ -1170,6 +1182,57 @@ static void view_details_scroll_to_top(ViewIface *view)
 			0);
 }
 
+static gboolean view_details_visible_rows(ViewIface *view,
+					  int *first, int *last, int *n_rows)
+{
+	ViewDetails *view_details = (ViewDetails *) view;
+	GtkTreePath *start, *end;
+
+	if (!gtk_tree_view_get_visible_range((GtkTreeView *) view,
+				&start, &end))
+		return FALSE;
+	*first = gtk_tree_path_get_indices(start)[0];
+	*last = gtk_tree_path_get_indices(end)[0];
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+
+	*n_rows = view_details->items->len;
+	*last = MIN(*last, *n_rows - 1);
+
+	return *first <= *last;
+}
+
+static void view_details_row_items(ViewIface *view, int row,
+				   GPtrArray *items)
+{
+	ViewDetails *view_details = (ViewDetails *) view;
+
+	g_ptr_array_add(items,
+		((ViewItem *) view_details->items->pdata[row])->item);
+}
+
+static void view_details_held_thumbs(ViewIface *view, GArray *held,
+				     int near_first, int near_last)
+{
+	ViewDetails *view_details = (ViewDetails *) view;
+	int i;
+
+	for (i = 0; i < view_details->items->len; i++)
+	{
+		ViewItem *view_item = view_details->items->pdata[i];
+		HeldThumb h;
+
+		if (!view_item->thumb)
+			continue;
+
+		h.thumb = &view_item->thumb;
+		h.used = view_item->thumb_used;
+		h.near = i >= near_first && i <= near_last;
+		h.data = view_item;
+		g_array_append_val(held, h);
+	}
+}
+
 
 #define ADD_TEXT_COLUMN_NS(name, model_column) \
 	cell = gtk_cell_renderer_text_new();	\
@@ -1203,6 +1266,7 @@ static void view_details_init(GTypeInstance *object, gpointer gclass)
 	view_details->desired_size.height = -1;
 	view_details->can_change_selection = 0;
 	view_details->lasso_box = FALSE;
+	view_details->thumb_trim = 0;
 
 	view_details->selection = gtk_tree_view_get_selection(treeview);
 	gtk_tree_selection_set_mode(view_details->selection,
@@ -1308,6 +1372,9 @@ static void view_details_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_details_extend_tip;
 	iface->auto_scroll_callback = view_details_auto_scroll_callback;
 	iface->scroll_to_top = view_details_scroll_to_top;
+	iface->visible_rows = view_details_visible_rows;
+	iface->row_items = view_details_row_items;
+	iface->held_thumbs = view_details_held_thumbs;
 }
 
 
@@ -1459,6 +1526,7 @@ static void view_details_add_items(ViewIface *view, GPtrArray *new_items)
 		vitem->item = item;
 		vitem->image = NULL;
 		vitem->thumb = NULL;
+		vitem->thumb_used = 0;
 		if (!g_utf8_validate(leafname, -1, NULL))
 			vitem->utf8_name = to_utf8(leafname);
 		else
@@ -2168,6 +2236,32 @@ static void make_iter(ViewDetails *view_details, ViewIter *iter,
 		iter->n_remaining = view_details->items->len;
 }
 
+/* Drop the thumbnails of rows far from the screen if the window's
+ * thumbnails are using too much memory. The icon cell loads them again if
+ * they are drawn again.
+ */
+static gboolean trim_thumbs(gpointer data)
+{
+	ViewDetails *view_details = (ViewDetails *) data;
+	GArray *held;
+
+	view_details->thumb_trim = 0;
+
+	held = view_trim_thumbs((ViewIface *) view_details);
+	if (held)
+		g_array_free(held, TRUE);
+
+	return FALSE;
+}
+
+/* The icon cell has loaded a thumbnail; check the budget soon */
+void view_details_thumb_loaded(ViewDetails *view_details)
+{
+	if (!view_details->thumb_trim)
+		view_details->thumb_trim = g_timeout_add(500, trim_thumbs,
+							 view_details);
+}
+
 static void free_view_item(ViewItem *view_item)
 {
 	if (view_item->image)
@@ -16,6 +16,7 @@ struct _ViewItem {
 	DirItem *item;
 	MaskedPixmap *image;
 	GdkPixbuf *thumb;
+	gint64	thumb_used;	/* When thumb was last drawn */
 	int	old_pos;	/* Used while sorting */
 	gchar   *utf8_name;	/* NULL => leafname is valid */
 };
@@ -65,6 +66,8 @@ struct _ViewDetails {
 	int		drag_box_y[2];
 
 	GtkTreeViewColumn *cols[N_COLUMNS];
+
+	guint		thumb_trim;	/* See view_details_thumb_loaded() */
 };
 
 
@@ -73,5 +76,6 @@ struct _ViewDetails {
 
 GtkWidget *view_details_new(FilerWindow *filer_window);
 GType view_details_get_type(void);
+void view_details_thumb_loaded(ViewDetails *view_details);
 
 #endif /* __VIEW_DETAILS_H__ */
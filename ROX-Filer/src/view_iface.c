@@ -27,6 +27,7 @@
 
 #include "view_iface.h"
 #include "diritem.h"
+#include "pixmaps.h"
 
 /* A word about interfaces:
  *
@@ -419,3 +420,70 @@ void view_scroll_to_top(ViewIface *obj)
 	VIEW_IFACE_GET_CLASS(obj)->scroll_to_top(obj);
 }
 
+/* Append the items on screen to 'items', followed by those within a
+ * screenful above and below, nearest first. Used to decide what to
+ * restat and thumbnail first.
+ * If 'direction' is positive (scrolling down) the screenful below comes
+ * before the one above; if negative, the other way round. If 0, they are
+ * interleaved.
+ */
+void view_visible_items(ViewIface *obj, GPtrArray *items, int direction)
+{
+	ViewIfaceClass *iface;
+	int first, last, n_rows, page, row;
+
+	g_return_if_fail(VIEW_IS_IFACE(obj));
+
+	iface = VIEW_IFACE_GET_CLASS(obj);
+	if (!iface->visible_rows(obj, &first, &last, &n_rows))
+		return;
+	page = last - first + 1;
+
+	for (row = first; row <= last; row++)
+		iface->row_items(obj, row, items);
+
+	for (row = 1; row <= page; row++)
+	{
+		if (direction >= 0 && last + row < n_rows)
+			iface->row_items(obj, last + row, items);
+		if (direction <= 0 && first - row >= 0)
+			iface->row_items(obj, first - row, items);
+	}
+
+	/* Then the screenful we're moving away from */
+	for (row = 1; direction && row <= page; row++)
+	{
+		if (direction < 0 && last + row < n_rows)
+			iface->row_items(obj, last + row, items);
+		if (direction > 0 && first - row >= 0)
+			iface->row_items(obj, first - row, items);
+	}
+}
+
+/* Drop the thumbnails of items more than a screenful from the screen if
+ * the view's thumbnails are using too much memory (see
+ * pixmap_trim_held_thumbs()). Returns all the view's thumbnails
+ * (HeldThumb), the dropped ones with *thumb now NULL, so that the view can
+ * load them again if they are drawn; g_array_free() it. NULL if we can't
+ * tell what's near.
+ */
+GArray *view_trim_thumbs(ViewIface *obj)
+{
+	ViewIfaceClass *iface;
+	int first, last, n_rows, page;
+	GArray *held;
+
+	g_return_val_if_fail(VIEW_IS_IFACE(obj), NULL);
+
+	iface = VIEW_IFACE_GET_CLASS(obj);
+	if (!iface->visible_rows(obj, &first, &last, &n_rows))
+		return NULL;
+	page = last - first + 1;
+
+	held = g_array_new(FALSE, FALSE, sizeof(HeldThumb));
+	iface->held_thumbs(obj, held, first - page, last + page);
+	pixmap_trim_held_thumbs(obj, held);
+
+	return held;
+}
+
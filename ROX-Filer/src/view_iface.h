@@ -92,6 +92,11 @@ struct _ViewIfaceClass {
 	void (*extend_tip)(ViewIface *obj, ViewIter *iter, GString *tip);
 	gboolean (*auto_scroll_callback)(ViewIface *obj);
 	void (*scroll_to_top)(ViewIface *obj);
+	gboolean (*visible_rows)(ViewIface *obj, int *first, int *last,
+				 int *n_rows);
+	void (*row_items)(ViewIface *obj, int row, GPtrArray *items);
+	void (*held_thumbs)(ViewIface *obj, GArray *held,
+			    int near_first, int near_last);
 };
 
 #define VIEW_TYPE_IFACE           (view_iface_get_type())
@@ -152,5 +157,7 @@ void view_start_lasso_box(ViewIface *obj, GdkEventButton *event);
 void view_extend_tip(ViewIface *obj, ViewIter *iter, GString *tip);
 gboolean view_auto_scroll_callback(ViewIface *obj);
 void view_scroll_to_top(ViewIface *obj);
+void view_visible_items(ViewIface *obj, GPtrArray *items, int direction);
+GArray *view_trim_thumbs(ViewIface *obj);
 
 #endif /* __VIEW_IFACE_H__ */
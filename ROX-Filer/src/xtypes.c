@@ -49,6 +49,9 @@ Option o_xattr_ignore;
 
 #define RETURN_IF_IGNORED(val) if(o_xattr_ignore.int_value) return (val)
 
+static MIME_type *type_from_attr(gchar *buf);
+static GdkColor *label_from_attr(gchar *buf);
+
 #if defined(HAVE_GETXATTR)
 /* Linux implementation */
 
@@ -63,6 +66,14 @@ static ssize_t (*dyn_listxattr)(const char *path, char *list,
 static int (*dyn_removexattr)(const char *path,
 		const char *name) = NULL;
 
+/* Filesystems which said they don't support xattrs, by st_dev. Only ever
+ * appended to, so it can be read without taking m_unsupported.
+ */
+#define MAX_UNSUPPORTED_DEVS 32
+static dev_t unsupported_devs[MAX_UNSUPPORTED_DEVS];
+static gint n_unsupported_devs = 0;
+static GMutex m_unsupported;
+
 void xattr_init(void)
 {
 	void *libc;
@@ -134,6 +145,22 @@ gchar *xattr_get(const char *path, const char *attr, int *len)
 	if (!dyn_getxattr)
 		return NULL;
 
+	/* Most values are short, so try to get it in one call */
+	{
+		char small[256];
+
+		size = dyn_getxattr(path, attr, small, sizeof(small) - 1);
+		if (size >= 0)
+		{
+			small[size] = '\0';
+			if (len)
+				*len = (int) size;
+			return size ? g_memdup(small, size + 1) : NULL;
+		}
+		if (errno != ERANGE)
+			return NULL;
+	}
+
 	size = dyn_getxattr(path, attr, "", 0);
 	if (size > 0)
 	{
@@ -199,6 +226,94 @@ int xattr_rem(const char *path, const char *attr)
 	return dyn_removexattr(path, attr);
 }
 
+static gboolean dev_unsupported(dev_t dev)
+{
+	int i, n = g_atomic_int_get(&n_unsupported_devs);
+
+	for (i = 0; i < n; i++)
+		if (unsupported_devs[i] == dev)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void mark_dev_unsupported(dev_t dev)
+{
+	g_mutex_lock(&m_unsupported);
+	if (n_unsupported_devs < MAX_UNSUPPORTED_DEVS && !dev_unsupported(dev))
+	{
+		unsupported_devs[n_unsupported_devs] = dev;
+		g_atomic_int_inc(&n_unsupported_devs);
+	}
+	g_mutex_unlock(&m_unsupported);
+}
+
+/* TRUE if 'name' is in the NUL-separated list from listxattr() */
+static gboolean list_has(const char *list, ssize_t len, const char *name)
+{
+	const char *end = list + len;
+
+	while (list < end)
+	{
+		if (strcmp(list, name) == 0)
+			return TRUE;
+		list += strlen(list) + 1;
+	}
+
+	return FALSE;
+}
+
+void xattr_probe(const char *path, const struct stat *info, XAttrProbe *probe)
+{
+	char list[1024];
+	ssize_t len;
+	gboolean want_type = TRUE, want_label = TRUE;
+
+	probe->have = FALSE;
+	probe->type = NULL;
+	probe->label = NULL;
+
+	if (o_xattr_ignore.int_value || !dyn_listxattr)
+		return;
+
+	/* listxattr() follows symlinks, so the link's st_dev tells us
+	 * nothing about the target's filesystem.
+	 */
+	if (info && S_ISLNK(info->st_mode))
+		info = NULL;
+
+	if (info && dev_unsupported(info->st_dev))
+		return;
+
+	errno = 0;
+	len = dyn_listxattr(path, list, sizeof(list));
+	if (len < 0)
+	{
+		int err = errno;
+
+		if (err == ENOTSUP && info)
+			mark_dev_unsupported(info->st_dev);
+		if (err != ERANGE)
+			return;
+		/* Too many to list here; just ask for the ones we want */
+	}
+	else if (len == 0)
+		return;
+	else
+	{
+		want_type = list_has(list, len, XATTR_MIME_TYPE);
+		want_label = list_has(list, len, XATTR_LABEL);
+	}
+
+	probe->have = TRUE;
+	if (want_type)
+		probe->type = type_from_attr(
+				xattr_get(path, XATTR_MIME_TYPE, NULL));
+	if (want_label)
+		probe->label = label_from_attr(
+				xattr_get(path, XATTR_LABEL, NULL));
+}
+
 #elif defined(HAVE_ATTROPEN)
 
 /* Solaris 9 implementation */
@@ -354,14 +469,21 @@ int xattr_rem(const char *path, const char *attr)
 }
 #endif
 
-MIME_type *xtype_get(const char *path)
+#if !defined(HAVE_GETXATTR)
+void xattr_probe(const char *path, const struct stat *info, XAttrProbe *probe)
+{
+	probe->have = xattr_have(path);
+	probe->type = probe->have ? xtype_get(path) : NULL;
+	probe->label = probe->have ? xlabel_get(path) : NULL;
+}
+#endif
+
+/* Parses and frees a XATTR_MIME_TYPE value */
+static MIME_type *type_from_attr(gchar *buf)
 {
 	MIME_type *type = NULL;
-	gchar *buf;
 	char *nl;
 
-	buf = xattr_get(path, XATTR_MIME_TYPE, NULL);
-
 	if(buf)
 	{
 		nl = strchr(buf, '\n');
@@ -373,6 +495,11 @@ MIME_type *xtype_get(const char *path)
 	return type;
 }
 
+MIME_type *xtype_get(const char *path)
+{
+	return type_from_attr(xattr_get(path, XATTR_MIME_TYPE, NULL));
+}
+
 int xtype_set(const char *path, const MIME_type *type)
 {
 	int res;
@@ -392,14 +519,13 @@ int xtype_set(const char *path, const MIME_type *type)
 }
 
 /* Label support */
-GdkColor *xlabel_get(const char *path)
+
+/* Parses and frees a XATTR_LABEL value */
+static GdkColor *label_from_attr(gchar *buf)
 {
 	GdkColor *col = NULL;
-	gchar *buf;
 	char *nl;
 
-	buf = xattr_get(path, XATTR_LABEL, NULL);
-
 	if(buf)
 	{
 		nl = strchr(buf, '\n');
@@ -415,6 +541,11 @@ GdkColor *xlabel_get(const char *path)
 	return col;
 }
 
+GdkColor *xlabel_get(const char *path)
+{
+	return label_from_attr(xattr_get(path, XATTR_LABEL, NULL));
+}
+
 /* Extended attributes browser */
 #if defined(HAVE_GETXATTR) /* Linux-only for now */
 
@@ -8,6 +8,8 @@
 #ifndef _XTYPES_H
 #define _XTYPES_H
 
+#include <sys/stat.h>
+
 /* Know attribute names */
 #define XATTR_MIME_TYPE "user.mime_type"
 #define XATTR_HIDDEN    "user.hidden"
@@ -16,6 +18,14 @@
 /* If set, do not use extended attributes */
 extern Option o_xattr_ignore;    /* Set up in xattr_init() */
 
+/* What xattr_probe() found out about a file */
+typedef struct _XAttrProbe XAttrProbe;
+struct _XAttrProbe {
+	gboolean	have;	/* It has some extended attributes */
+	MIME_type	*type;	/* From XATTR_MIME_TYPE, or NULL */
+	GdkColor	*label;	/* From XATTR_LABEL, or NULL; g_free() it */
+};
+
 /* Prototypes */
 void xattr_init(void);
 
@@ -30,6 +40,14 @@ int xattr_rem(const char *path,
 		const char *attr);
 void xattr_copy(const char *src_path, const char *dest_path);
 
+/* xattr_have(), xtype_get() and xlabel_get() together, with one
+ * listxattr() for a file without attributes. 'info' is path's lstat(),
+ * or NULL; filesystems without xattr support are then remembered by
+ * st_dev and not asked again.
+ */
+void xattr_probe(const char *path, const struct stat *info,
+		 XAttrProbe *probe);
+
 MIME_type *xtype_get(const char *path);
 int xtype_set(const char *path, const MIME_type *type);
 